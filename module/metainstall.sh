@@ -16,4 +16,10 @@ ui_print "- Using Hymo metainstall"
 # Standard installation (extracts to /data/adb/modules/hymo)
 install_module
 
+# Build the next boot's image in the background, outside metamount's timeout
+HYMOD="/data/adb/modules/hymo/hymod"
+if [ -x "$HYMOD" ]; then
+    setsid "$HYMOD" config prebuild-image >/dev/null 2>&1 &
+fi
+
 ui_print "- Installation complete"
\ No newline at end of file
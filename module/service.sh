@@ -0,0 +1,15 @@
+#!/system/bin/sh
+# Hymo service.sh: once boot has completed, build the image the next boot will
+# mount (hymod config prebuild-image), so metamount only has to mount it.
+
+MODDIR="${0%/*}"
+
+[ -f "$MODDIR/hymod" ] || exit 0
+
+(
+    until [ "$(getprop sys.boot_completed)" = "1" ]; do
+        sleep 5
+    done
+    "$MODDIR/hymod" config prebuild-image >/dev/null 2>&1
+) &
+exit 0
@@ -51,6 +51,13 @@ Config Config::from_file(const fs::path& path) {
                 config.verbose = o.at("verbose").as_bool();
             if (o.count("fs_type"))
                 config.fs_type = filesystem_type_from_string(o.at("fs_type").as_string());
+            if (o.count("spill_threshold_mb"))
+                config.spill_threshold_mb =
+                    static_cast<int>(o.at("spill_threshold_mb").as_number());
+            if (o.count("sync_engine"))
+                config.sync_engine = o.at("sync_engine").as_string();
+            if (o.count("erofs_per_module"))
+                config.erofs_per_module = o.at("erofs_per_module").as_bool();
             if (o.count("disable_umount"))
                 config.disable_umount = o.at("disable_umount").as_bool();
             if (o.count("enable_nuke"))
@@ -106,6 +113,9 @@ bool Config::save_to_file(const fs::path& path) const {
     root["debug"] = json::Value(debug);
     root["verbose"] = json::Value(verbose);
     root["fs_type"] = json::Value(filesystem_type_to_string(fs_type));
+    root["spill_threshold_mb"] = json::Value(spill_threshold_mb);
+    root["sync_engine"] = json::Value(sync_engine);
+    root["erofs_per_module"] = json::Value(erofs_per_module);
     root["disable_umount"] = json::Value(disable_umount);
     root["enable_nuke"] = json::Value(enable_nuke);
     root["ignore_protocol_mismatch"] = json::Value(ignore_protocol_mismatch);
@@ -15,7 +15,7 @@ struct ModuleRuleConfig {
     std::string mode;
 };
 
-enum class FilesystemType { AUTO, EXT4, EROFS_FS, TMPFS };
+enum class FilesystemType { AUTO, EXT4, EROFS_FS, TMPFS, HYBRID };
 
 // Convert string to FilesystemType
 inline FilesystemType filesystem_type_from_string(const std::string& str) {
@@ -25,6 +25,8 @@ inline FilesystemType filesystem_type_from_string(const std::string& str) {
         return FilesystemType::EROFS_FS;
     if (str == "tmpfs")
         return FilesystemType::TMPFS;
+    if (str == "hybrid")
+        return FilesystemType::HYBRID;
     return FilesystemType::AUTO;
 }
 
@@ -37,6 +39,8 @@ inline std::string filesystem_type_to_string(FilesystemType type) {
         return "erofs";
     case FilesystemType::TMPFS:
         return "tmpfs";
+    case FilesystemType::HYBRID:
+        return "hybrid";
     default:
         return "auto";
     }
@@ -49,6 +53,9 @@ struct Config {
     bool debug = false;
     bool verbose = false;
     FilesystemType fs_type = FilesystemType::AUTO;
+    int spill_threshold_mb = 8;  // hybrid: modules larger than this skip the tmpfs tier
+    std::string sync_engine = "sync";  // "sync" or "uring" (batched io_uring copies)
+    bool erofs_per_module = false;     // erofs: one image per module instead of one for all
     bool disable_umount = false;
     bool enable_nuke = true;
     bool ignore_protocol_mismatch = false;
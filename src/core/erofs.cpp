@@ -0,0 +1,1246 @@
+// core/erofs.cpp - Native EROFS image writer
+#include "erofs.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../utils.hpp"
+#include "manifest.hpp"
+
+namespace hymo {
+
+namespace {
+
+// On-disk format constants (see erofs_fs.h in the kernel)
+constexpr uint32_t BLOCK_SIZE = 4096;
+constexpr uint8_t BLOCK_BITS = 12;
+constexpr uint32_t SUPERBLOCK_OFFSET = 1024;
+constexpr uint32_t SUPERBLOCK_SIZE = 128;
+constexpr uint32_t EROFS_MAGIC = 0xE0F5E1E2;
+constexpr uint32_t FEATURE_INCOMPAT_ZERO_PADDING = 0x1;
+
+constexpr uint16_t LAYOUT_FLAT_PLAIN = 0;
+constexpr uint16_t LAYOUT_COMPRESSED_FULL = 1;
+constexpr uint16_t LAYOUT_FLAT_INLINE = 2;
+
+constexpr uint32_t COMPACT_INODE_SIZE = 32;
+constexpr uint32_t EXTENDED_INODE_SIZE = 64;
+constexpr uint32_t INODE_SLOT_SIZE = 32;  // nid granularity
+constexpr uint32_t DIRENT_SIZE = 12;
+constexpr uint32_t XATTR_IBODY_HEADER_SIZE = 12;
+constexpr uint32_t XATTR_ENTRY_SIZE = 4;
+constexpr uint32_t MAP_HEADER_SIZE = 16;  // z_erofs_map_header + legacy padding
+constexpr uint32_t LCLUSTER_INDEX_SIZE = 8;
+
+constexpr uint16_t LCLUSTER_PLAIN = 0;
+constexpr uint16_t LCLUSTER_HEAD = 1;
+constexpr uint16_t LCLUSTER_NONHEAD = 2;
+constexpr uint32_t LCLUSTER_MAX_DELTA0 = (1u << 11) - 1;
+
+constexpr uint8_t FT_UNKNOWN = 0;
+constexpr uint8_t FT_REG_FILE = 1;
+constexpr uint8_t FT_DIR = 2;
+constexpr uint8_t FT_CHRDEV = 3;
+constexpr uint8_t FT_BLKDEV = 4;
+constexpr uint8_t FT_FIFO = 5;
+constexpr uint8_t FT_SOCK = 6;
+constexpr uint8_t FT_SYMLINK = 7;
+
+// A pcluster is one block; cap what a single one may decompress to
+constexpr uint32_t MAX_EXTENT_INPUT = 64 * BLOCK_SIZE;
+constexpr unsigned MAX_WRITER_THREADS = 8;
+// Compressed output the queue may hold for files not yet written out
+constexpr uint64_t MAX_QUEUED_BYTES = 32ULL * 1024 * 1024;
+constexpr size_t COPY_CHUNK = 128 * 1024;
+
+void put16(uint8_t* p, uint16_t v) {
+    p[0] = static_cast<uint8_t>(v);
+    p[1] = static_cast<uint8_t>(v >> 8);
+}
+
+void put32(uint8_t* p, uint32_t v) {
+    put16(p, static_cast<uint16_t>(v));
+    put16(p + 2, static_cast<uint16_t>(v >> 16));
+}
+
+void put64(uint8_t* p, uint64_t v) {
+    put32(p, static_cast<uint32_t>(v));
+    put32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+
+uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+uint64_t blocks_for(uint64_t size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// ---------------------------------------------------------------------------
+// LZ4 block compression
+// ---------------------------------------------------------------------------
+
+constexpr size_t LZ4_MIN_MATCH = 4;
+constexpr size_t LZ4_TAIL = 12;  // no match may end closer than this to the block end
+constexpr uint32_t LZ4_HASH_BITS = 12;
+constexpr size_t LZ4_MAX_DISTANCE = 65535;
+
+uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+size_t lz4_length_bytes(size_t length) {
+    return length >= 15 ? 1 + (length - 15) / 255 : 0;
+}
+
+uint8_t* lz4_put_length(uint8_t* op, size_t length) {
+    length -= 15;
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = static_cast<uint8_t>(length);
+    return op;
+}
+
+// Compresses the longest prefix of `src` that fits in `capacity` bytes, like
+// LZ4_compress_destSize() with a greedy single-probe matcher. The stream always
+// ends with at least LZ4_TAIL literals, which satisfies the format's end-of-block
+// rules. Returns the compressed size; `consumed` is the prefix length.
+size_t lz4_compress_prefix(const uint8_t* src, size_t src_len, uint8_t* dst, size_t capacity,
+                           size_t& consumed) {
+    constexpr size_t final_reserve = 1 + LZ4_TAIL;
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    if (src_len > LZ4_TAIL + LZ4_MIN_MATCH && capacity > final_reserve) {
+        std::vector<int32_t> table(1u << LZ4_HASH_BITS, -1);
+        const size_t match_limit = src_len - LZ4_TAIL;
+
+        while (ip + LZ4_MIN_MATCH <= match_limit) {
+            // Pending literals alone no longer fit
+            if (ip - anchor + final_reserve > capacity - op)
+                break;
+
+            uint32_t sequence = read32(src + ip);
+            uint32_t h = lz4_hash(sequence);
+            int32_t ref = table[h];
+            table[h] = static_cast<int32_t>(ip);
+            if (ref < 0 || ip - ref > LZ4_MAX_DISTANCE || read32(src + ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            size_t length = LZ4_MIN_MATCH;
+            while (ip + length < match_limit && src[ip + length] == src[ref + length])
+                length++;
+
+            size_t literals = ip - anchor;
+            size_t cost = 1 + lz4_length_bytes(literals) + literals + 2 +
+                          lz4_length_bytes(length - LZ4_MIN_MATCH);
+            if (op + cost + final_reserve > capacity)
+                break;
+
+            uint8_t* token = dst + op;
+            uint8_t* out = token + 1;
+            if (literals >= 15) {
+                *token = 15 << 4;
+                out = lz4_put_length(out, literals);
+            } else {
+                *token = static_cast<uint8_t>(literals << 4);
+            }
+            memcpy(out, src + anchor, literals);
+            out += literals;
+            put16(out, static_cast<uint16_t>(ip - ref));
+            out += 2;
+            size_t match_code = length - LZ4_MIN_MATCH;
+            if (match_code >= 15) {
+                *token |= 15;
+                out = lz4_put_length(out, match_code);
+            } else {
+                *token |= static_cast<uint8_t>(match_code);
+            }
+            op = out - dst;
+
+            ip += length;
+            anchor = ip;
+        }
+    }
+
+    // Trailing literals, trimmed to what still fits
+    size_t room = capacity - op;
+    size_t literals = src_len - anchor;
+    if (room == 0) {
+        literals = 0;
+    } else {
+        size_t fit = room - 1;
+        while (fit > 0 && 1 + lz4_length_bytes(fit) + fit > room)
+            fit--;
+        literals = std::min(literals, fit);
+    }
+
+    uint8_t* out = dst + op;
+    if (literals >= 15) {
+        *out++ = 15 << 4;
+        out = lz4_put_length(out, literals);
+    } else {
+        *out++ = static_cast<uint8_t>(literals << 4);
+    }
+    memcpy(out, src + anchor, literals);
+    out += literals;
+
+    consumed = anchor + literals;
+    return out - dst;
+}
+
+// ---------------------------------------------------------------------------
+// Source tree
+// ---------------------------------------------------------------------------
+
+struct Xattr {
+    uint8_t index;
+    std::string name;  // without the namespace prefix
+    std::string value;
+};
+
+struct DirEntry {
+    std::string name;
+    uint32_t node;
+};
+
+struct Node {
+    std::string path;  // empty for generated directories
+    uint32_t parent = 0;
+    struct stat st {};
+    uint32_t nlink = 1;
+    std::string link_target;
+    std::string digest;  // content hash, only computed for dedup candidates
+    std::vector<Xattr> xattrs;
+    std::vector<DirEntry> entries;  // directories: sorted, including "." and ".."
+    std::vector<size_t> dir_blocks;  // directories: first entry of each block
+
+    // Layout
+    uint64_t size = 0;
+    uint16_t layout = LAYOUT_FLAT_PLAIN;
+    bool extended = false;
+    uint32_t xattr_size = 0;
+    uint32_t blkaddr = 0;  // first data block
+    uint32_t compressed_blocks = 0;
+    std::vector<uint8_t> indexes;  // compressed: lcluster indexes
+    uint64_t meta_pos = 0;
+    uint32_t ino = 0;
+};
+
+uint8_t file_type(mode_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFREG:
+        return FT_REG_FILE;
+    case S_IFDIR:
+        return FT_DIR;
+    case S_IFCHR:
+        return FT_CHRDEV;
+    case S_IFBLK:
+        return FT_BLKDEV;
+    case S_IFIFO:
+        return FT_FIFO;
+    case S_IFSOCK:
+        return FT_SOCK;
+    case S_IFLNK:
+        return FT_SYMLINK;
+    default:
+        return FT_UNKNOWN;
+    }
+}
+
+constexpr uint8_t XATTR_INDEX_SECURITY = 6;
+
+void sort_xattrs(std::vector<Xattr>& xattrs) {
+    std::sort(xattrs.begin(), xattrs.end(), [](const Xattr& a, const Xattr& b) {
+        return a.index != b.index ? a.index < b.index : a.name < b.name;
+    });
+}
+
+// `follow` reads the xattrs of a symlink's target (followed directory symlinks)
+bool read_xattrs(const std::string& path, bool follow, std::vector<Xattr>& out) {
+    static const std::pair<const char*, uint8_t> prefixes[] = {
+        {"user.", 1},
+        {"trusted.", 4},
+        {"security.", XATTR_INDEX_SECURITY},
+    };
+    auto list = follow ? listxattr : llistxattr;
+    auto get = follow ? getxattr : lgetxattr;
+
+    ssize_t list_size = list(path.c_str(), nullptr, 0);
+    if (list_size <= 0)
+        return list_size == 0 || errno == ENOTSUP;
+
+    std::vector<char> names(list_size);
+    list_size = list(path.c_str(), names.data(), names.size());
+    if (list_size < 0)
+        return false;
+
+    for (ssize_t off = 0; off < list_size;) {
+        std::string name(names.data() + off);
+        off += name.size() + 1;
+
+        for (const auto& prefix : prefixes) {
+            size_t prefix_len = strlen(prefix.first);
+            if (name.compare(0, prefix_len, prefix.first) != 0 || name.size() == prefix_len)
+                continue;
+
+            ssize_t value_size = get(path.c_str(), name.c_str(), nullptr, 0);
+            if (value_size < 0)
+                return false;
+            std::string value(value_size, '\0');
+            if (value_size > 0 &&
+                get(path.c_str(), name.c_str(), &value[0], value.size()) != value_size)
+                return false;
+            out.push_back({prefix.second, name.substr(prefix_len), std::move(value)});
+            break;
+        }
+    }
+
+    sort_xattrs(out);
+    return true;
+}
+
+std::string file_digest(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return "";
+    Sha256 sha;
+    std::vector<uint8_t> buffer(COPY_CHUNK);
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0)
+        sha.update(buffer.data(), n);
+    close(fd);
+    return n < 0 ? "" : sha.hex_digest();
+}
+
+// ---------------------------------------------------------------------------
+// Compression workers
+// ---------------------------------------------------------------------------
+
+struct Extent {
+    uint32_t length;  // decompressed bytes
+    bool raw;
+};
+
+// Empty `blocks` with `ok` set means the file doesn't compress and is copied as is
+struct CompressedFile {
+    bool ok = false;
+    std::vector<uint8_t> blocks;  // one block per extent, ready to write
+    std::vector<Extent> extents;
+};
+
+// Fills `window` with the file bytes from `pos` on, up to MAX_EXTENT_INPUT of
+// them. Bytes already read past `pos` are kept, so every byte is read once.
+bool fill_window(int fd, uint64_t size, uint64_t pos, std::vector<uint8_t>& window,
+                 uint64_t& window_pos, size_t& window_len) {
+    size_t keep = pos < window_pos + window_len ? window_pos + window_len - pos : 0;
+    if (keep > 0 && pos != window_pos)
+        memmove(window.data(), window.data() + (pos - window_pos), keep);
+    window_pos = pos;
+    window_len = keep;
+
+    size_t want = static_cast<size_t>(std::min<uint64_t>(size - pos, MAX_EXTENT_INPUT));
+    while (window_len < want) {
+        ssize_t n = pread(fd, window.data() + window_len, want - window_len,
+                          static_cast<off_t>(pos + window_len));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        window_len += n;
+    }
+    return true;
+}
+
+// Reads and compresses one pcluster input window at a time, so only the output
+// blocks stay in memory
+void compress_file(const std::string& path, uint64_t size, CompressedFile& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    std::vector<uint8_t> window(MAX_EXTENT_INPUT);
+    uint64_t window_pos = 0;
+    size_t window_len = 0;
+    std::vector<uint8_t> buffer(BLOCK_SIZE);
+    uint64_t pos = 0;
+    while (pos < size) {
+        // Stored uncompressed anyway once the extents can't save a block
+        if (out.extents.size() + 1 >= blocks_for(size))
+            break;
+        if (!fill_window(fd, size, pos, window, window_pos, window_len)) {
+            close(fd);
+            return;
+        }
+
+        uint64_t remaining = size - pos;
+        size_t old_size = out.blocks.size();
+        out.blocks.resize(old_size + BLOCK_SIZE);
+        uint8_t* block = out.blocks.data() + old_size;
+
+        // Only clusters saving at least a block are stored compressed
+        if (remaining > BLOCK_SIZE) {
+            size_t input = window_len;
+            size_t consumed = 0;
+            size_t csize =
+                lz4_compress_prefix(window.data(), input, buffer.data(), BLOCK_SIZE, consumed);
+            if (consumed > BLOCK_SIZE) {
+                // Zero padding: data sits at the end of its block
+                memcpy(block + BLOCK_SIZE - csize, buffer.data(), csize);
+                out.extents.push_back({static_cast<uint32_t>(consumed), false});
+                pos += consumed;
+                continue;
+            }
+        }
+
+        uint32_t length = static_cast<uint32_t>(std::min<uint64_t>(remaining, BLOCK_SIZE));
+        memcpy(block, window.data(), length);
+        out.extents.push_back({length, true});
+        pos += length;
+    }
+    close(fd);
+
+    if (pos < size) {
+        out.blocks = std::vector<uint8_t>();
+        out.extents.clear();
+    }
+    out.ok = true;
+}
+
+// Compresses files on worker threads and hands the results out in job order.
+// A job only starts while the output held for untaken files (its size is
+// reserved up front) stays under MAX_QUEUED_BYTES; the oldest untaken job may
+// always run, and jobs start in order, so the consumer never waits forever.
+class CompressQueue {
+public:
+    CompressQueue(std::vector<std::pair<std::string, uint64_t>> jobs, unsigned threads)
+        : jobs_(std::move(jobs)), results_(jobs_.size()), window_(threads * 2) {
+        for (unsigned i = 0; i < threads && i < jobs_.size(); ++i) {
+            threads_.emplace_back(&CompressQueue::worker, this);
+        }
+    }
+
+    ~CompressQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    std::unique_ptr<CompressedFile> take(size_t index) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return results_[index] != nullptr; });
+        std::unique_ptr<CompressedFile> result = std::move(results_[index]);
+        taken_ = index + 1;
+        held_bytes_ -= result->blocks.size();
+        lock.unlock();
+        cv_.notify_all();
+        return result;
+    }
+
+private:
+    void worker() {
+        while (true) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&] {
+                    return stop_ || next_ >= jobs_.size() ||
+                           (next_ < taken_ + window_ &&
+                            (next_ == taken_ || held_bytes_ + reserve(next_) <= MAX_QUEUED_BYTES));
+                });
+                if (stop_ || next_ >= jobs_.size())
+                    return;
+                index = next_++;
+                held_bytes_ += reserve(index);
+            }
+
+            auto result = std::make_unique<CompressedFile>();
+            compress_file(jobs_[index].first, jobs_[index].second, *result);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                held_bytes_ = held_bytes_ - reserve(index) + result->blocks.size();
+                results_[index] = std::move(result);
+            }
+            cv_.notify_all();
+        }
+    }
+
+    // Compressed output never exceeds the block-aligned file size
+    uint64_t reserve(size_t index) const { return align_up(jobs_[index].second, BLOCK_SIZE); }
+
+    std::vector<std::pair<std::string, uint64_t>> jobs_;
+    std::vector<std::unique_ptr<CompressedFile>> results_;
+    size_t window_;
+    uint64_t held_bytes_ = 0;  // reserved by running jobs, held by untaken results
+    size_t next_ = 0;
+    size_t taken_ = 0;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::thread> threads_;
+};
+
+// Legacy (full) lcluster indexes for one compressed file, as mkfs.erofs writes them
+std::vector<uint8_t> build_indexes(const std::vector<Extent>& extents, uint32_t first_blkaddr) {
+    std::vector<uint8_t> out;
+    auto emit = [&out](uint16_t type, uint32_t clusterofs, uint32_t u) {
+        size_t at = out.size();
+        out.resize(at + LCLUSTER_INDEX_SIZE);
+        put16(&out[at], type);
+        put16(&out[at + 2], static_cast<uint16_t>(clusterofs));
+        put32(&out[at + 4], u);
+    };
+
+    uint32_t clusterofs = 0;
+    for (size_t i = 0; i < extents.size(); ++i) {
+        const Extent& e = extents[i];
+        uint16_t head_type = e.raw ? LCLUSTER_PLAIN : LCLUSTER_HEAD;
+        uint32_t blkaddr = first_blkaddr + static_cast<uint32_t>(i);
+        uint32_t count = e.length;
+        uint32_t d1 = (clusterofs + count) / BLOCK_SIZE;
+
+        // Tail extent within a single lcluster: no end marker follows
+        if (d1 == 0) {
+            emit(head_type, clusterofs, blkaddr);
+            clusterofs = 0;
+            continue;
+        }
+
+        uint32_t start_ofs = clusterofs;
+        uint32_t ofs = clusterofs;
+        uint32_t d0 = 0;
+        do {
+            if (d0 == 0) {
+                emit(head_type, start_ofs, blkaddr);
+            } else {
+                uint32_t delta0 = std::min(d0, LCLUSTER_MAX_DELTA0);
+                emit(LCLUSTER_NONHEAD, start_ofs, delta0 | (d1 << 16));
+            }
+            count -= BLOCK_SIZE - ofs;
+            ofs = 0;
+            ++d0;
+            --d1;
+        } while (ofs + count >= BLOCK_SIZE);
+        clusterofs = ofs + count;
+    }
+
+    if (clusterofs != 0)
+        emit(LCLUSTER_PLAIN, clusterofs, 0);
+    return out;
+}
+
+// ---------------------------------------------------------------------------
+// Image builder
+// ---------------------------------------------------------------------------
+
+constexpr uint32_t NO_NODE = UINT32_MAX;
+
+class ErofsBuilder {
+public:
+    ErofsBuilder(int fd, const ErofsWriterOptions& options) : fd_(fd), options_(options) {}
+
+    bool build(const std::vector<ErofsSource>& sources, bool source_root, ErofsWriterStats& stats);
+
+private:
+    bool scan(const std::string& path, std::string& device_path, uint32_t index,
+              const std::vector<std::string>& include);
+    bool add_node(const std::string& path, std::string& device_path, uint32_t parent,
+                  uint32_t& index);
+    uint32_t add_generated_dir(uint32_t parent);
+    void apply_overrides(Node& node, const std::string& device_path);
+    bool find_duplicate(const Node& node, uint32_t& index);
+    bool layout_dir(Node& node, uint32_t self);
+    uint32_t inode_size(const Node& node) const;
+    uint64_t record_size(const Node& node) const;
+    bool choose_inline(Node& node, uint64_t size);
+    bool write_data();
+    bool write_blocks(uint32_t blkaddr, const uint8_t* data, uint64_t size);
+    bool copy_file_blocks(const Node& node, uint32_t blkaddr, uint64_t size);
+    void layout_metadata();
+    bool write_metadata();
+    std::vector<uint8_t> dir_content(const Node& node) const;
+    bool inline_tail(const Node& node, uint8_t* out) const;
+    bool write_superblock();
+
+    int fd_;
+    ErofsWriterOptions options_;
+    std::vector<Node> nodes_;
+    std::map<std::pair<dev_t, ino_t>, uint32_t> hardlinks_;
+    std::map<std::string, std::vector<uint32_t>> dedup_groups_;
+    uint32_t next_block_ = 1;  // block 0 holds the superblock
+    uint32_t meta_blkaddr_ = 0;
+    uint64_t meta_size_ = 0;
+    uint64_t build_time_ = 0;
+    uint32_t build_time_nsec_ = 0;
+    bool compressed_ = false;
+    ErofsWriterStats stats_;
+};
+
+void ErofsBuilder::apply_overrides(Node& node, const std::string& device_path) {
+    if (options_.uid >= 0)
+        node.st.st_uid = static_cast<uid_t>(options_.uid);
+    if (options_.gid >= 0)
+        node.st.st_gid = static_cast<gid_t>(options_.gid);
+
+    if (options_.label) {
+        std::string context =
+            options_.label(device_path.empty() ? "/" : device_path, node.st.st_mode & S_IFMT);
+        node.xattrs.erase(std::remove_if(node.xattrs.begin(), node.xattrs.end(),
+                                         [](const Xattr& x) {
+                                             return x.index == XATTR_INDEX_SECURITY &&
+                                                    x.name == "selinux";
+                                         }),
+                          node.xattrs.end());
+        if (!context.empty())
+            node.xattrs.push_back({XATTR_INDEX_SECURITY, "selinux", context});
+        sort_xattrs(node.xattrs);
+    }
+}
+
+// An earlier file with the same content and metadata, hashing both on demand
+bool ErofsBuilder::find_duplicate(const Node& node, uint32_t& index) {
+    std::string key = std::to_string(node.st.st_size) + ":" + std::to_string(node.st.st_mode) +
+                      ":" + std::to_string(node.st.st_uid) + ":" + std::to_string(node.st.st_gid);
+    for (const auto& xattr : node.xattrs) {
+        key += ":" + std::to_string(xattr.index) + xattr.name + "=" + xattr.value;
+    }
+
+    std::vector<uint32_t>& group = dedup_groups_[key];
+    std::string digest;
+    for (uint32_t candidate : group) {
+        if (digest.empty())
+            digest = file_digest(node.path);
+        if (nodes_[candidate].digest.empty())
+            nodes_[candidate].digest = file_digest(nodes_[candidate].path);
+        if (!digest.empty() && digest == nodes_[candidate].digest) {
+            index = candidate;
+            return true;
+        }
+    }
+    group.push_back(static_cast<uint32_t>(nodes_.size()));
+    return false;
+}
+
+uint32_t ErofsBuilder::add_generated_dir(uint32_t parent) {
+    uint32_t index = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+    Node& node = nodes_.back();
+    node.parent = parent;
+    node.st.st_mode = S_IFDIR | 0755;
+    apply_overrides(node, "");
+    return index;
+}
+
+// `index` is NO_NODE for entries that are left out of the image
+bool ErofsBuilder::add_node(const std::string& path, std::string& device_path, uint32_t parent,
+                            uint32_t& index) {
+    index = NO_NODE;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        LOG_ERROR("EROFS writer: cannot stat " + path + ": " + strerror(errno));
+        return false;
+    }
+
+    // Directory symlinks are followed unless they stay inside the tree, in which
+    // case they are dropped (sync_dir() semantics)
+    bool follow = false;
+    if (S_ISLNK(st.st_mode)) {
+        struct stat target_st;
+        if (stat(path.c_str(), &target_st) == 0 && S_ISDIR(target_st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(path.c_str(), target, sizeof(target) - 1);
+            target[len < 0 ? 0 : len] = '\0';
+            if (is_subpath(target, path))
+                return true;
+            st = target_st;
+            follow = true;
+        }
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        auto it = hardlinks_.find({st.st_dev, st.st_ino});
+        if (it != hardlinks_.end()) {
+            index = it->second;
+            nodes_[index].nlink++;
+            return true;
+        }
+    }
+
+    Node node;
+    node.path = path;
+    node.parent = parent;
+    node.st = st;
+
+    if (S_ISLNK(st.st_mode)) {
+        std::vector<char> target(st.st_size > 0 ? st.st_size + 1 : PATH_MAX);
+        ssize_t len = readlink(path.c_str(), target.data(), target.size());
+        if (len < 0) {
+            LOG_ERROR("EROFS writer: cannot read link " + path + ": " + strerror(errno));
+            return false;
+        }
+        node.link_target.assign(target.data(), len);
+    }
+
+    if (!read_xattrs(path, follow, node.xattrs)) {
+        LOG_ERROR("EROFS writer: cannot read xattrs of " + path + ": " + strerror(errno));
+        return false;
+    }
+    apply_overrides(node, device_path);
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && options_.dedup &&
+        find_duplicate(node, index)) {
+        nodes_[index].nlink++;
+        stats_.deduped_files++;
+        stats_.deduped_bytes += st.st_size;
+        return true;
+    }
+
+    index = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(std::move(node));
+    if (S_ISREG(st.st_mode) && st.st_nlink > 1)
+        hardlinks_[{st.st_dev, st.st_ino}] = index;
+
+    if (S_ISDIR(st.st_mode))
+        return scan(path, device_path, index, {});
+    return true;
+}
+
+// Adds the entries of `path` (only those in `include`, if given) to dir `index`
+bool ErofsBuilder::scan(const std::string& path, std::string& device_path, uint32_t index,
+                        const std::vector<std::string>& include) {
+    std::vector<std::string> names;
+    if (include.empty()) {
+        DIR* dir = opendir(path.c_str());
+        if (!dir) {
+            LOG_ERROR("EROFS writer: cannot open " + path + ": " + strerror(errno));
+            return false;
+        }
+        while (struct dirent* entry = readdir(dir)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            names.emplace_back(entry->d_name);
+        }
+        closedir(dir);
+    } else {
+        for (const auto& name : include) {
+            struct stat st;
+            if (lstat((path + "/" + name).c_str(), &st) == 0)
+                names.push_back(name);
+        }
+    }
+    std::sort(names.begin(), names.end());
+
+    const size_t device_len = device_path.size();
+    std::vector<DirEntry> entries;
+    for (const auto& name : names) {
+        device_path.append("/").append(name);
+        uint32_t child;
+        bool ok = add_node(path + "/" + name, device_path, index, child);
+        device_path.resize(device_len);
+        if (!ok)
+            return false;
+        if (child != NO_NODE)
+            entries.push_back({name, child});
+    }
+
+    auto& existing = nodes_[index].entries;
+    existing.insert(existing.end(), entries.begin(), entries.end());
+    return true;
+}
+
+// Sorts the entries (lookups binary-search names across blocks) and packs them
+bool ErofsBuilder::layout_dir(Node& node, uint32_t self) {
+    uint32_t subdirs = 0;
+    for (const auto& entry : node.entries) {
+        if (S_ISDIR(nodes_[entry.node].st.st_mode))
+            subdirs++;
+    }
+    node.nlink = 2 + subdirs;
+
+    node.entries.push_back({".", self});
+    node.entries.push_back({"..", node.parent});
+    std::sort(node.entries.begin(), node.entries.end(),
+              [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+
+    uint64_t used = BLOCK_SIZE;
+    for (size_t i = 0; i < node.entries.size(); ++i) {
+        // Sources merged into one directory must not collide
+        if (i > 0 && node.entries[i].name == node.entries[i - 1].name) {
+            LOG_ERROR("EROFS writer: duplicate entry " + node.entries[i].name);
+            return false;
+        }
+        uint64_t need = DIRENT_SIZE + node.entries[i].name.size();
+        if (used + need > BLOCK_SIZE) {
+            node.dir_blocks.push_back(i);
+            used = 0;
+        }
+        used += need;
+    }
+    node.size = (node.dir_blocks.size() - 1) * static_cast<uint64_t>(BLOCK_SIZE) + used;
+    return true;
+}
+
+uint32_t ErofsBuilder::inode_size(const Node& node) const {
+    return node.extended ? EXTENDED_INODE_SIZE : COMPACT_INODE_SIZE;
+}
+
+uint64_t ErofsBuilder::record_size(const Node& node) const {
+    uint64_t base = inode_size(node) + node.xattr_size;
+    switch (node.layout) {
+    case LAYOUT_FLAT_INLINE:
+        return base + node.size % BLOCK_SIZE;
+    case LAYOUT_COMPRESSED_FULL:
+        return align_up(base, 8) + MAP_HEADER_SIZE + node.indexes.size();
+    default:
+        return base;
+    }
+}
+
+// Tails go right after the inode when inode, xattrs and tail share one block
+bool ErofsBuilder::choose_inline(Node& node, uint64_t size) {
+    uint64_t tail = size % BLOCK_SIZE;
+    node.layout = LAYOUT_FLAT_PLAIN;
+    if (tail != 0 && inode_size(node) + node.xattr_size + tail <= BLOCK_SIZE)
+        node.layout = LAYOUT_FLAT_INLINE;
+    return node.layout == LAYOUT_FLAT_INLINE;
+}
+
+bool ErofsBuilder::write_blocks(uint32_t blkaddr, const uint8_t* data, uint64_t size) {
+    uint64_t offset = static_cast<uint64_t>(blkaddr) * BLOCK_SIZE;
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd_, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOG_ERROR("EROFS writer: write failed: " + std::string(strerror(errno)));
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool ErofsBuilder::copy_file_blocks(const Node& node, uint32_t blkaddr, uint64_t size) {
+    int in = open(node.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        LOG_ERROR("EROFS writer: cannot open " + node.path + ": " + strerror(errno));
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(COPY_CHUNK);
+    uint64_t done = 0;
+    bool ok = true;
+    while (ok && done < size) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(COPY_CHUNK, size - done));
+        ssize_t n = pread(in, buffer.data(), want, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            LOG_ERROR("EROFS writer: short read on " + node.path);
+            ok = false;
+            break;
+        }
+        // The last block is zero padded
+        size_t out = static_cast<size_t>(n);
+        if (done + n == size && out % BLOCK_SIZE != 0) {
+            size_t padded = align_up(out, BLOCK_SIZE);
+            memset(buffer.data() + out, 0, padded - out);
+            out = padded;
+        }
+        ok = write_blocks(blkaddr + static_cast<uint32_t>(done / BLOCK_SIZE), buffer.data(), out);
+        done += n;
+    }
+    close(in);
+    return ok;
+}
+
+bool ErofsBuilder::write_data() {
+    std::vector<std::pair<std::string, uint64_t>> jobs;
+    if (options_.compress) {
+        for (const auto& node : nodes_) {
+            if (S_ISREG(node.st.st_mode) && static_cast<uint64_t>(node.st.st_size) > BLOCK_SIZE)
+                jobs.emplace_back(node.path, node.st.st_size);
+        }
+    }
+
+    unsigned threads = options_.threads;
+    if (threads == 0) {
+        unsigned cpus = std::thread::hardware_concurrency();
+        threads = cpus == 0 ? 2 : std::min(cpus, MAX_WRITER_THREADS);
+    }
+    CompressQueue queue(std::move(jobs), threads);
+    size_t next_job = 0;
+
+    for (auto& node : nodes_) {
+        mode_t type = node.st.st_mode & S_IFMT;
+        node.blkaddr = next_block_;
+
+        if (type == S_IFREG) {
+            node.size = node.st.st_size;
+            stats_.files++;
+            stats_.data_bytes += node.size;
+
+            std::unique_ptr<CompressedFile> compressed;
+            if (options_.compress && node.size > BLOCK_SIZE) {
+                compressed = queue.take(next_job++);
+                if (!compressed->ok) {
+                    LOG_ERROR("EROFS writer: cannot read " + node.path);
+                    return false;
+                }
+                if (!compressed->blocks.empty()) {
+                    node.layout = LAYOUT_COMPRESSED_FULL;
+                    node.compressed_blocks = static_cast<uint32_t>(compressed->extents.size());
+                    node.indexes = build_indexes(compressed->extents, next_block_);
+                    if (!write_blocks(next_block_, compressed->blocks.data(),
+                                      compressed->blocks.size()))
+                        return false;
+                    next_block_ += node.compressed_blocks;
+                    compressed_ = true;
+                    stats_.compressed_files++;
+                    continue;
+                }
+            }
+
+            uint64_t stored = choose_inline(node, node.size)
+                                  ? node.size / BLOCK_SIZE * BLOCK_SIZE
+                                  : node.size;
+            if (stored == 0)
+                continue;
+            if (!copy_file_blocks(node, next_block_, stored))
+                return false;
+            next_block_ += static_cast<uint32_t>(blocks_for(stored));
+        } else if (type == S_IFLNK) {
+            node.size = node.link_target.size();
+            if (!choose_inline(node, node.size)) {
+                std::vector<uint8_t> block(align_up(node.size, BLOCK_SIZE), 0);
+                memcpy(block.data(), node.link_target.data(), node.size);
+                if (!write_blocks(next_block_, block.data(), block.size()))
+                    return false;
+                next_block_ += static_cast<uint32_t>(blocks_for(node.size));
+            }
+        } else if (type == S_IFDIR) {
+            // Filled in once nids are known
+            uint64_t stored = choose_inline(node, node.size)
+                                  ? node.size / BLOCK_SIZE * BLOCK_SIZE
+                                  : node.size;
+            next_block_ += static_cast<uint32_t>(blocks_for(stored));
+        } else {
+            node.size = 0;
+            node.layout = LAYOUT_FLAT_PLAIN;
+            node.blkaddr = 0;
+        }
+    }
+    return true;
+}
+
+// Metadata follows the data; the root inode goes first so its nid fits the
+// 16-bit superblock field
+void ErofsBuilder::layout_metadata() {
+    meta_blkaddr_ = next_block_;
+    uint64_t pos = 0;
+    uint32_t ino = 1;
+    for (auto& node : nodes_) {
+        uint64_t record = record_size(node);
+        uint64_t head = align_up(inode_size(node) + node.xattr_size, 8) +
+                        (node.layout == LAYOUT_COMPRESSED_FULL ? MAP_HEADER_SIZE : 0);
+        uint64_t must_fit = record <= BLOCK_SIZE ? record : head;
+
+        pos = align_up(pos, INODE_SLOT_SIZE);
+        if (pos % BLOCK_SIZE + must_fit > BLOCK_SIZE)
+            pos = align_up(pos, BLOCK_SIZE);
+        node.meta_pos = pos;
+        node.ino = ino++;
+        pos += record;
+    }
+    meta_size_ = align_up(pos, BLOCK_SIZE);
+}
+
+std::vector<uint8_t> ErofsBuilder::dir_content(const Node& node) const {
+    std::vector<uint8_t> content(node.size, 0);
+    for (size_t b = 0; b < node.dir_blocks.size(); ++b) {
+        size_t first = node.dir_blocks[b];
+        size_t last = b + 1 < node.dir_blocks.size() ? node.dir_blocks[b + 1] : node.entries.size();
+        uint8_t* block = content.data() + b * BLOCK_SIZE;
+        uint32_t nameoff = static_cast<uint32_t>((last - first) * DIRENT_SIZE);
+        for (size_t i = first; i < last; ++i) {
+            const DirEntry& entry = node.entries[i];
+            const Node& target = nodes_[entry.node];
+            uint8_t* dirent = block + (i - first) * DIRENT_SIZE;
+            put64(dirent, target.meta_pos / INODE_SLOT_SIZE);
+            put16(dirent + 8, static_cast<uint16_t>(nameoff));
+            dirent[10] = file_type(target.st.st_mode);
+            memcpy(block + nameoff, entry.name.data(), entry.name.size());
+            nameoff += static_cast<uint32_t>(entry.name.size());
+        }
+    }
+    return content;
+}
+
+bool ErofsBuilder::inline_tail(const Node& node, uint8_t* out) const {
+    uint64_t tail = node.size % BLOCK_SIZE;
+    uint64_t offset = node.size - tail;
+    mode_t type = node.st.st_mode & S_IFMT;
+
+    if (type == S_IFLNK) {
+        memcpy(out, node.link_target.data() + offset, tail);
+        return true;
+    }
+
+    int in = open(node.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        LOG_ERROR("EROFS writer: cannot open " + node.path + ": " + strerror(errno));
+        return false;
+    }
+    ssize_t n = pread(in, out, tail, offset);
+    close(in);
+    if (n != static_cast<ssize_t>(tail)) {
+        LOG_ERROR("EROFS writer: short read on " + node.path);
+        return false;
+    }
+    return true;
+}
+
+bool ErofsBuilder::write_metadata() {
+    std::vector<uint8_t> meta(meta_size_, 0);
+
+    for (const auto& node : nodes_) {
+        uint8_t* p = meta.data() + node.meta_pos;
+        mode_t type = node.st.st_mode & S_IFMT;
+
+        uint32_t iu = node.blkaddr;
+        if (node.layout == LAYOUT_COMPRESSED_FULL) {
+            iu = node.compressed_blocks;
+        } else if (type == S_IFCHR || type == S_IFBLK) {
+            uint32_t major_no = major(node.st.st_rdev);
+            uint32_t minor_no = minor(node.st.st_rdev);
+            iu = (minor_no & 0xff) | (major_no << 8) | ((minor_no & ~0xffu) << 12);
+        } else if (type == S_IFIFO || type == S_IFSOCK) {
+            iu = 0;
+        }
+
+        uint16_t icount = 0;
+        if (node.xattr_size > 0)
+            icount = static_cast<uint16_t>((node.xattr_size - XATTR_IBODY_HEADER_SIZE) / 4 + 1);
+
+        if (node.extended) {
+            put16(p, static_cast<uint16_t>(node.layout << 1 | 1));
+            put16(p + 2, icount);
+            put16(p + 4, static_cast<uint16_t>(node.st.st_mode));
+            put64(p + 8, node.size);
+            put32(p + 16, iu);
+            put32(p + 20, node.ino);
+            put32(p + 24, node.st.st_uid);
+            put32(p + 28, node.st.st_gid);
+            put64(p + 32, node.st.st_mtim.tv_sec);
+            put32(p + 40, static_cast<uint32_t>(node.st.st_mtim.tv_nsec));
+            put32(p + 44, node.nlink);
+        } else {
+            put16(p, static_cast<uint16_t>(node.layout << 1));
+            put16(p + 2, icount);
+            put16(p + 4, static_cast<uint16_t>(node.st.st_mode));
+            put16(p + 6, static_cast<uint16_t>(node.nlink));
+            put32(p + 8, static_cast<uint32_t>(node.size));
+            put32(p + 16, iu);
+            put32(p + 20, node.ino);
+            put16(p + 24, static_cast<uint16_t>(node.st.st_uid));
+            put16(p + 26, static_cast<uint16_t>(node.st.st_gid));
+        }
+        p += inode_size(node);
+
+        if (node.xattr_size > 0) {
+            uint8_t* x = p + XATTR_IBODY_HEADER_SIZE;
+            for (const auto& xattr : node.xattrs) {
+                x[0] = static_cast<uint8_t>(xattr.name.size());
+                x[1] = xattr.index;
+                put16(x + 2, static_cast<uint16_t>(xattr.value.size()));
+                memcpy(x + XATTR_ENTRY_SIZE, xattr.name.data(), xattr.name.size());
+                memcpy(x + XATTR_ENTRY_SIZE + xattr.name.size(), xattr.value.data(),
+                       xattr.value.size());
+                x += align_up(XATTR_ENTRY_SIZE + xattr.name.size() + xattr.value.size(), 4);
+            }
+            p += node.xattr_size;
+        }
+
+        if (node.layout == LAYOUT_COMPRESSED_FULL) {
+            // Map header is all zero: LZ4, 4K lclusters, no advise bits
+            uint8_t* indexes = meta.data() + node.meta_pos +
+                               align_up(inode_size(node) + node.xattr_size, 8) + MAP_HEADER_SIZE;
+            memcpy(indexes, node.indexes.data(), node.indexes.size());
+        }
+
+        if (type == S_IFDIR) {
+            std::vector<uint8_t> content = dir_content(node);
+            uint64_t full = node.layout == LAYOUT_FLAT_INLINE
+                                ? node.size / BLOCK_SIZE * BLOCK_SIZE
+                                : node.size;
+            if (full > 0) {
+                content.resize(align_up(node.size, BLOCK_SIZE), 0);
+                if (!write_blocks(node.blkaddr, content.data(), align_up(full, BLOCK_SIZE)))
+                    return false;
+            }
+            if (node.layout == LAYOUT_FLAT_INLINE)
+                memcpy(p, content.data() + full, node.size - full);
+        } else if (node.layout == LAYOUT_FLAT_INLINE) {
+            if (!inline_tail(node, p))
+                return false;
+        }
+    }
+
+    return write_blocks(meta_blkaddr_, meta.data(), meta.size());
+}
+
+bool ErofsBuilder::write_superblock() {
+    uint8_t sb[SUPERBLOCK_SIZE] = {};
+    uint32_t total_blocks = meta_blkaddr_ + static_cast<uint32_t>(meta_size_ / BLOCK_SIZE);
+
+    put32(sb, EROFS_MAGIC);
+    sb[12] = BLOCK_BITS;
+    put16(sb + 14, static_cast<uint16_t>(nodes_[0].meta_pos / INODE_SLOT_SIZE));
+    put64(sb + 16, nodes_.size());
+    put64(sb + 24, build_time_);
+    put32(sb + 32, build_time_nsec_);
+    put32(sb + 36, total_blocks);
+    put32(sb + 40, meta_blkaddr_);
+    if (compressed_)
+        put32(sb + 80, FEATURE_INCOMPAT_ZERO_PADDING);
+
+    if (pwrite(fd_, sb, sizeof(sb), SUPERBLOCK_OFFSET) != static_cast<ssize_t>(sizeof(sb)) ||
+        ftruncate(fd_, static_cast<off_t>(total_blocks) * BLOCK_SIZE) != 0) {
+        LOG_ERROR("EROFS writer: cannot write superblock: " + std::string(strerror(errno)));
+        return false;
+    }
+    stats_.image_bytes = static_cast<uint64_t>(total_blocks) * BLOCK_SIZE;
+    return true;
+}
+
+bool ErofsBuilder::build(const std::vector<ErofsSource>& sources, bool source_root,
+                         ErofsWriterStats& stats) {
+    std::string device_path;
+    uint32_t root = 0;
+    if (source_root) {
+        const fs::path& dir = sources.front().dir;
+        if (!add_node(dir.string(), device_path, 0, root))
+            return false;
+        if (root == NO_NODE || !S_ISDIR(nodes_[root].st.st_mode)) {
+            LOG_ERROR("EROFS writer: " + dir.string() + " is not a directory");
+            return false;
+        }
+    } else {
+        root = add_generated_dir(0);
+        for (const auto& source : sources) {
+            uint32_t parent = root;
+            if (!source.name.empty()) {
+                parent = add_generated_dir(root);
+                nodes_[root].entries.push_back({source.name, parent});
+            }
+            if (!scan(source.dir.string(), device_path, parent, source.include))
+                return false;
+        }
+    }
+
+    // Compact inodes inherit the build time, which is taken from the root
+    build_time_ = nodes_[root].st.st_mtim.tv_sec;
+    build_time_nsec_ = static_cast<uint32_t>(nodes_[root].st.st_mtim.tv_nsec);
+
+    for (uint32_t i = 0; i < nodes_.size(); ++i) {
+        Node& node = nodes_[i];
+        if (S_ISDIR(node.st.st_mode) && !layout_dir(node, i))
+            return false;
+
+        for (const auto& xattr : node.xattrs) {
+            node.xattr_size += static_cast<uint32_t>(
+                align_up(XATTR_ENTRY_SIZE + xattr.name.size() + xattr.value.size(), 4));
+        }
+        if (node.xattr_size > 0)
+            node.xattr_size += XATTR_IBODY_HEADER_SIZE;
+
+        uint64_t size = S_ISDIR(node.st.st_mode) ? node.size : node.st.st_size;
+        node.extended = node.st.st_uid > 0xffff || node.st.st_gid > 0xffff ||
+                        node.nlink > 0xffff || size > 0xffffffffULL ||
+                        static_cast<uint64_t>(node.st.st_mtim.tv_sec) != build_time_ ||
+                        static_cast<uint32_t>(node.st.st_mtim.tv_nsec) != build_time_nsec_;
+    }
+
+    if (!write_data())
+        return false;
+    layout_metadata();
+    if (!write_metadata() || !write_superblock())
+        return false;
+
+    stats_.inodes = nodes_.size();
+    stats = stats_;
+    return true;
+}
+
+}  // namespace
+
+namespace {
+
+bool write_image(const std::vector<ErofsSource>& sources, bool source_root,
+                 const fs::path& image_path, const ErofsWriterOptions& options,
+                 ErofsWriterStats* stats) {
+    int fd = open(image_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("EROFS writer: cannot create " + image_path.string() + ": " + strerror(errno));
+        return false;
+    }
+
+    ErofsWriterStats result;
+    bool ok = ErofsBuilder(fd, options).build(sources, source_root, result);
+    if (fsync(fd) != 0)
+        ok = false;
+    close(fd);
+
+    if (!ok) {
+        unlink(image_path.c_str());
+        return false;
+    }
+    if (stats)
+        *stats = result;
+    return true;
+}
+
+}  // namespace
+
+bool write_erofs_image(const std::vector<ErofsSource>& sources, const fs::path& image_path,
+                       const ErofsWriterOptions& options, ErofsWriterStats* stats) {
+    return write_image(sources, false, image_path, options, stats);
+}
+
+bool write_erofs_image(const fs::path& source_dir, const fs::path& image_path,
+                       const ErofsWriterOptions& options, ErofsWriterStats* stats) {
+    return write_image({{source_dir, "", {}}}, true, image_path, options, stats);
+}
+
+}  // namespace hymo
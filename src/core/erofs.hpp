@@ -0,0 +1,61 @@
+// core/erofs.hpp - Native EROFS image writer
+#pragma once
+
+#include <sys/types.h>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace hymo {
+
+// A directory to serialize into the image. Its entries land in `name` below the
+// image root (directly in the root when empty); `include` limits them to the
+// listed top-level entries (all of them when empty).
+struct ErofsSource {
+    fs::path dir;
+    std::string name;
+    std::vector<std::string> include;
+};
+
+struct ErofsWriterOptions {
+    bool compress = true;  // LZ4 clusters for files where they save blocks
+    bool dedup = true;     // store byte-identical files with equal metadata once
+    unsigned threads = 0;  // compression workers, 0 = pick from the CPU count
+
+    // SELinux context for an entry given its path relative to the source dir
+    // ("/system/bin/foo", "/" for generated dirs). Unset keeps the source label.
+    std::function<std::string(const std::string&, mode_t)> label;
+    // Owner for every entry; -1 keeps the source owner
+    int64_t uid = -1;
+    int64_t gid = -1;
+};
+
+struct ErofsWriterStats {
+    uint64_t inodes = 0;
+    uint64_t files = 0;
+    uint64_t compressed_files = 0;
+    uint64_t deduped_files = 0;
+    uint64_t deduped_bytes = 0;
+    uint64_t data_bytes = 0;   // regular file bytes in the tree
+    uint64_t image_bytes = 0;  // size of the resulting image
+};
+
+// Serializes the sources into a read-only EROFS image (4K blocks, LZ4 pclusters
+// with zero padding, in-inode xattrs, hardlinks preserved). Directory symlinks
+// pointing outside their own tree are followed, like sync_dir() does. Output
+// only depends on the input, so the same tree always gives a byte-identical
+// image. Returns false and removes the partial image on error.
+bool write_erofs_image(const std::vector<ErofsSource>& sources, const fs::path& image_path,
+                       const ErofsWriterOptions& options = {},
+                       ErofsWriterStats* stats = nullptr);
+
+// Single-directory form: `source_dir` itself becomes the image root
+bool write_erofs_image(const fs::path& source_dir, const fs::path& image_path,
+                       const ErofsWriterOptions& options = {},
+                       ErofsWriterStats* stats = nullptr);
+
+}  // namespace hymo
@@ -0,0 +1,265 @@
+// core/file_contexts.cpp - Compiled SELinux file_contexts lookup
+#include "file_contexts.hpp"
+#include <sys/stat.h>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "../utils.hpp"
+
+namespace hymo {
+
+namespace {
+
+// Same load order as libselinux: later files override earlier ones
+const char* const FILE_CONTEXTS_PATHS[] = {
+    "/system/etc/selinux/plat_file_contexts",
+    "/system_ext/etc/selinux/system_ext_file_contexts",
+    "/product/etc/selinux/product_file_contexts",
+    "/vendor/etc/selinux/vendor_file_contexts",
+    "/odm/etc/selinux/odm_file_contexts",
+};
+
+// Pre-treble devices keep them in the ramdisk root
+const char* const LEGACY_FILE_CONTEXTS_PATHS[] = {
+    "/plat_file_contexts",
+    "/vendor_file_contexts",
+};
+
+struct RegexSpec {
+    std::string pattern;
+    std::string prefix;  // literal head of the pattern, checked before the regex
+    std::string context;
+    mode_t type = 0;
+    std::once_flag once;
+    std::regex regex;
+    bool valid = false;
+};
+
+struct ExactSpec {
+    std::string context;
+    mode_t type = 0;
+};
+
+struct FileContexts {
+    std::deque<RegexSpec> specs;  // file order, so higher index = higher priority
+    std::unordered_map<std::string, std::vector<size_t>> by_stem;
+    std::vector<size_t> unstemmed;
+    std::unordered_map<std::string, std::vector<ExactSpec>> exact;
+    size_t count = 0;
+};
+
+bool is_meta(char c) {
+    switch (c) {
+    case '.':
+    case '^':
+    case '$':
+    case '?':
+    case '*':
+    case '+':
+    case '|':
+    case '[':
+    case '(':
+    case '{':
+    case '\\':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Length of the leading run without regex metacharacters
+size_t literal_length(const std::string& pattern) {
+    size_t i = 0;
+    while (i < pattern.size() && !is_meta(pattern[i]))
+        i++;
+    return i;
+}
+
+// "/system" for "/system/bin/foo", empty if the first component isn't literal
+std::string stem_of(const std::string& path, size_t literal_len) {
+    if (path.empty() || path[0] != '/')
+        return "";
+    size_t end = path.find('/', 1);
+    if (end == std::string::npos)
+        end = path.size();
+    if (end > literal_len)
+        return "";
+    return path.substr(0, end);
+}
+
+mode_t parse_type(const std::string& token) {
+    if (token == "--")
+        return S_IFREG;
+    if (token == "-d")
+        return S_IFDIR;
+    if (token == "-l")
+        return S_IFLNK;
+    if (token == "-c")
+        return S_IFCHR;
+    if (token == "-b")
+        return S_IFBLK;
+    if (token == "-s")
+        return S_IFSOCK;
+    if (token == "-p")
+        return S_IFIFO;
+    return 0;
+}
+
+bool type_matches(mode_t spec_type, mode_t mode) {
+    return spec_type == 0 || mode == 0 || (mode & S_IFMT) == spec_type;
+}
+
+void load_file(const char* path, FileContexts& fc) {
+    std::ifstream file(path);
+    if (!file.is_open())
+        return;
+
+    std::string line;
+    size_t loaded = 0;
+    while (std::getline(file, line)) {
+        std::istringstream ss(line);
+        std::string pattern, second, third;
+        if (!(ss >> pattern) || pattern[0] == '#')
+            continue;
+        if (!(ss >> second))
+            continue;
+
+        mode_t type = 0;
+        std::string context = second;
+        if (ss >> third) {
+            type = parse_type(second);
+            context = third;
+        }
+
+        size_t lit = literal_length(pattern);
+        if (lit == pattern.size()) {
+            fc.exact[pattern].push_back({context, type});
+        } else {
+            fc.specs.emplace_back();
+            RegexSpec& spec = fc.specs.back();
+            spec.pattern = pattern;
+            spec.prefix = pattern.substr(0, lit);
+            spec.context = context;
+            spec.type = type;
+
+            size_t index = fc.specs.size() - 1;
+            std::string stem = stem_of(pattern, lit);
+            if (stem.empty())
+                fc.unstemmed.push_back(index);
+            else
+                fc.by_stem[stem].push_back(index);
+        }
+        loaded++;
+    }
+
+    fc.count += loaded;
+    LOG_DEBUG("Loaded " + std::to_string(loaded) + " file_contexts specs from " + path);
+}
+
+FileContexts& instance() {
+    static FileContexts fc;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (const char* path : FILE_CONTEXTS_PATHS)
+            load_file(path, fc);
+        if (fc.count == 0) {
+            for (const char* path : LEGACY_FILE_CONTEXTS_PATHS)
+                load_file(path, fc);
+        }
+        if (fc.count == 0)
+            LOG_WARN("No file_contexts found, using static SELinux contexts");
+    });
+    return fc;
+}
+
+// Regexes are compiled on first use, and only once their literal prefix matched
+bool spec_matches(RegexSpec& spec, const std::string& path) {
+    if (path.compare(0, spec.prefix.size(), spec.prefix) != 0)
+        return false;
+
+    std::call_once(spec.once, [&spec] {
+        try {
+            spec.regex = std::regex("^(?:" + spec.pattern + ")$",
+                                    std::regex::ECMAScript | std::regex::nosubs);
+            spec.valid = true;
+        } catch (const std::exception&) {
+            LOG_DEBUG("Unsupported file_contexts regex: " + spec.pattern);
+        }
+    });
+
+    return spec.valid && std::regex_match(path, spec.regex);
+}
+
+}  // namespace
+
+size_t file_contexts_spec_count() {
+    return instance().count;
+}
+
+std::string file_contexts_fingerprint() {
+    std::string fingerprint;
+    auto add = [&fingerprint](const char* path) {
+        struct stat st;
+        if (stat(path, &st) != 0)
+            return;
+        fingerprint += std::string(path) + ":" + std::to_string(st.st_size) + ":" +
+                       std::to_string(st.st_mtime) + ";";
+    };
+    for (const char* path : FILE_CONTEXTS_PATHS)
+        add(path);
+    for (const char* path : LEGACY_FILE_CONTEXTS_PATHS)
+        add(path);
+    return fingerprint;
+}
+
+std::string lookup_file_context(const std::string& path, mode_t mode) {
+    FileContexts& fc = instance();
+
+    auto exact_it = fc.exact.find(path);
+    if (exact_it != fc.exact.end()) {
+        const auto& entries = exact_it->second;
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (type_matches(it->type, mode))
+                return it->context;
+        }
+    }
+
+    static const std::vector<size_t> none;
+    const std::vector<size_t>* stemmed = &none;
+    auto stem_it = fc.by_stem.find(stem_of(path, path.size()));
+    if (stem_it != fc.by_stem.end())
+        stemmed = &stem_it->second;
+
+    // Walk both candidate lists from the highest priority (last loaded) spec down
+    auto a = stemmed->rbegin();
+    auto b = fc.unstemmed.rbegin();
+    while (a != stemmed->rend() || b != fc.unstemmed.rend()) {
+        size_t index;
+        if (b == fc.unstemmed.rend() || (a != stemmed->rend() && *a > *b)) {
+            index = *a++;
+        } else {
+            index = *b++;
+        }
+
+        RegexSpec& spec = fc.specs[index];
+        if (type_matches(spec.type, mode) && spec_matches(spec, path))
+            return spec.context;
+    }
+
+    return "";
+}
+
+std::string resolve_file_context(const std::string& path, mode_t mode) {
+    std::string context = lookup_file_context(path, mode);
+    if (context.empty() || context == "<<none>>" ||
+        context.find("u:object_r:rootfs:s0") != std::string::npos) {
+        return get_context_for_path(path);
+    }
+    return context;
+}
+
+}  // namespace hymo
@@ -0,0 +1,28 @@
+// core/file_contexts.hpp - Compiled SELinux file_contexts lookup
+#pragma once
+
+#include <sys/types.h>
+#include <cstddef>
+#include <string>
+
+namespace hymo {
+
+// Number of specs loaded from the device file_contexts (0 if none could be read).
+// The files are parsed once per process on first use.
+size_t file_contexts_spec_count();
+
+// Size and mtime of each file_contexts file on the device, for build caches whose
+// output depends on the labels. Doesn't load the specs.
+std::string file_contexts_fingerprint();
+
+// Context for an on-device path such as "/system/lib64/libfoo.so", following
+// libselinux precedence (last matching spec wins, exact paths beat regexes).
+// `mode` is an st_mode used to honour per-type specs; 0 matches any type.
+// Returns an empty string when nothing matches.
+std::string lookup_file_context(const std::string& path, mode_t mode);
+
+// lookup_file_context() with the static get_context_for_path() fallback; rootfs
+// and <<none>> results are mapped to the fallback as well.
+std::string resolve_file_context(const std::string& path, mode_t mode);
+
+}  // namespace hymo
@@ -0,0 +1,252 @@
+// core/manifest.cpp - Content digests of module trees for build caches
+#include "manifest.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include "../utils.hpp"
+#include "file_contexts.hpp"
+
+namespace hymo {
+
+namespace {
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// One record per entry; fields are separated so that no two trees serialize alike
+void hash_entry(Sha256& hasher, const std::string& rel_path, const struct stat& st,
+                const char* link_target) {
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "|%o|%u|%u|%lld|%lld.%09ld|%lld.%09ld|",
+                       static_cast<unsigned>(st.st_mode), static_cast<unsigned>(st.st_uid),
+                       static_cast<unsigned>(st.st_gid), static_cast<long long>(st.st_size),
+                       static_cast<long long>(st.st_mtim.tv_sec), st.st_mtim.tv_nsec,
+                       static_cast<long long>(st.st_ctim.tv_sec), st.st_ctim.tv_nsec);
+    hasher.update(rel_path);
+    hasher.update(buf, static_cast<size_t>(len));
+    if (link_target)
+        hasher.update(link_target, strlen(link_target));
+    hasher.update("\n", 1);
+}
+
+// Takes ownership of `dir_fd`
+bool hash_tree_at(int dir_fd, std::string& rel_path, Sha256& hasher) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return false;
+    }
+
+    // readdir order isn't stable across rewrites of a directory
+    std::vector<std::string> names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            names.emplace_back(entry->d_name);
+    }
+    std::sort(names.begin(), names.end());
+
+    bool ok = true;
+    const size_t rel_len = rel_path.size();
+    for (const auto& name : names) {
+        struct stat st;
+        if (fstatat(dirfd(dir), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ok = false;
+            break;
+        }
+        rel_path.append("/").append(name);
+
+        if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlinkat(dirfd(dir), name.c_str(), target, sizeof(target) - 1);
+            target[len < 0 ? 0 : len] = '\0';
+            hash_entry(hasher, rel_path, st, target);
+        } else {
+            hash_entry(hasher, rel_path, st, nullptr);
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            int child = openat(dirfd(dir), name.c_str(),
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            ok = child >= 0 && hash_tree_at(child, rel_path, hasher);
+        }
+        rel_path.resize(rel_len);
+        if (!ok)
+            break;
+    }
+
+    closedir(dir);
+    return ok;
+}
+
+}  // namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab,
+             0x5be0cd19} {}
+
+void Sha256::transform(const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+               (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+}
+
+void Sha256::update(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    length_ += len;
+    while (len > 0) {
+        size_t n = std::min(len, sizeof(buffer_) - buffered_);
+        memcpy(buffer_ + buffered_, p, n);
+        buffered_ += n;
+        p += n;
+        len -= n;
+        if (buffered_ == sizeof(buffer_)) {
+            transform(buffer_);
+            buffered_ = 0;
+        }
+    }
+}
+
+std::string Sha256::hex_digest() {
+    uint64_t bits = length_ * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    uint8_t zero = 0;
+    while (buffered_ != 56)
+        update(&zero, 1);
+    uint8_t len_be[8];
+    for (int i = 0; i < 8; ++i)
+        len_be[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    update(len_be, 8);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(64);
+    for (uint32_t word : state_) {
+        for (int shift = 28; shift >= 0; shift -= 4)
+            out.push_back(hex[(word >> shift) & 0xf]);
+    }
+    return out;
+}
+
+bool hash_module_tree(const fs::path& module_dir, Sha256& hasher) {
+    int fd = open(module_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    std::string rel_path = module_dir.filename().string();
+    rel_path.reserve(PATH_MAX);
+    hasher.update("module:", 7);
+    hasher.update(rel_path);
+    hasher.update("\n", 1);
+    return hash_tree_at(fd, rel_path, hasher);
+}
+
+std::string manifest_digest(const std::vector<fs::path>& module_dirs,
+                            const std::string& build_options) {
+    Sha256 hasher;
+    hasher.update("options:" + build_options + "\n");
+    hasher.update("file_contexts:" + file_contexts_fingerprint() + "\n");
+    for (const auto& dir : module_dirs) {
+        if (!hash_module_tree(dir, hasher)) {
+            LOG_WARN("Manifest: cannot read " + dir.string());
+            return "";
+        }
+    }
+    return hasher.hex_digest();
+}
+
+static fs::path sidecar_path(const fs::path& image_path) {
+    return fs::path(image_path.string() + ".digest");
+}
+
+std::string read_digest_sidecar(const fs::path& image_path) {
+    std::ifstream file(sidecar_path(image_path));
+    std::string digest;
+    if (!file.is_open() || !std::getline(file, digest))
+        return "";
+    return digest;
+}
+
+bool read_sidecar_dedup(const fs::path& image_path, uint64_t& files_linked,
+                        uint64_t& bytes_saved) {
+    std::ifstream file(sidecar_path(image_path));
+    std::string digest, label;
+    if (!file.is_open() || !std::getline(file, digest))
+        return false;
+    return static_cast<bool>(file >> label >> files_linked >> bytes_saved) && label == "dedup";
+}
+
+bool write_digest_sidecar(const fs::path& image_path, const std::string& digest,
+                          uint64_t files_linked, uint64_t bytes_saved) {
+    fs::path path = sidecar_path(image_path);
+    fs::path tmp = path.string() + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        if (!file.is_open())
+            return false;
+        file << digest << "\n"
+             << "dedup " << files_linked << " " << bytes_saved << "\n";
+        if (!file.good())
+            return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+void remove_digest_sidecar(const fs::path& image_path) {
+    unlink(sidecar_path(image_path).c_str());
+}
+
+}  // namespace hymo
@@ -0,0 +1,52 @@
+// core/manifest.hpp - Content digests of module trees for build caches
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace hymo {
+
+// Incremental SHA-256
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t len);
+    void update(const std::string& s) { update(s.data(), s.size()); }
+    std::string hex_digest();  // finalizes; call once
+
+private:
+    void transform(const uint8_t* block);
+
+    uint32_t state_[8];
+    uint8_t buffer_[64];
+    uint64_t length_ = 0;
+    size_t buffered_ = 0;
+};
+
+// Digest of a module tree as it would be copied: every entry's relative path,
+// type, mode, owner, size, mtime/ctime and symlink target, in sorted order.
+// Adds to `hasher` so several modules can be folded into one digest.
+// Returns false if the tree can't be read.
+bool hash_module_tree(const fs::path& module_dir, Sha256& hasher);
+
+// Digest of `module_dirs` (in order) plus `build_options`; empty on error.
+// The device file_contexts are folded in, since they decide the labels.
+std::string manifest_digest(const std::vector<fs::path>& module_dirs,
+                            const std::string& build_options);
+
+// Sidecar "<image>.digest" handling. A missing or unreadable sidecar never matches.
+// The dedup savings of the build are kept next to the digest, so a reused image
+// still reports them.
+std::string read_digest_sidecar(const fs::path& image_path);
+bool read_sidecar_dedup(const fs::path& image_path, uint64_t& files_linked,
+                        uint64_t& bytes_saved);
+bool write_digest_sidecar(const fs::path& image_path, const std::string& digest,
+                          uint64_t files_linked = 0, uint64_t bytes_saved = 0);
+void remove_digest_sidecar(const fs::path& image_path);
+
+}  // namespace hymo
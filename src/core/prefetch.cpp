@@ -0,0 +1,164 @@
+// core/prefetch.cpp - Background readahead of module trees
+#include "prefetch.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include "../defs.hpp"
+#include "../utils.hpp"
+
+namespace hymo {
+
+namespace {
+
+constexpr unsigned MAX_PREFETCH_THREADS = 4;
+
+bool module_enabled(const fs::path& module_path) {
+    return access((module_path / DISABLE_FILE_NAME).c_str(), F_OK) != 0 &&
+           access((module_path / REMOVE_FILE_NAME).c_str(), F_OK) != 0 &&
+           access((module_path / SKIP_MOUNT_FILE_NAME).c_str(), F_OK) != 0;
+}
+
+}  // namespace
+
+Prefetcher::~Prefetcher() {
+    wait();
+}
+
+void Prefetcher::start(const fs::path& moduledir, const std::vector<std::string>& partitions,
+                       unsigned threads) {
+    if (!threads_.empty())
+        return;
+
+    started_ = std::chrono::steady_clock::now();
+
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(moduledir, ec)) {
+        if (!entry.is_directory(ec) || !module_enabled(entry.path()))
+            continue;
+        for (const auto& part : partitions) {
+            queue_.push_back((entry.path() / part).string());
+        }
+    }
+
+    if (threads == 0) {
+        unsigned cpus = std::thread::hardware_concurrency();
+        threads = cpus == 0 ? 2 : std::min(cpus, MAX_PREFETCH_THREADS);
+    }
+
+    try {
+        for (unsigned i = 0; i < threads; ++i) {
+            threads_.emplace_back(&Prefetcher::worker, this);
+        }
+    } catch (const std::exception& e) {
+        // Prefetching is only an optimization; run with what we have
+        LOG_WARN("Prefetch: failed to start worker: " + std::string(e.what()));
+    }
+
+    if (threads_.empty()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.clear();
+    }
+    LOG_DEBUG("Prefetch started with " + std::to_string(threads_.size()) + " workers");
+}
+
+void Prefetcher::push(std::string dir) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cancelled_)
+            return;
+        queue_.push_back(std::move(dir));
+    }
+    cv_.notify_one();
+}
+
+void Prefetcher::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (threads_.empty() || done_ || cancelled_)
+            return;
+        cancelled_ = true;
+        queue_.clear();
+    }
+    cv_.notify_all();
+    LOG_DEBUG("Prefetch cancelled");
+}
+
+void Prefetcher::worker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        cv_.wait(lock, [this] { return !queue_.empty() || busy_ == 0; });
+        if (queue_.empty())
+            break;
+
+        std::string dir_path = std::move(queue_.front());
+        queue_.pop_front();
+        busy_++;
+        lock.unlock();
+
+        int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR* dir = dir_fd >= 0 ? fdopendir(dir_fd) : nullptr;
+        if (dir) {
+            dirs_++;
+            struct dirent* entry;
+            while (!cancelled_ && (entry = readdir(dir)) != nullptr) {
+                const char* name = entry->d_name;
+                if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                    continue;
+
+                // The stat itself is what warms the dentry and inode caches
+                struct stat st;
+                if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+
+                if (S_ISDIR(st.st_mode)) {
+                    push(dir_path + "/" + name);
+                } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+                    int fd = openat(dirfd(dir), name, O_RDONLY | O_NOATIME | O_CLOEXEC);
+                    if (fd < 0)
+                        continue;
+                    if (readahead(fd, 0, st.st_size) != 0) {
+                        posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+                    }
+                    close(fd);
+                    files_++;
+                    bytes_ += st.st_size;
+                }
+            }
+            closedir(dir);
+        } else if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+
+        lock.lock();
+        busy_--;
+        if (queue_.empty() && busy_ == 0)
+            cv_.notify_all();
+    }
+}
+
+PrefetchStats Prefetcher::wait() {
+    if (threads_.empty() || done_)
+        return stats_;
+
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    done_ = true;
+
+    stats_.dirs = dirs_;
+    stats_.files = files_;
+    stats_.bytes = bytes_;
+    stats_.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - started_)
+                            .count();
+    LOG_INFO("Prefetch" + std::string(cancelled_ ? " (cancelled)" : "") + ": " +
+             std::to_string(stats_.files) + " files (" +
+             std::to_string(stats_.bytes / (1024 * 1024)) + " MB) in " + std::to_string(stats_.dirs) + " dirs, " +
+             std::to_string(stats_.elapsed_ms) + " ms");
+    return stats_;
+}
+
+}  // namespace hymo
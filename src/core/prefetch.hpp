@@ -0,0 +1,66 @@
+// core/prefetch.hpp - Background readahead of module trees
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace hymo {
+
+struct PrefetchStats {
+    uint64_t dirs = 0;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t elapsed_ms = 0;
+};
+
+// Warms the page and dentry caches for enabled modules' partition dirs while
+// storage is being set up. Workers share a queue of directories; every entry is
+// stat'ed and regular files get readahead(). The destructor waits for the walk.
+class Prefetcher {
+public:
+    Prefetcher() = default;
+    ~Prefetcher();
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    // Start `threads` workers (0 = pick from the CPU count); no-op if already running
+    void start(const fs::path& moduledir, const std::vector<std::string>& partitions,
+               unsigned threads = 0);
+
+    // Block until the walk is done. Safe to call more than once.
+    PrefetchStats wait();
+
+    // Drop the rest of the walk, e.g. when a cached image means the data is never
+    // read. Workers stop after the file they are on; does not block.
+    void cancel();
+
+private:
+    void worker();
+    void push(std::string dir);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::string> queue_;
+    size_t busy_ = 0;
+    bool done_ = false;
+    std::atomic<bool> cancelled_{false};
+    std::vector<std::thread> threads_;
+
+    std::atomic<uint64_t> dirs_{0};
+    std::atomic<uint64_t> files_{0};
+    std::atomic<uint64_t> bytes_{0};
+    std::chrono::steady_clock::time_point started_;
+    PrefetchStats stats_;
+};
+
+}  // namespace hymo
@@ -55,6 +55,35 @@ bool RuntimeState::save() const {
     }
     file << "],\n";
 
+    file << "  \"dedup_files_linked\": " << dedup_files_linked << ",\n";
+    file << "  \"dedup_bytes_saved\": " << dedup_bytes_saved << ",\n";
+    file << "  \"tmpfs_budget\": " << tmpfs_budget << ",\n";
+    file << "  \"try_umount_paths\": " << try_umount_paths << ",\n";
+
+    file << "  \"spilled_module_ids\": [";
+    for (size_t i = 0; i < spilled_module_ids.size(); ++i) {
+        file << "\"" << spilled_module_ids[i] << "\"";
+        if (i < spilled_module_ids.size() - 1)
+            file << ", ";
+    }
+    file << "],\n";
+
+    file << "  \"module_usage_bytes\": {";
+    for (size_t i = 0; i < module_usage_bytes.size(); ++i) {
+        file << "\"" << module_usage_bytes[i].first << "\": " << module_usage_bytes[i].second;
+        if (i < module_usage_bytes.size() - 1)
+            file << ", ";
+    }
+    file << "},\n";
+
+    file << "  \"stage_timings_ms\": {";
+    for (size_t i = 0; i < stage_timings_ms.size(); ++i) {
+        file << "\"" << stage_timings_ms[i].first << "\": " << stage_timings_ms[i].second;
+        if (i < stage_timings_ms.size() - 1)
+            file << ", ";
+    }
+    file << "},\n";
+
     file << "  \"pid\": " << pid << "\n";
 
     file << "}\n";
@@ -83,6 +112,39 @@ static std::vector<std::string> parse_json_array(const std::string& line) {
     return result;
 }
 
+static uint64_t parse_json_uint(const std::string& line) {
+    auto colon = line.find(":");
+    if (colon == std::string::npos)
+        return 0;
+    try {
+        return std::stoull(line.substr(colon + 1));
+    } catch (...) {
+        return 0;
+    }
+}
+
+// {"scan": 12, "storage": 40} on a single line, order preserved
+static std::vector<std::pair<std::string, uint64_t>> parse_json_uint_map(const std::string& line) {
+    std::vector<std::pair<std::string, uint64_t>> result;
+    auto start = line.find("{");
+    auto end = line.find("}");
+    if (start == std::string::npos || end == std::string::npos)
+        return result;
+
+    std::string content = line.substr(start + 1, end - start - 1);
+    std::stringstream ss(content);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t first_quote = item.find("\"");
+        size_t last_quote = item.rfind("\"");
+        if (first_quote == std::string::npos || last_quote <= first_quote)
+            continue;
+        result.emplace_back(item.substr(first_quote + 1, last_quote - first_quote - 1),
+                            parse_json_uint(item.substr(last_quote + 1)));
+    }
+    return result;
+}
+
 RuntimeState load_runtime_state() {
     RuntimeState state;
 
@@ -99,7 +161,10 @@ RuntimeState load_runtime_state() {
     while (std::getline(file, line)) {
         line.erase(0, line.find_first_not_of(" \t"));
 
-        if (line.find("\"storage_mode\"") != std::string::npos) {
+        // Module ids are arbitrary, so this line is matched before any other key
+        if (line.find("\"module_usage_bytes\"") == 0) {
+            state.module_usage_bytes = parse_json_uint_map(line.substr(line.find(":") + 1));
+        } else if (line.find("\"storage_mode\"") != std::string::npos) {
             auto start = line.find(": \"") + 3;
             auto end = line.find("\"", start);
             if (end != std::string::npos) {
@@ -123,6 +188,18 @@ RuntimeState load_runtime_state() {
             state.hymofs_module_ids = parse_json_array(line);
         } else if (line.find("\"active_mounts\"") != std::string::npos) {
             state.active_mounts = parse_json_array(line);
+        } else if (line.find("\"dedup_files_linked\"") != std::string::npos) {
+            state.dedup_files_linked = parse_json_uint(line);
+        } else if (line.find("\"dedup_bytes_saved\"") != std::string::npos) {
+            state.dedup_bytes_saved = parse_json_uint(line);
+        } else if (line.find("\"tmpfs_budget\"") != std::string::npos) {
+            state.tmpfs_budget = parse_json_uint(line);
+        } else if (line.find("\"try_umount_paths\"") != std::string::npos) {
+            state.try_umount_paths = parse_json_uint(line);
+        } else if (line.find("\"spilled_module_ids\"") != std::string::npos) {
+            state.spilled_module_ids = parse_json_array(line);
+        } else if (line.find("\"stage_timings_ms\"") != std::string::npos) {
+            state.stage_timings_ms = parse_json_uint_map(line.substr(line.find(":") + 1));
         } else if (line.find("\"pid\"") != std::string::npos) {
             if (line.find(":") != std::string::npos) {
                 try {
@@ -141,4 +218,11 @@ RuntimeState load_runtime_state() {
     return state;
 }
 
+uint64_t total_module_usage(const RuntimeState& state) {
+    uint64_t total = 0;
+    for (const auto& entry : state.module_usage_bytes)
+        total += entry.second;
+    return total;
+}
+
 }  // namespace hymo
@@ -1,7 +1,9 @@
 // core/state.hpp - Runtime state management
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace hymo {
@@ -16,6 +18,13 @@ struct RuntimeState {
     bool nuke_active = false;
     bool hymofs_mismatch = false;
     std::string mismatch_message;
+    uint64_t dedup_files_linked = 0;
+    uint64_t dedup_bytes_saved = 0;
+    uint64_t tmpfs_budget = 0;
+    uint64_t try_umount_paths = 0;  // mount points registered with KernelSU try_umount
+    std::vector<std::string> spilled_module_ids;
+    std::vector<std::pair<std::string, uint64_t>> module_usage_bytes;  // measured after sync
+    std::vector<std::pair<std::string, uint64_t>> stage_timings_ms;  // mount stages, in order
     int pid = 0;
 
     bool save() const;
@@ -23,4 +32,7 @@ struct RuntimeState {
 
 RuntimeState load_runtime_state();
 
+// Sum of module_usage_bytes
+uint64_t total_module_usage(const RuntimeState& state);
+
 }  // namespace hymo
@@ -1,23 +1,35 @@
 // core/storage.cpp - Storage backend (Tmpfs/Ext4/EROFS)
 #include "storage.hpp"
 #include <fcntl.h>
+#include <linux/loop.h>
 #include <sched.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <algorithm>
+#include <chrono>
 #include <cinttypes>
 #include <cstdio>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <vector>
 #include "../defs.hpp"
+#include "../mount/partition_utils.hpp"
 #include "../utils.hpp"
+#include "erofs.hpp"
 #include "json.hpp"
+#include "manifest.hpp"
 #include "state.hpp"
 
+#ifndef EXT4_IOC_RESIZE_FS
+#define EXT4_IOC_RESIZE_FS _IOW('f', 16, uint64_t)
+#endif  // #ifndef EXT4_IOC_RESIZE_FS
+
 namespace hymo {
 
 static bool try_setup_tmpfs(const fs::path& target) {
@@ -75,8 +87,39 @@ static uint64_t dir_size(const fs::path& path) {
     return total;
 }
 
-// Run mkfs.ext4 via execve (no shell)
-static bool run_mkfs_ext4(const fs::path& img_path) {
+// Block size for an ext4 image in `dir`. The loop device takes the filesystem's
+// block size as its own, and direct I/O only works when that is a multiple of
+// the backing device's logical block size (4K on some UFS storage). 1K, as
+// before, when the device can't be determined.
+static uint32_t ext4_block_size(const fs::path& dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0)
+        return 1024;
+
+    // Partitions have no queue of their own; it is on the parent disk
+    std::string dev = "/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" +
+                      std::to_string(minor(st.st_dev));
+    uint32_t logical = 0;
+    for (const char* queue : {"/queue/logical_block_size", "/../queue/logical_block_size"}) {
+        std::ifstream file(dev + queue);
+        if (file >> logical)
+            break;
+    }
+
+    const uint32_t page = static_cast<uint32_t>(getpagesize());
+    return logical > 1024 && logical <= page ? logical : 1024;
+}
+
+// Bind mount set up in mkfs' private mount namespace before it runs
+struct MkfsBind {
+    std::string source;
+    std::string target;
+};
+
+// Run mkfs.ext4 via execve (no shell). `binds` are only visible to mkfs and go
+// away with it.
+static bool run_mkfs_ext4(const fs::path& img_path, const std::vector<std::string>& extra_args = {},
+                          const std::vector<MkfsBind>& binds = {}) {
     const char* mkfs_paths[] = {"/system/bin/mkfs.ext4", "/system/bin/mke2fs", "/sbin/mkfs.ext4",
                                 "/sbin/mke2fs"};
     const char* mkfs_bin = nullptr;
@@ -92,7 +135,12 @@ static bool run_mkfs_ext4(const fs::path& img_path) {
     }
 
     std::string path_str = img_path.string();
-    std::vector<const char*> argv = {mkfs_bin, "-t", "ext4", "-b", "1024", path_str.c_str(), nullptr};
+    std::string block_size = std::to_string(ext4_block_size(img_path.parent_path()));
+    std::vector<const char*> argv = {mkfs_bin, "-t", "ext4", "-b", block_size.c_str()};
+    for (const auto& arg : extra_args)
+        argv.push_back(arg.c_str());
+    argv.push_back(path_str.c_str());
+    argv.push_back(nullptr);
 
     pid_t pid = fork();
     if (pid < 0) {
@@ -108,6 +156,16 @@ static bool run_mkfs_ext4(const fs::path& img_path) {
             if (devnull > 2)
                 close(devnull);
         }
+        if (!binds.empty()) {
+            if (unshare(CLONE_NEWNS) != 0 ||
+                mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) != 0)
+                _exit(126);
+            for (const auto& bind : binds) {
+                if (mount(bind.source.c_str(), bind.target.c_str(), nullptr, MS_BIND | MS_REC,
+                          nullptr) != 0)
+                    _exit(126);
+            }
+        }
         execve(mkfs_bin, const_cast<char* const*>(argv.data()), ::environ);
         _exit(127);
     }
@@ -131,10 +189,14 @@ bool create_image(const fs::path& base_dir) {
     if (fs::exists(img_file)) {
         fs::remove(img_file);
     }
+    remove_digest_sidecar(img_file);
 
-    // Dynamic size: max(moduledir_size * 1.2, 64MB) - align with mhm
+    // Dynamic size: max(moduledir_size * 1.2, 64MB) - align with mhm. The usage
+    // recorded at the last mount saves walking the module dir.
     const uint64_t min_size = 64ULL * 1024 * 1024;
-    uint64_t total = dir_size(modules_dir);
+    uint64_t total = total_module_usage(load_runtime_state());
+    if (total == 0)
+        total = dir_size(modules_dir);
     uint64_t grow_size = std::max(static_cast<uint64_t>(total * 1.2), min_size);
 
     int fd = open(img_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -159,98 +221,359 @@ bool create_image(const fs::path& base_dir) {
     return true;
 }
 
-static bool is_erofs_available() {
-    return access("/system/bin/mkfs.erofs", X_OK) == 0 ||
-           access("/vendor/bin/mkfs.erofs", X_OK) == 0 || access("/sbin/mkfs.erofs", X_OK) == 0;
+// Revision of the populated ext4 layout; part of the image cache digest
+static const char* const EXT4_IMAGE_FORMAT = "populate-v2";
+
+std::string ext4_build_options() {
+    return std::string("mke2fs-d ") + EXT4_IMAGE_FORMAT;
 }
 
-static bool create_erofs_image(const fs::path& modules_dir, const fs::path& image_path) {
-    LOG_INFO("Creating EROFS image from " + modules_dir.string());
+// Space and inodes mke2fs -d needs for `sources`: `block_size` blocks per file
+// and dir, plus room for inode tables, journal and metadata
+static void populated_image_size(const std::vector<ErofsSource>& sources, uint64_t block_size,
+                                 uint64_t& bytes, uint64_t& inodes) {
+    uint64_t blocks = 0;
+    uint64_t entries = 0;
+    for (const auto& source : sources) {
+        entries++;
+        for (const auto& include : source.include) {
+            std::error_code ec;
+            entries++;
+            blocks++;
+            for (fs::recursive_directory_iterator it(source.dir / include, ec), end;
+                 !ec && it != end; it.increment(ec)) {
+                entries++;
+                if (it->is_regular_file(ec) && !it->is_symlink(ec)) {
+                    blocks += (it->file_size(ec) + block_size - 1) / block_size;
+                } else if (it->is_directory(ec)) {
+                    blocks++;
+                }
+            }
+        }
+    }
+
+    inodes = entries + entries / 4 + 1024;
+    const uint64_t min_size = 64ULL * 1024 * 1024;
+    const uint64_t overhead = 16ULL * 1024 * 1024;
+    uint64_t needed = static_cast<uint64_t>(blocks * block_size * 1.2) + inodes * 256 + overhead;
+    bytes = std::max(needed, min_size);
+}
 
-    if (!fs::exists(modules_dir)) {
-        LOG_ERROR("Modules directory not found: " + modules_dir.string());
+// The sources are bind-mounted into an empty view only mkfs can see
+bool create_populated_image(const std::vector<ErofsSource>& sources, const fs::path& image_path) {
+    fs::path view = image_path.parent_path() / "ext4_view";
+    std::error_code ec;
+    fs::remove_all(view, ec);  // binds only ever existed in mkfs' namespace
+
+    std::vector<MkfsBind> binds;
+    for (const auto& source : sources) {
+        for (const auto& include : source.include) {
+            fs::path target = view / source.name / include;
+            if (!ensure_dir_exists(target)) {
+                fs::remove_all(view, ec);
+                return false;
+            }
+            binds.push_back({(source.dir / include).string(), target.string()});
+        }
+    }
+    if (!ensure_dir_exists(view))
         return false;
+
+    uint64_t size = 0;
+    uint64_t inodes = 0;
+    populated_image_size(sources, ext4_block_size(image_path.parent_path()), size, inodes);
+
+    bool ok = false;
+    int fd = open(image_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create image file: " + std::string(strerror(errno)));
+    } else if (ftruncate(fd, size) != 0) {
+        LOG_ERROR("ftruncate failed: " + std::string(strerror(errno)));
+        close(fd);
+    } else {
+        close(fd);
+        ok = run_mkfs_ext4(image_path,
+                           {"-F", "-q", "-m", "0", "-N", std::to_string(inodes), "-d", view.string()},
+                           binds);
     }
 
-    if (fs::exists(image_path)) {
-        fs::remove(image_path);
+    fs::remove_all(view, ec);
+    if (!ok)
+        fs::remove(image_path, ec);
+    return ok;
+}
+
+fs::path image_slot(const fs::path& image_path) {
+    return image_path.string() + ".b";
+}
+
+bool promote_image_slot(const fs::path& image_path, const std::string& digest,
+                        uint64_t files_linked, uint64_t bytes_saved) {
+    // Without a sidecar the image never matches, so a crash in between only
+    // costs a rebuild
+    remove_digest_sidecar(image_path);
+    if (rename(image_slot(image_path).c_str(), image_path.c_str()) != 0) {
+        LOG_ERROR("Failed to promote " + image_slot(image_path).string() + ": " +
+                  strerror(errno));
+        return false;
+    }
+    if (!digest.empty() &&
+        !write_digest_sidecar(image_path, digest, files_linked, bytes_saved)) {
+        LOG_WARN("Failed to record digest of " + image_path.string());
     }
+    return true;
+}
 
-    const char* mkfs_paths[] = {"/system/bin/mkfs.erofs", "/vendor/bin/mkfs.erofs",
-                                "/sbin/mkfs.erofs"};
-    const char* mkfs_bin = nullptr;
-    for (const auto& p : mkfs_paths) {
-        if (access(p, X_OK) == 0) {
-            mkfs_bin = p;
-            break;
-        }
+bool populate_ext4_image(const fs::path& mnt_dir, const fs::path& image_path,
+                         const std::vector<ErofsSource>& sources) {
+    LOG_INFO("Building populated modules.img from " + std::to_string(sources.size()) +
+             " sources");
+
+    auto started = std::chrono::steady_clock::now();
+    fs::path staged = image_slot(image_path);
+    if (!create_populated_image(sources, staged)) {
+        LOG_WARN("mke2fs could not populate modules.img");
+        return false;
     }
-    if (!mkfs_bin) {
-        LOG_ERROR("mkfs.erofs not found");
+
+    // The old image stays mounted until the new one is complete
+    umount2(mnt_dir.c_str(), MNT_DETACH);
+    if (!promote_image_slot(image_path, "")) {
+        std::error_code ec;
+        fs::remove(staged, ec);
+        throw std::runtime_error("Failed to replace modules.img");
+    }
+
+    ensure_dir_exists(mnt_dir);
+    if (!mount_image(image_path, mnt_dir, "ext4", "loop,rw,noatime")) {
+        throw std::runtime_error("Failed to mount populated modules.img");
+    }
+    send_unmountable(mnt_dir);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+    LOG_INFO("Ext4 image populated in " + std::to_string(elapsed) + " ms");
+    return true;
+}
+
+// Filesystem size and used bytes of an unmounted ext4 image, from its superblock
+static bool read_ext4_usage(const fs::path& image_path, uint64_t& total, uint64_t& used) {
+    int fd = open(image_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return false;
+    uint8_t sb[1024];
+    bool ok = pread(fd, sb, sizeof(sb), 1024) == static_cast<ssize_t>(sizeof(sb));
+    close(fd);
+    if (!ok || (sb[56] | sb[57] << 8) != 0xEF53)
+        return false;
+
+    auto le32 = [&sb](size_t off) -> uint64_t {
+        return static_cast<uint64_t>(sb[off]) | static_cast<uint64_t>(sb[off + 1]) << 8 |
+               static_cast<uint64_t>(sb[off + 2]) << 16 | static_cast<uint64_t>(sb[off + 3]) << 24;
+    };
+
+    uint64_t blocks = le32(4);
+    uint64_t free_blocks = le32(12);
+    if (le32(0x60) & 0x80) {  // INCOMPAT_64BIT
+        blocks |= le32(0x150) << 32;
+        free_blocks |= le32(0x158) << 32;
     }
+    uint64_t block_size = 1024ULL << le32(24);
+    total = blocks * block_size;
+    used = (blocks - std::min(free_blocks, blocks)) * block_size;
+    return true;
+}
 
-    std::string img_str = image_path.string();
-    std::string mod_str = modules_dir.string();
-    std::vector<const char*> argv = {mkfs_bin, "-zlz4hc,9", img_str.c_str(), mod_str.c_str(),
-                                    nullptr};
+static uint64_t round_up_mb(uint64_t bytes) {
+    const uint64_t mb = 1024 * 1024;
+    return (bytes + mb - 1) / mb * mb;
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        LOG_ERROR("fork failed: " + std::string(strerror(errno)));
+bool ensure_ext4_capacity(const fs::path& mnt_dir, const fs::path& image_path,
+                          const std::vector<ErofsSource>& sources) {
+    struct statfs st;
+    if (statfs(mnt_dir.c_str(), &st) != 0) {
+        LOG_WARN("statfs failed on " + mnt_dir.string());
         return false;
     }
-    if (pid == 0) {
-        int devnull = open("/dev/null", O_RDWR);
-        if (devnull >= 0) {
-            dup2(devnull, STDIN_FILENO);
-            dup2(devnull, STDOUT_FILENO);
-            dup2(devnull, STDERR_FILENO);
-            if (devnull > 2)
-                close(devnull);
-        }
-        execve(mkfs_bin, const_cast<char* const*>(argv.data()), ::environ);
-        _exit(127);
+
+    uint64_t needed = 0;
+    uint64_t inodes = 0;
+    populated_image_size(sources, st.f_bsize, needed, inodes);
+    uint64_t capacity = static_cast<uint64_t>(st.f_blocks) * st.f_bsize;
+    if (needed <= capacity)
+        return true;
+
+    std::string loop_name;
+    bool direct_io = false;
+    if (!find_image_loop(image_path, loop_name, direct_io)) {
+        LOG_WARN("modules.img has no loop device, cannot grow it");
+        return false;
     }
-    int status;
-    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-        LOG_ERROR("Failed to create EROFS image");
+
+    uint64_t new_size = round_up_mb(needed);
+    LOG_INFO("Growing modules.img to " + std::to_string(new_size / (1024 * 1024)) + " MB (" +
+             std::to_string(capacity / (1024 * 1024)) + " MB too small for the modules)");
+    if (truncate(image_path.c_str(), static_cast<off_t>(new_size)) != 0) {
+        LOG_ERROR("Failed to grow modules.img: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    // The loop device keeps the old size until told otherwise
+    std::string loop_dev = "/dev/block/" + loop_name;
+    if (access(loop_dev.c_str(), F_OK) != 0)
+        loop_dev = "/dev/" + loop_name;
+    int loop_fd = open(loop_dev.c_str(), O_RDONLY | O_CLOEXEC);
+    if (loop_fd < 0 || ioctl(loop_fd, LOOP_SET_CAPACITY, 0) != 0) {
+        LOG_ERROR("Failed to update loop capacity: " + std::string(strerror(errno)));
+        if (loop_fd >= 0)
+            close(loop_fd);
         return false;
     }
+    close(loop_fd);
 
-    LOG_INFO("EROFS image created");
+    // Online resize of the mounted filesystem, resize2fs if the kernel refuses
+    bool grown = false;
+    int dir_fd = open(mnt_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        uint64_t blocks = new_size / st.f_bsize;
+        grown = ioctl(dir_fd, EXT4_IOC_RESIZE_FS, &blocks) == 0;
+        if (!grown)
+            LOG_DEBUG("EXT4_IOC_RESIZE_FS failed: " + std::string(strerror(errno)));
+        close(dir_fd);
+    }
+    if (!grown)
+        grown = resize_image(loop_dev, new_size);
+
+    if (grown)
+        LOG_INFO("modules.img grown in place.");
+    return grown;
+}
+
+bool compact_image(const fs::path& image_path) {
+    std::string loop_name;
+    bool direct_io = false;
+    if (find_image_loop(image_path, loop_name, direct_io)) {
+        LOG_WARN("modules.img is in use, cannot compact it now");
+        return false;
+    }
+
+    // resize2fs only shrinks freshly checked filesystems
+    if (!repair_image(image_path))
+        return false;
+
+    uint64_t total = 0;
+    uint64_t used = 0;
+    if (!read_ext4_usage(image_path, total, used)) {
+        LOG_ERROR("modules.img is not an ext4 image");
+        return false;
+    }
+
+    // A grow that never reached the filesystem can leave the file larger than it
+    struct stat st;
+    uint64_t file_size = stat(image_path.c_str(), &st) == 0 ? st.st_size : total;
+
+    const uint64_t min_size = 64ULL * 1024 * 1024;
+    uint64_t target = round_up_mb(std::max(static_cast<uint64_t>(used * 1.2), min_size));
+    if (target >= file_size) {
+        LOG_INFO("modules.img already compact (" + std::to_string(file_size / (1024 * 1024)) +
+                 " MB)");
+        return true;
+    }
+
+    if (!resize_image(image_path, target))
+        return false;
+    if (truncate(image_path.c_str(), static_cast<off_t>(target)) != 0) {
+        LOG_ERROR("Failed to truncate modules.img: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    LOG_INFO("modules.img compacted: " + std::to_string(file_size / (1024 * 1024)) + " MB -> " +
+             std::to_string(target / (1024 * 1024)) + " MB");
     return true;
 }
 
-static bool try_setup_erofs(const fs::path& target, const fs::path& modules_dir,
-                            const fs::path& image_path) {
-    LOG_DEBUG("Attempting EROFS...");
+// EROFS images are written in-process, so only kernel support is needed
+static bool is_erofs_available() {
+    return is_erofs_supported();
+}
+
+// Writer format revision; part of the image cache digest
+static const char* const EROFS_WRITER_FORMAT = "native-v2 lz4";
 
-    if (!is_erofs_available()) {
-        LOG_WARN("mkfs.erofs not found.");
+std::string erofs_build_options() {
+    return std::string("erofs-writer ") + EROFS_WRITER_FORMAT;
+}
+
+static bool create_erofs_image(const std::vector<ErofsSource>& sources,
+                               const ErofsWriterOptions& options, const fs::path& image_path,
+                               ErofsWriterStats& stats) {
+    LOG_INFO("Creating EROFS image from " + std::to_string(sources.size()) + " sources");
+
+    auto started = std::chrono::steady_clock::now();
+    if (!write_erofs_image(sources, image_path, options, &stats)) {
+        LOG_ERROR("Failed to create EROFS image");
         return false;
     }
 
-    if (!create_erofs_image(modules_dir, image_path)) {
-        LOG_WARN("Failed to create EROFS image.");
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - started)
+                       .count();
+    LOG_INFO("EROFS image created: " + std::to_string(stats.inodes) + " inodes, " +
+             std::to_string(stats.compressed_files) + "/" + std::to_string(stats.files) +
+             " files compressed, " + std::to_string(stats.deduped_files) + " deduplicated, " +
+             std::to_string(stats.data_bytes / 1024) + " KB -> " +
+             std::to_string(stats.image_bytes / 1024) + " KB in " + std::to_string(elapsed) +
+             " ms");
+    return true;
+}
+
+bool build_erofs_image(const std::vector<ErofsSource>& sources, const ErofsWriterOptions& options,
+                       const fs::path& image_path, const std::string& digest,
+                       ErofsWriterStats* stats) {
+    // Written to the inactive slot, so a failed build leaves the active image intact
+    ErofsWriterStats result;
+    if (!create_erofs_image(sources, options, image_slot(image_path), result) ||
+        !promote_image_slot(image_path, digest, result.deduped_files, result.deduped_bytes)) {
         return false;
     }
 
-    if (!mount_image(image_path, target, "erofs", "loop,ro,noatime")) {
-        LOG_WARN("Failed to mount EROFS image.");
+    if (stats)
+        *stats = result;
+    return true;
+}
+
+bool mount_cached_erofs(const fs::path& mnt_dir, const fs::path& image_path,
+                        const std::string& digest, StorageHandle& handle) {
+    if (digest.empty() || !fs::exists(image_path) || read_digest_sidecar(image_path) != digest) {
+        return false;
+    }
+
+    if (fs::exists(mnt_dir)) {
+        umount2(mnt_dir.c_str(), MNT_DETACH);
+    }
+    ensure_dir_exists(mnt_dir);
+
+    if (!mount_image(image_path, mnt_dir, "erofs", "loop,ro,noatime")) {
+        LOG_WARN("Cached EROFS image failed to mount, rebuilding");
+        remove_digest_sidecar(image_path);
         return false;
     }
 
     // Register unmountable path for proper cleanup
-    send_unmountable(target);
+    send_unmountable(mnt_dir);
 
-    LOG_INFO("EROFS active (read-only, compressed)");
+    LOG_INFO("EROFS active (cached image, digest " + digest.substr(0, 12) + ")");
+    handle.mount_point = mnt_dir;
+    handle.mode = "erofs";
     return true;
 }
 
-StorageHandle setup_erofs_storage(const fs::path& mnt_dir, const fs::path& source_dir,
-                                  const fs::path& image_path) {
-    LOG_DEBUG("Setting up EROFS storage at " + mnt_dir.string() + " from " + source_dir.string());
+StorageHandle setup_erofs_storage(const fs::path& mnt_dir, const std::vector<ErofsSource>& sources,
+                                  const ErofsWriterOptions& options, const fs::path& image_path,
+                                  const std::string& digest, ErofsWriterStats* stats) {
+    LOG_DEBUG("Setting up EROFS storage at " + mnt_dir.string());
 
     if (fs::exists(mnt_dir)) {
         umount2(mnt_dir.c_str(), MNT_DETACH);
@@ -258,10 +581,10 @@ StorageHandle setup_erofs_storage(const fs::path& mnt_dir, const fs::path& sourc
     ensure_dir_exists(mnt_dir);
 
     if (!is_erofs_available()) {
-        throw std::runtime_error("mkfs.erofs not found");
+        throw std::runtime_error("EROFS not supported by kernel");
     }
 
-    if (!create_erofs_image(source_dir, image_path)) {
+    if (!build_erofs_image(sources, options, image_path, digest, stats)) {
         throw std::runtime_error("Failed to create EROFS image");
     }
 
@@ -273,7 +596,10 @@ StorageHandle setup_erofs_storage(const fs::path& mnt_dir, const fs::path& sourc
     send_unmountable(mnt_dir);
 
     LOG_INFO("EROFS active (read-only, compressed)");
-    return StorageHandle{mnt_dir, "erofs"};
+    StorageHandle handle;
+    handle.mount_point = mnt_dir;
+    handle.mode = "erofs";
+    return handle;
 }
 
 static std::string setup_ext4_image(const fs::path& target, const fs::path& image_path) {
@@ -284,6 +610,10 @@ static std::string setup_ext4_image(const fs::path& target, const fs::path& imag
         if (!create_image(image_path.parent_path())) {
             throw std::runtime_error("Failed to create modules.img");
         }
+    } else if (fs::exists(COMPACT_IMAGE_FILE)) {
+        // Requested while the image was mounted
+        fs::remove(COMPACT_IMAGE_FILE);
+        compact_image(image_path);
     }
 
     if (!mount_image(image_path, target, "ext4", "loop,rw,noatime")) {
@@ -305,6 +635,39 @@ static std::string setup_ext4_image(const fs::path& target, const fs::path& imag
     return "ext4";
 }
 
+// Hybrid: size-capped tmpfs for small modules, ext4 image as the spill tier
+static bool try_setup_hybrid(const fs::path& target, const fs::path& image_path,
+                             StorageHandle& handle) {
+    LOG_DEBUG("Attempting Hybrid...");
+
+    uint64_t budget = get_optimal_tmpfs_size("/system");
+    if (!mount_tmpfs(target, nullptr, budget)) {
+        LOG_WARN("Hybrid tmpfs mount failed.");
+        return false;
+    }
+
+    if (!is_xattr_supported(target)) {
+        LOG_WARN("Tmpfs lacks XATTR support. Unmounting...");
+        umount2(target.c_str(), MNT_DETACH);
+        return false;
+    }
+    handle.tmpfs_budget = budget;
+
+    fs::path spill_dir = target / HYBRID_SPILL_DIR;
+    try {
+        setup_ext4_image(spill_dir, image_path);
+        handle.spill_dir = spill_dir;
+        // Spilled modules are written into the image, so it no longer matches
+        remove_digest_sidecar(image_path);
+    } catch (const std::exception& e) {
+        LOG_WARN("Spill image unavailable, large modules will be referenced in place: " +
+                 std::string(e.what()));
+    }
+
+    LOG_INFO("Hybrid active (tmpfs budget " + std::to_string(budget / (1024 * 1024)) + "MB).");
+    return true;
+}
+
 StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
                             FilesystemType fs_type) {
     LOG_DEBUG("Setting up storage at " + mnt_dir.string());
@@ -314,9 +677,9 @@ StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
     }
     ensure_dir_exists(mnt_dir);
 
+    StorageHandle handle;
+    handle.mount_point = mnt_dir;
     std::string mode;
-    fs::path erofs_image = image_path.parent_path() / "modules.erofs";
-    fs::path modules_dir = image_path.parent_path() / "modules";
 
     // Helper functions for readability
     auto do_tmpfs = [&]() {
@@ -327,12 +690,16 @@ StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
         return false;
     };
 
+    // The image can only be built (or reused) once the modules are known, so this
+    // just selects EROFS; callers follow up with mount_cached_erofs() or
+    // setup_erofs_storage().
     auto do_erofs = [&]() {
-        if (try_setup_erofs(mnt_dir, modules_dir, erofs_image)) {
-            mode = "erofs";
-            return true;
+        if (!is_erofs_available()) {
+            LOG_WARN("EROFS not supported by kernel.");
+            return false;
         }
-        return false;
+        mode = "erofs";
+        return true;
     };
 
     auto do_ext4 = [&]() {
@@ -340,6 +707,14 @@ StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
         return true;
     };
 
+    auto do_hybrid = [&]() {
+        if (try_setup_hybrid(mnt_dir, image_path, handle)) {
+            mode = "hybrid";
+            return true;
+        }
+        return false;
+    };
+
     switch (fs_type) {
     case FilesystemType::EXT4:
         do_ext4();
@@ -352,6 +727,13 @@ StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
         }
         break;
 
+    case FilesystemType::HYBRID:
+        if (!do_hybrid()) {
+            LOG_WARN("Hybrid setup failed, falling back to ext4");
+            do_ext4();
+        }
+        break;
+
     case FilesystemType::TMPFS:
         if (!do_tmpfs()) {
             LOG_WARN("Tmpfs setup failed (or no xattr), falling back to auto preference");
@@ -371,7 +753,8 @@ StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
         break;
     }
 
-    return StorageHandle{mnt_dir, mode};
+    handle.mode = mode;
+    return handle;
 }
 
 void finalize_storage_permissions(const fs::path& storage_root) {
@@ -396,20 +779,6 @@ static std::string format_size(uint64_t bytes) {
     return std::string(buf);
 }
 
-static uint64_t calculate_dir_size(const fs::path& path) {
-    uint64_t total = 0;
-    try {
-        for (const auto& entry : fs::recursive_directory_iterator(path)) {
-            if (entry.is_regular_file()) {
-                total += entry.file_size();
-            }
-        }
-    } catch (...) {
-        // Ignore errors and return best-effort size
-    }
-    return total;
-}
-
 void print_storage_status() {
     auto state = load_runtime_state();
 
@@ -444,31 +813,12 @@ void print_storage_status() {
     uint64_t used_bytes = total_bytes > free_bytes ? total_bytes - free_bytes : 0;
     double percent = total_bytes > 0 ? (used_bytes * 100.0 / total_bytes) : 0.0;
 
-    // Fallback: if used shows 0 but directory has files, compute logical size
-    if (used_bytes == 0 && fs::exists(path)) {
-        uint64_t logical_used = calculate_dir_size(path);
-        if (logical_used > 0) {
-            used_bytes = logical_used;
-            percent = total_bytes > 0 ? (used_bytes * 100.0 / total_bytes) : 0.0;
-        }
-    }
-
-    // Mirror/tmpfs mode: data may live in moduledir rather than mount_point
-    if (used_bytes == 0 && state.storage_mode == "tmpfs") {
-        try {
-            Config cfg = Config::load_default();
-            fs::path module_root =
-                cfg.moduledir.empty() ? fs::path("/data/adb/modules") : fs::path(cfg.moduledir);
-            if (fs::exists(module_root)) {
-                uint64_t logical_used = calculate_dir_size(module_root);
-                if (logical_used > 0) {
-                    used_bytes = logical_used;
-                    percent = total_bytes > 0 ? (used_bytes * 100.0 / total_bytes) : 0.0;
-                }
-            }
-        } catch (...) {
-            // Ignore and keep statfs results
-        }
+    // Fallback: if used shows 0 (data referenced from the module dir, or an empty
+    // mirror), report the usage measured when the modules were mounted
+    uint64_t module_used = total_module_usage(state);
+    if (used_bytes == 0 && module_used > 0) {
+        used_bytes = module_used;
+        percent = total_bytes > 0 ? (used_bytes * 100.0 / total_bytes) : 0.0;
     }
 
     // Explicitly check for 0 total bytes which might indicate issue with the mount
@@ -481,8 +831,66 @@ void print_storage_status() {
     root["avail"] = json::Value(format_size(free_bytes));
     root["percent"] = json::Value(percent);
     root["mode"] = json::Value(fs_type);
+    root["dedup_saved"] = json::Value(format_size(state.dedup_bytes_saved));
+    root["dedup_files"] = json::Value(static_cast<double>(state.dedup_files_linked));
+    root["try_umount_paths"] = json::Value(static_cast<double>(state.try_umount_paths));
+    json::Value modules = json::Value::array();
+    for (const auto& entry : state.module_usage_bytes) {
+        json::Value module = json::Value::object();
+        module["id"] = json::Value(entry.first);
+        module["size"] = json::Value(format_size(entry.second));
+        module["bytes"] = json::Value(static_cast<double>(entry.second));
+        modules.push_back(module);
+    }
+    root["modules"] = modules;
+    if (state.storage_mode == "hybrid") {
+        root["tmpfs_budget"] = json::Value(format_size(state.tmpfs_budget));
+        json::Value spilled = json::Value::array();
+        for (const auto& id : state.spilled_module_ids) {
+            spilled.push_back(json::Value(id));
+        }
+        root["spilled"] = spilled;
+    }
 
     std::cout << json::dump(root) << "\n";
 }
 
+void print_image_cache_status() {
+    // Attached images: with direct I/O the image file itself should stay out of
+    // the page cache, leaving only the filesystem's own cached pages
+    std::vector<fs::path> image_paths = {fs::path(BASE_DIR) / "modules.img",
+                                         fs::path(BASE_DIR) / "modules.erofs"};
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(fs::path(BASE_DIR) / "erofs", ec)) {
+        if (entry.path().extension() == ".erofs")
+            image_paths.push_back(entry.path());
+    }
+    std::sort(image_paths.begin() + 2, image_paths.end());
+
+    json::Value images = json::Value::array();
+    uint64_t image_cached = 0;
+    for (const auto& image_path : image_paths) {
+        std::string loop_name;
+        bool direct_io = false;
+        if (!find_image_loop(image_path, loop_name, direct_io))
+            continue;
+
+        uint64_t cached = file_cached_bytes(image_path);
+        image_cached += cached;
+        json::Value image = json::Value::object();
+        image["path"] = json::Value(image_path.string());
+        image["loop"] = json::Value(loop_name);
+        image["direct_io"] = json::Value(direct_io);
+        struct stat st;
+        uint64_t size = stat(image_path.c_str(), &st) == 0 ? st.st_size : 0;
+        image["size"] = json::Value(format_size(size));
+        image["cached"] = json::Value(format_size(cached));
+        images.push_back(image);
+    }
+    json::Value root = json::Value::object();
+    root["images"] = images;
+    root["image_cached"] = json::Value(format_size(image_cached));
+    std::cout << json::dump(root) << "\n";
+}
+
 }  // namespace hymo
\ No newline at end of file
@@ -1,9 +1,12 @@
 // core/storage.hpp - Storage management
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <string>
+#include <vector>
 #include "../conf/config.hpp"
+#include "erofs.hpp"
 
 namespace fs = std::filesystem;
 
@@ -11,17 +14,69 @@ namespace hymo {
 
 struct StorageHandle {
     fs::path mount_point;
-    std::string mode;  // tmpfs, ext4, erofs
+    std::string mode;           // tmpfs, ext4, erofs, hybrid
+    fs::path spill_dir;         // hybrid: ext4 tier for large modules (empty if unavailable)
+    uint64_t tmpfs_budget = 0;  // hybrid: size= cap of the tmpfs tier
 };
 
 StorageHandle setup_storage(const fs::path& mnt_dir, const fs::path& image_path,
                             FilesystemType fs_type);
 
-// Build an EROFS image from `source_dir` and mount it read-only at `mnt_dir`.
-// This is intended for mirror flows where content must be synced to a writable
-// staging directory before creating the compressed EROFS image.
-StorageHandle setup_erofs_storage(const fs::path& mnt_dir, const fs::path& source_dir,
-                                  const fs::path& image_path);
+// Build an EROFS image from `sources` and mount it read-only at `mnt_dir`. The
+// image is written straight from the source dirs; `options` supply the labels
+// and owners. A non-empty `digest` is recorded next to the image for
+// mount_cached_erofs(). Throws on failure.
+StorageHandle setup_erofs_storage(const fs::path& mnt_dir, const std::vector<ErofsSource>& sources,
+                                  const ErofsWriterOptions& options, const fs::path& image_path,
+                                  const std::string& digest = "",
+                                  ErofsWriterStats* stats = nullptr);
+
+// Mount `image_path` read-only at `mnt_dir` if it was built from inputs with the
+// given manifest digest. Returns false (nothing mounted) when it must be rebuilt.
+bool mount_cached_erofs(const fs::path& mnt_dir, const fs::path& image_path,
+                        const std::string& digest, StorageHandle& handle);
+
+// Build `image_path` from `sources` without mounting it, recording `digest`
+// (if non-empty) once the image is complete.
+bool build_erofs_image(const std::vector<ErofsSource>& sources, const ErofsWriterOptions& options,
+                       const fs::path& image_path, const std::string& digest,
+                       ErofsWriterStats* stats = nullptr);
+
+// Build options folded into the EROFS image digest
+std::string erofs_build_options();
+
+// Inactive slot next to an image ("modules.erofs.b"): new images are built there
+// and only renamed over the active one once complete
+fs::path image_slot(const fs::path& image_path);
+
+// Atomically replace `image_path` with its slot and record `digest` (if non-empty)
+// along with the dedup savings of the build
+bool promote_image_slot(const fs::path& image_path, const std::string& digest,
+                        uint64_t files_linked = 0, uint64_t bytes_saved = 0);
+
+// Write `image_path` as an ext4 image already holding `sources` (mke2fs -d),
+// unmounted and unlabeled
+bool create_populated_image(const std::vector<ErofsSource>& sources, const fs::path& image_path);
+
+// Replace `image_path` with an ext4 image already holding `sources` (mke2fs -d)
+// and mount it read-write at `mnt_dir` in place of the old one. Labels are left
+// to the caller. Returns false, with the old image still mounted, if mke2fs
+// can't populate images; throws if the new image can't be mounted.
+bool populate_ext4_image(const fs::path& mnt_dir, const fs::path& image_path,
+                         const std::vector<ErofsSource>& sources);
+
+// Grow the mounted `image_path` in place (file, loop device and filesystem) when
+// it is too small to hold `sources`. Returns false if it is too small and
+// couldn't be grown.
+bool ensure_ext4_capacity(const fs::path& mnt_dir, const fs::path& image_path,
+                          const std::vector<ErofsSource>& sources);
+
+// Shrink the unmounted ext4 `image_path` to its contents plus headroom (resize2fs).
+// Fails while the image is mounted.
+bool compact_image(const fs::path& image_path);
+
+// Build options folded into the populated ext4 image digest
+std::string ext4_build_options();
 
 // Exposed for CLI tools
 bool create_image(const fs::path& base_dir);
@@ -30,4 +85,9 @@ void finalize_storage_permissions(const fs::path& storage_root);
 
 void print_storage_status();
 
+// Loop device, direct I/O state and page cache use of every attached image. Kept
+// out of print_storage_status(), which the WebUI polls: it maps each image and
+// scans /sys/block.
+void print_image_cache_status();
+
 }  // namespace hymo
\ No newline at end of file
@@ -1,9 +1,24 @@
 // core/sync.cpp - Module content sync
 #include "sync.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <map>
 #include <set>
 #include "../defs.hpp"
 #include "../utils.hpp"
+#include "file_contexts.hpp"
+#include "json.hpp"
 
 namespace hymo {
 
@@ -63,7 +78,7 @@ static void prune_orphaned_modules(const std::vector<Module>& modules,
         for (const auto& entry : fs::directory_iterator(storage_root)) {
             std::string name = entry.path().filename().string();
 
-            if (name == "lost+found" || name == "hymo") {
+            if (name == "lost+found" || name == "hymo" || name == HYBRID_SPILL_DIR) {
                 continue;
             }
 
@@ -81,63 +96,241 @@ static void prune_orphaned_modules(const std::vector<Module>& modules,
     }
 }
 
-// Map SELinux context from system if possible
-static void recursive_context_repair(const fs::path& base, const fs::path& current) {
-    if (!fs::exists(current)) {
+// Context of the live on-device path, or false if it doesn't exist
+static bool system_context(const std::string& device_path, std::string& context) {
+    struct stat st;
+    if (lstat(device_path.c_str(), &st) != 0)
+        return false;
+    context = lgetfilecon(device_path);
+    // Fix rootfs context
+    if (context.find("u:object_r:rootfs:s0") != std::string::npos)
+        context = get_context_for_path(device_path);
+    return true;
+}
+
+// The label a mirror entry should carry: the live system path's context when no
+// file_contexts were loaded (and the path exists), else the compiled lookup
+static std::string module_entry_context(const std::string& device_path, mode_t mode) {
+    std::string context;
+    if (file_contexts_spec_count() == 0 && system_context(device_path, context))
+        return context;
+    return resolve_file_context(device_path, mode);
+}
+
+// Label one mirror entry. Regular files and directories go through an fd opened
+// relative to the held parent; symlinks and special nodes have no usable fd.
+static void label_entry_at(int dir_fd, const char* name, mode_t mode, int entry_fd,
+                           const std::string& mirror_path, const std::string& context) {
+    if (entry_fd >= 0) {
+        fsetfilecon(entry_fd, context);
+        return;
+    }
+    if (S_ISREG(mode)) {
+        int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0) {
+            fsetfilecon(fd, context);
+            close(fd);
+            return;
+        }
+    }
+    lsetfilecon(mirror_path, context);
+}
+
+// Map SELinux context from system if possible. Used when no file_contexts could
+// be loaded (otherwise sync_dir() already labeled every file), and with
+// `all_entries` for trees that were not copied by sync_dir() at all.
+// Takes ownership of `dir_fd`; both paths are extended per entry and restored.
+static void recursive_context_repair(int dir_fd, std::string& mirror_path,
+                                     std::string& device_path, bool all_entries) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        LOG_DEBUG("Context repair failed: " + mirror_path);
         return;
     }
 
-    try {
-        std::string file_name = current.filename().string();
+    const size_t mirror_len = mirror_path.size();
+    const size_t device_len = device_path.size();
+    std::string parent_ctx;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        mirror_path.append("/").append(name);
+        device_path.append("/").append(name);
+
+        int child_fd = -1;
+        if (S_ISDIR(st.st_mode))
+            child_fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 
         // Use parent context for internal overlay structs
-        if (file_name == "upperdir" || file_name == "workdir") {
-            if (current.has_parent_path()) {
-                fs::path parent = current.parent_path();
-                try {
-                    std::string parent_ctx = lgetfilecon(parent);
-                    lsetfilecon(current, parent_ctx);
-                } catch (...) {
-                }
-            }
+        if (strcmp(name, "upperdir") == 0 || strcmp(name, "workdir") == 0) {
+            if (parent_ctx.empty())
+                parent_ctx = fgetfilecon(dirfd(dir));
+            label_entry_at(dirfd(dir), name, st.st_mode, child_fd, mirror_path, parent_ctx);
+        } else if (all_entries) {
+            label_entry_at(dirfd(dir), name, st.st_mode, child_fd, mirror_path,
+                           module_entry_context(device_path, st.st_mode));
         } else {
-            fs::path relative = fs::relative(current, base);
-            fs::path system_path = fs::path("/") / relative;
-
-            if (fs::exists(system_path)) {
-                copy_path_context(system_path, current);
-            }
+            std::string context;
+            if (system_context(device_path, context))
+                label_entry_at(dirfd(dir), name, st.st_mode, child_fd, mirror_path, context);
         }
 
-        if (fs::is_directory(current)) {
-            for (const auto& entry : fs::directory_iterator(current)) {
-                recursive_context_repair(base, entry.path());
-            }
-        }
-    } catch (const std::exception& e) {
-        LOG_DEBUG("Context repair failed: " + current.string());
+        if (child_fd >= 0)
+            recursive_context_repair(child_fd, mirror_path, device_path, all_entries);
+
+        mirror_path.resize(mirror_len);
+        device_path.resize(device_len);
     }
+
+    closedir(dir);
 }
 
 static void repair_module_contexts(const fs::path& module_root, const std::string& module_id,
-                                   const std::vector<std::string>& all_partitions) {
+                                   const std::vector<std::string>& all_partitions,
+                                   bool all_entries = false) {
     LOG_DEBUG("Repairing SELinux contexts for: " + module_id);
 
+    int root_fd = open(module_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return;
+
+    std::string mirror_path = module_root.string();
+    const size_t root_len = mirror_path.size();
+    std::string device_path;
+    mirror_path.reserve(PATH_MAX);
+    device_path.reserve(PATH_MAX);
+
+    // Partition roots are labeled like any other entry, then walked
     for (const auto& partition : all_partitions) {
-        fs::path part_root = module_root / partition;
+        int part_fd =
+            openat(root_fd, partition.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (part_fd < 0)
+            continue;
 
-        if (fs::exists(part_root) && fs::is_directory(part_root)) {
-            try {
-                recursive_context_repair(module_root, part_root);
-            } catch (const std::exception& e) {
-                LOG_WARN("Context repair failed for " + module_id + "/" + partition);
-            }
+        mirror_path.append("/").append(partition);
+        device_path.append("/").append(partition);
+        std::string context;
+        if (all_entries)
+            fsetfilecon(part_fd, module_entry_context(device_path, S_IFDIR));
+        else if (system_context(device_path, context))
+            fsetfilecon(part_fd, context);
+        recursive_context_repair(part_fd, mirror_path, device_path, all_entries);
+        mirror_path.resize(root_len);
+        device_path.clear();
+    }
+
+    close(root_fd);
+}
+
+static uint64_t module_size(const fs::path& path) {
+    uint64_t total = 0;
+    try {
+        for (const auto& entry : fs::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file() && !entry.is_symlink())
+                total += entry.file_size();
+        }
+    } catch (...) {
+        // Best-effort size
+    }
+    return total;
+}
+
+// Bind a module from the spill tier (or its source dir) read-only into the mirror
+static bool spill_module(const std::string& id, const fs::path& src, const fs::path& dst,
+                         SpillPolicy& spill) {
+    fs::path source = src;
+    if (!spill.spill_dir.empty()) {
+        // The tier outlives reboots; start from an empty copy so files the
+        // module dropped don't linger
+        fs::path spill_dst = spill.spill_dir / id;
+        std::error_code ec;
+        fs::remove_all(spill_dst, ec);
+        if (ec) {
+            LOG_WARN("Failed to clear spill tier copy of " + id + ": " + ec.message());
+        }
+        if (sync_dir(src, spill_dst)) {
+            source = spill_dst;
+        } else {
+            LOG_WARN("Spill tier sync failed for " + id + ", referencing in place");
+        }
+    }
+
+    if (!ensure_dir_exists(dst))
+        return false;
+
+    if (mount(source.c_str(), dst.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0) {
+        LOG_ERROR("Failed to bind spilled module " + id + ": " + strerror(errno));
+        return false;
+    }
+    if (mount(nullptr, dst.c_str(), nullptr, MS_REMOUNT | MS_BIND | MS_RDONLY, nullptr) != 0) {
+        LOG_WARN("Failed to remount spilled module read-only: " + id);
+    }
+    send_unmountable(dst);
+
+    spill.spilled_ids.push_back(id);
+    LOG_INFO("Spilled module " + id + " <- " + source.string());
+    return true;
+}
+
+bool sync_module(const std::string& id, const fs::path& src, const fs::path& dst,
+                 SpillPolicy* spill) {
+    if (!spill) {
+        return sync_dir(src, dst);
+    }
+
+    if (module_size(src) <= spill->threshold) {
+        if (sync_dir(src, dst)) {
+            return true;
+        }
+
+        // Most likely ENOSPC: the tmpfs budget is exhausted
+        LOG_WARN("Module " + id + " did not fit the tmpfs tier, spilling");
+        try {
+            fs::remove_all(dst);
+        } catch (...) {
+            LOG_WARN("Failed to clean partial copy of " + id);
+        }
+    }
+
+    return spill_module(id, src, dst, *spill);
+}
+
+void prune_spill_tier(const SpillPolicy& spill, const std::vector<std::string>& keep) {
+    if (spill.spill_dir.empty()) {
+        return;
+    }
+
+    std::set<std::string> kept(keep.begin(), keep.end());
+    kept.insert(spill.spilled_ids.begin(), spill.spilled_ids.end());
+
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(spill.spill_dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name == "lost+found" || kept.count(name)) {
+            continue;
+        }
+
+        LOG_INFO("Pruning stale spill tier copy: " + name);
+        std::error_code rm_ec;
+        fs::remove_all(entry.path(), rm_ec);
+        if (rm_ec) {
+            LOG_WARN("Failed to remove: " + name);
         }
     }
 }
 
-void perform_sync(const std::vector<Module>& modules, const fs::path& storage_root,
-                  const Config& config) {
+std::vector<std::string> perform_sync(const std::vector<Module>& modules,
+                                      const fs::path& storage_root, const Config& config,
+                                      SpillPolicy* spill) {
     LOG_INFO("Syncing modules to " + storage_root.string());
 
     std::vector<std::string> all_partitions = BUILTIN_PARTITIONS;
@@ -147,6 +340,8 @@ void perform_sync(const std::vector<Module>& modules, const fs::path& storage_ro
 
     prune_orphaned_modules(modules, storage_root);
 
+    std::vector<std::string> synced_ids;
+    std::vector<std::string> unchanged_ids;
     for (const auto& module : modules) {
         fs::path dst = storage_root / module.id;
 
@@ -166,17 +361,407 @@ void perform_sync(const std::vector<Module>& modules, const fs::path& storage_ro
                 }
             }
 
-            if (!sync_dir(module.source_path, dst)) {
+            if (!sync_module(module.id, module.source_path, dst, spill)) {
                 LOG_ERROR("Failed to sync: " + module.id);
-            } else {
+                continue;
+            }
+            synced_ids.push_back(module.id);
+
+            if (spill && !spill->spilled_ids.empty() && spill->spilled_ids.back() == module.id) {
+                // The mirror side is a read-only bind; label the spill tier copy instead
+                if (!spill->spill_dir.empty() && file_contexts_spec_count() == 0) {
+                    repair_module_contexts(spill->spill_dir / module.id, module.id,
+                                           all_partitions);
+                }
+            } else if (file_contexts_spec_count() == 0) {
                 repair_module_contexts(dst, module.id, all_partitions);
             }
         } else {
             LOG_DEBUG("Up-to-date: " + module.id);
+            unchanged_ids.push_back(module.id);
         }
     }
 
+    if (spill) {
+        prune_spill_tier(*spill, unchanged_ids);
+    }
+
     LOG_INFO("Sync completed.");
+    return synced_ids;
+}
+
+void label_module_mirror(const std::vector<Module>& modules, const fs::path& storage_root,
+                         const Config& config) {
+    std::vector<std::string> all_partitions = BUILTIN_PARTITIONS;
+    for (const auto& part : config.partitions) {
+        all_partitions.push_back(part);
+    }
+
+    const std::string root_context = module_entry_context("/", S_IFDIR);
+    for (const auto& module : modules) {
+        fs::path module_root = storage_root / module.id;
+        if (!fs::is_directory(module_root))
+            continue;
+        lsetfilecon(module_root, root_context);
+        repair_module_contexts(module_root, module.id, all_partitions, true);
+    }
+}
+
+std::vector<ErofsSource> erofs_module_sources(const std::vector<Module>& modules,
+                                              const Config& config, bool flat) {
+    std::vector<std::string> all_partitions = BUILTIN_PARTITIONS;
+    for (const auto& part : config.partitions) {
+        all_partitions.push_back(part);
+    }
+
+    std::vector<ErofsSource> sources;
+    for (const auto& module : modules) {
+        ErofsSource source;
+        source.dir = module.source_path;
+        source.name = flat ? "" : module.id;
+        for (const auto& partition : all_partitions) {
+            if (has_files_recursive(module.source_path / partition))
+                source.include.push_back(partition);
+        }
+
+        if (source.include.empty()) {
+            LOG_DEBUG("Skipping empty module: " + module.id);
+            continue;
+        }
+        sources.push_back(std::move(source));
+    }
+    return sources;
+}
+
+ErofsWriterOptions erofs_module_options() {
+    ErofsWriterOptions options;
+    options.uid = 0;
+    options.gid = 0;
+    // The same labels sync_dir() and repair_module_contexts() would apply
+    options.label = module_entry_context;
+    return options;
+}
+
+// Content deduplication
+namespace {
+
+struct DedupInode {
+    uint64_t size = 0;
+    uid_t uid = 0;
+    gid_t gid = 0;
+    mode_t mode = 0;
+    bool synced = false;  // has a path in a module synced this time
+    std::vector<fs::path> paths;
+};
+
+}  // namespace
+
+static bool crc_file(const fs::path& path, uint32_t& crc_out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return false;
+
+    std::vector<unsigned char> buf(64 * 1024);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) {
+        crc = crc32(crc, buf.data(), static_cast<uInt>(n));
+    }
+    close(fd);
+    if (n < 0)
+        return false;
+
+    crc_out = static_cast<uint32_t>(crc);
+    return true;
+}
+
+// CRC only groups candidates; linking always requires a byte-for-byte match
+static bool files_equal(const fs::path& a, const fs::path& b) {
+    int fa = open(a.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fa < 0)
+        return false;
+    int fb = open(b.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fb < 0) {
+        close(fa);
+        return false;
+    }
+
+    std::vector<char> buf_a(64 * 1024);
+    std::vector<char> buf_b(64 * 1024);
+    bool equal = true;
+    while (equal) {
+        ssize_t na = read(fa, buf_a.data(), buf_a.size());
+        ssize_t nb = read(fb, buf_b.data(), buf_b.size());
+        if (na < 0 || nb < 0 || na != nb) {
+            equal = false;
+        } else if (na == 0) {
+            break;
+        } else if (memcmp(buf_a.data(), buf_b.data(), na) != 0) {
+            equal = false;
+        }
+    }
+
+    close(fa);
+    close(fb);
+    return equal;
+}
+
+// Swap `dup` for a hardlink to `canonical` without leaving a window where it is missing
+static bool replace_with_link(const fs::path& canonical, const fs::path& dup) {
+    fs::path tmp = dup;
+    tmp += ".hymo_dedup";
+    unlink(tmp.c_str());
+
+    if (link(canonical.c_str(), tmp.c_str()) != 0) {
+        LOG_DEBUG("dedup: link failed for " + dup.string() + ": " + strerror(errno));
+        return false;
+    }
+    if (rename(tmp.c_str(), dup.c_str()) != 0) {
+        LOG_DEBUG("dedup: rename failed for " + dup.string() + ": " + strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+DedupStats dedup_storage(const fs::path& storage_root, const std::vector<std::string>& module_ids,
+                         const std::vector<std::string>* synced_ids) {
+    DedupStats stats;
+
+    struct stat root_st;
+    if (stat(storage_root.c_str(), &root_st) != 0)
+        return stats;
+
+    // Index regular files by inode so existing hardlinks are only counted once
+    std::vector<DedupInode> inodes;
+    std::map<std::pair<dev_t, ino_t>, size_t> inode_index;
+    std::map<uint64_t, std::vector<size_t>> by_size;
+
+    for (const auto& id : module_ids) {
+        fs::path module_root = storage_root / id;
+        // Spilled modules are binds from another filesystem; links to them fail (EXDEV)
+        struct stat module_st;
+        if (stat(module_root.c_str(), &module_st) != 0 || !S_ISDIR(module_st.st_mode) ||
+            module_st.st_dev != root_st.st_dev)
+            continue;
+        bool synced = !synced_ids || std::find(synced_ids->begin(), synced_ids->end(), id) !=
+                                         synced_ids->end();
+
+        try {
+            for (const auto& entry : fs::recursive_directory_iterator(module_root)) {
+                struct stat st;
+                if (lstat(entry.path().c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+                    st.st_size == 0 || st.st_dev != root_st.st_dev) {
+                    continue;
+                }
+
+                auto key = std::make_pair(st.st_dev, st.st_ino);
+                auto it = inode_index.find(key);
+                if (it != inode_index.end()) {
+                    inodes[it->second].paths.push_back(entry.path());
+                    inodes[it->second].synced |= synced;
+                    continue;
+                }
+
+                DedupInode inode;
+                inode.size = static_cast<uint64_t>(st.st_size);
+                inode.uid = st.st_uid;
+                inode.gid = st.st_gid;
+                inode.mode = st.st_mode;
+                inode.synced = synced;
+                inode.paths.push_back(entry.path());
+
+                inode_index[key] = inodes.size();
+                by_size[inode.size].push_back(inodes.size());
+                inodes.push_back(std::move(inode));
+            }
+        } catch (const std::exception& e) {
+            LOG_WARN("dedup: failed to scan " + module_root.string() + ": " + e.what());
+        }
+    }
+
+    // Links left by earlier runs on a persistent mirror are savings too: every
+    // path beyond an inode's first is a file that takes no space of its own
+    for (const auto& inode : inodes) {
+        if (inode.paths.size() > 1) {
+            stats.files_linked += inode.paths.size() - 1;
+            stats.bytes_saved += inode.size * (inode.paths.size() - 1);
+        }
+    }
+
+    for (const auto& [size, candidates] : by_size) {
+        if (candidates.size() < 2)
+            continue;
+        // Nothing new of this size: it was settled when those files were synced
+        if (std::none_of(candidates.begin(), candidates.end(),
+                         [&inodes](size_t idx) { return inodes[idx].synced; }))
+            continue;
+
+        // Inodes can only be merged when every attribute they would share is identical
+        std::map<std::string, std::vector<size_t>> groups;
+        for (size_t idx : candidates) {
+            const auto& inode = inodes[idx];
+            uint32_t crc = 0;
+            if (!crc_file(inode.paths.front(), crc))
+                continue;
+
+            std::string key = std::to_string(crc) + ":" + std::to_string(inode.uid) + ":" +
+                              std::to_string(inode.gid) + ":" + std::to_string(inode.mode) + ":" +
+                              lgetfilecon(inode.paths.front());
+            groups[key].push_back(idx);
+        }
+
+        for (const auto& [key, members] : groups) {
+            const auto& canonical = inodes[members.front()].paths.front();
+            for (size_t i = 1; i < members.size(); ++i) {
+                const auto& dup = inodes[members[i]];
+                if (!files_equal(canonical, dup.paths.front()))
+                    continue;
+
+                size_t linked = 0;
+                for (const auto& path : dup.paths) {
+                    if (replace_with_link(canonical, path))
+                        linked++;
+                }
+                // Links `dup` already had were counted above; merging it frees one inode
+                if (linked == dup.paths.size()) {
+                    stats.files_linked++;
+                    stats.bytes_saved += size;
+                }
+            }
+        }
+    }
+
+    LOG_INFO("Dedup: linked " + std::to_string(stats.files_linked) + " files, saved " +
+             std::to_string(stats.bytes_saved / 1024) + " KB");
+    return stats;
+}
+
+// Small files dominate real modules; every 50th file is larger than one
+// io_uring buffer slot so both copy paths are exercised.
+static uint64_t build_bench_tree(const fs::path& root, int file_count) {
+    uint64_t total = 0;
+    uint32_t seed = 0x9e3779b9;
+    std::vector<char> data(256 * 1024);
+    for (auto& c : data) {
+        seed = seed * 1664525 + 1013904223;
+        c = static_cast<char>(seed >> 24);
+    }
+
+    for (int i = 0; i < file_count; ++i) {
+        fs::path dir = root / "system" / "priv-app" / ("Bench" + std::to_string(i / 40)) / "lib";
+        if (i % 40 == 0)
+            ensure_dir_exists(dir);
+
+        size_t size = (i % 50 == 49) ? data.size() : 512 + (i * 977) % (48 * 1024);
+        std::ofstream out(dir / ("f" + std::to_string(i) + ".so"), std::ios::binary);
+        out.write(data.data() + (i % 64), static_cast<std::streamsize>(size - (i % 64)));
+        total += size - (i % 64);
+    }
+    return total;
+}
+
+// Allocated bytes below `dir_fd` (closed here); inodes already in `seen` are skipped
+static uint64_t tree_usage(int dir_fd, std::set<std::pair<dev_t, ino_t>>& seen) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return 0;
+    }
+
+    uint64_t total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        if (!seen.insert({st.st_dev, st.st_ino}).second)
+            continue;
+        total += static_cast<uint64_t>(st.st_blocks) * 512;
+
+        if (S_ISDIR(st.st_mode)) {
+            int child_fd =
+                openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd >= 0)
+                total += tree_usage(child_fd, seen);
+        }
+    }
+
+    closedir(dir);
+    return total;
+}
+
+std::vector<std::pair<std::string, uint64_t>> measure_module_usage(
+    const fs::path& storage_root, const std::vector<std::string>& module_ids,
+    const std::vector<std::string>* synced_ids,
+    const std::vector<std::pair<std::string, uint64_t>>& previous) {
+    std::vector<std::pair<std::string, uint64_t>> usage;
+    std::set<std::pair<dev_t, ino_t>> seen;
+    for (const auto& id : module_ids) {
+        // Unchanged since it was last measured
+        if (synced_ids &&
+            std::find(synced_ids->begin(), synced_ids->end(), id) == synced_ids->end()) {
+            auto prev = std::find_if(previous.begin(), previous.end(),
+                                     [&id](const auto& entry) { return entry.first == id; });
+            if (prev != previous.end()) {
+                usage.push_back(*prev);
+                continue;
+            }
+        }
+
+        int fd = open((storage_root / id).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        usage.emplace_back(id, tree_usage(fd, seen));
+    }
+    return usage;
+}
+
+bool run_sync_benchmark(const fs::path& work_dir, int file_count) {
+    std::error_code ec;
+    fs::remove_all(work_dir, ec);
+    fs::path src = work_dir / "src";
+    fs::path dst = work_dir / "dst";
+    uint64_t bytes = build_bench_tree(src, file_count);
+
+    json::Value root = json::Value::object();
+    root["files"] = json::Value(file_count);
+    root["bytes"] = json::Value(static_cast<double>(bytes));
+    json::Value results = json::Value::array();
+
+    bool all_ok = true;
+    for (const char* engine : {"sync", "uring"}) {
+        json::Value result = json::Value::object();
+        result["engine"] = json::Value(engine);
+        result["active"] = json::Value(set_copy_engine(engine));
+
+        // Best of three runs into a fresh destination
+        uint64_t best_ms = UINT64_MAX;
+        bool ok = true;
+        for (int round = 0; round < 3 && ok; ++round) {
+            fs::remove_all(dst, ec);
+            auto start = std::chrono::steady_clock::now();
+            ok = sync_dir(src, dst);
+            uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+            best_ms = std::min(best_ms, ms);
+        }
+        result["best_ms"] = json::Value(static_cast<double>(best_ms));
+        result["ok"] = json::Value(ok);
+        results.push_back(result);
+        all_ok = all_ok && ok;
+    }
+    set_copy_engine("sync");
+
+    root["results"] = results;
+    std::cout << json::dump(root) << "\n";
+    fs::remove_all(work_dir, ec);
+    return all_ok;
 }
 
-}  // namespace hymo
\ No newline at end of file
+}  // namespace hymo
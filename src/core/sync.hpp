@@ -2,14 +2,82 @@
 #pragma once
 
 #include "../conf/config.hpp"
+#include "erofs.hpp"
 #include "inventory.hpp"
+#include <cstdint>
 #include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 
 namespace hymo {
 
-void perform_sync(const std::vector<Module> &modules,
-                  const fs::path &storage_root, const Config &config);
+// Hybrid storage: modules above `threshold` bytes, or ones that no longer fit
+// the tmpfs budget, are placed in `spill_dir` (or referenced in place when it is
+// empty) and bind-mounted read-only into the mirror.
+struct SpillPolicy {
+    fs::path spill_dir;
+    uint64_t threshold = 0;
+    std::vector<std::string> spilled_ids;
+};
+
+struct DedupStats {
+    uint64_t files_linked = 0;
+    uint64_t bytes_saved = 0;
+};
+
+// Returns the ids of the modules copied this time; up-to-date ones are left alone
+std::vector<std::string> perform_sync(const std::vector<Module> &modules,
+                                      const fs::path &storage_root,
+                                      const Config &config,
+                                      SpillPolicy *spill = nullptr);
+
+// Copy one module into the mirror at `dst`, honouring the spill policy if set
+bool sync_module(const std::string &id, const fs::path &src,
+                 const fs::path &dst, SpillPolicy *spill);
+
+// Remove spill tier copies of modules that are neither in `spill.spilled_ids`
+// nor in `keep` (left untouched by this sync), so dropped modules don't linger
+void prune_spill_tier(const SpillPolicy &spill,
+                      const std::vector<std::string> &keep = {});
+
+// Label every entry of the module trees under `storage_root` the way sync_dir()
+// would have, for mirrors that were filled without it (pre-populated images)
+void label_module_mirror(const std::vector<Module> &modules,
+                         const fs::path &storage_root, const Config &config);
+
+// EROFS sources for `modules` (their partition dirs with content), so images are
+// built straight from the module directory. Each module lands in `<id>/`, or at
+// the image root when `flat`; empty modules are left out.
+std::vector<ErofsSource> erofs_module_sources(const std::vector<Module> &modules,
+                                              const Config &config, bool flat);
+
+// Writer options giving the image the owners and labels a synced mirror has
+ErofsWriterOptions erofs_module_options();
+
+// Hardlink byte-identical files across the synced module trees under
+// `storage_root`. Files are only merged when owner, mode and SELinux context
+// match, since hardlinks share a single inode. Links already in place (a
+// persistent mirror) count towards the savings. With `synced_ids`, only files
+// of the same size as a file of those modules are compared; the rest were
+// deduplicated when they were synced.
+DedupStats dedup_storage(const fs::path &storage_root,
+                         const std::vector<std::string> &module_ids,
+                         const std::vector<std::string> *synced_ids = nullptr);
+
+// Allocated bytes (st_blocks) of each module tree under `storage_root`, for the
+// runtime state. Inodes shared by hardlinks count once, for the first module.
+// With `synced_ids`, only those modules (and ones missing from `previous`) are
+// walked; the others keep their entry from `previous`.
+std::vector<std::pair<std::string, uint64_t>> measure_module_usage(
+    const fs::path &storage_root, const std::vector<std::string> &module_ids,
+    const std::vector<std::string> *synced_ids = nullptr,
+    const std::vector<std::pair<std::string, uint64_t>> &previous = {});
+
+// Time sync_dir() with each copy engine on a synthetic module tree of
+// `file_count` files built under `work_dir` (removed afterwards); prints JSON.
+bool run_sync_benchmark(const fs::path &work_dir, int file_count);
 
 } // namespace hymo
@@ -0,0 +1,160 @@
+// core/uring.cpp - Minimal io_uring ring for batched file I/O
+#include "uring.hpp"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+namespace hymo {
+
+Uring::~Uring() {
+    release();
+}
+
+void Uring::release() {
+    if (sqes_)
+        munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_)
+        munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_)
+        munmap(sq_ptr_, sq_size_);
+    if (ring_fd_ >= 0)
+        close(ring_fd_);
+    sqes_ = nullptr;
+    cq_ptr_ = sq_ptr_ = nullptr;
+    ring_fd_ = -1;
+}
+
+bool Uring::init(unsigned entries, const std::vector<uint8_t>& ops) {
+    if (ready())
+        return true;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0)
+        return false;
+    ring_fd_ = fd;
+
+    // Every opcode we submit must be known to this kernel
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::unique_ptr<char[]> probe_buf(new char[probe_size]());
+    auto* probe = reinterpret_cast<io_uring_probe*>(probe_buf.get());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        int saved = errno;
+        release();
+        errno = saved;
+        return false;
+    }
+    for (uint8_t op : ops) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            release();
+            errno = EOPNOTSUPP;
+            return false;
+        }
+    }
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                   IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        sq_ptr_ = nullptr;
+        release();
+        return false;
+    }
+    if (single_mmap) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            cq_ptr_ = nullptr;
+            release();
+            return false;
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        release();
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_entries_ = params.sq_entries;
+    sqe_tail_ = submitted_ = *sq_tail_;
+
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe* Uring::get_sqe() {
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (sqe_tail_ - head >= sq_entries_)
+        return nullptr;
+
+    unsigned index = sqe_tail_ & *sq_mask_;
+    sq_array_[index] = index;
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe_tail_++;
+    return sqe;
+}
+
+bool Uring::submit_and_reap(unsigned count, std::vector<io_uring_cqe>& out) {
+    out.clear();
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+    while (out.size() < count) {
+        unsigned to_submit = sqe_tail_ - submitted_;
+        unsigned wait_nr = count - static_cast<unsigned>(out.size());
+        long ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, wait_nr,
+                           IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        submitted_ += static_cast<unsigned>(ret);
+
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            out.push_back(cqes_[head & *cq_mask_]);
+            head++;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+}  // namespace hymo
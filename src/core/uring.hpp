@@ -0,0 +1,60 @@
+// core/uring.hpp - Minimal io_uring ring for batched file I/O
+#pragma once
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace hymo {
+
+// Raw-syscall io_uring instance; no liburing dependency. Only what the batched
+// copy engine needs: queue SQEs, submit, and wait for a known number of CQEs.
+class Uring {
+public:
+    Uring() = default;
+    ~Uring();
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    // Set up the ring and check that every opcode in `ops` is supported.
+    // Returns false (with errno set) when io_uring is missing, blocked by
+    // seccomp/SELinux, or too old.
+    bool init(unsigned entries, const std::vector<uint8_t>& ops);
+    bool ready() const { return ring_fd_ >= 0; }
+
+    // Next free SQE, zeroed; nullptr when the submission queue is full
+    io_uring_sqe* get_sqe();
+
+    // Submit queued SQEs and collect exactly `count` completions into `out`
+    // (user_data, res). Returns false if io_uring_enter fails.
+    bool submit_and_reap(unsigned count, std::vector<io_uring_cqe>& out);
+
+    unsigned entries() const { return sq_entries_; }
+
+private:
+    void release();
+
+    int ring_fd_ = -1;
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_entries_ = 0;
+    unsigned sqe_tail_ = 0;   // local tail, published on submit
+    unsigned submitted_ = 0;  // tail value the kernel has seen
+
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+};
+
+}  // namespace hymo
@@ -51,8 +51,26 @@ std::string export_mount_stats_json() {
          << "\"dirs_mounted\":" << stats.dirs_mounted << ","
          << "\"symlinks_created\":" << stats.symlinks_created << ","
          << "\"overlayfs_mounts\":" << stats.overlayfs_mounts << ","
+         << "\"mirror_binds\":" << stats.mirror_binds << ","
+         << "\"mounts_added\":" << stats.mounts_added << ","
+         << "\"tree_nodes\":" << stats.tree_nodes << ","
+         << "\"tree_kib\":" << stats.tree_kib << ","
+         << "\"program_ops\":" << stats.program_ops << ","
+         << "\"attr_clones\":" << stats.attr_clones << ","
+         << "\"program_cached\":" << (stats.program_cached ? "true" : "false") << ","
+         << "\"attr_syscalls\":" << stats.attr_syscalls << ","
          << "\"success_rate\":" << std::fixed << std::setprecision(2) << stats.get_success_rate()
-         << "}";
+         << ",";
+
+    // Stage timings of the last mount run
+    auto timings = load_runtime_state().stage_timings_ms;
+    json << "\"stage_timings_ms\":{";
+    for (size_t i = 0; i < timings.size(); i++) {
+        if (i > 0)
+            json << ",";
+        json << "\"" << escape_json_string(timings[i].first) << "\":" << timings[i].second;
+    }
+    json << "}}";
 
     return json.str();
 }
@@ -22,6 +22,11 @@ constexpr const char* MODULE_PROP_FILE = HYMO_MODULE_DIR "/module.prop";
 constexpr const char* LKM_KO = HYMO_MODULE_DIR "/hymofs_lkm.ko";
 constexpr const char* LKM_AUTOLOAD_FILE = HYMO_DATA_DIR "/lkm_autoload";
 constexpr const char* USER_HIDE_RULES_FILE = HYMO_DATA_DIR "/user_hide_rules.json";
+constexpr const char* COMPACT_IMAGE_FILE = HYMO_DATA_DIR "/compact_image";
+constexpr const char* MAGIC_PROGRAM_FILE = HYMO_DATA_DIR "/magic_program";
+
+// Hybrid storage: ext4 spill tier, mounted inside the tmpfs mirror root
+constexpr const char* HYBRID_SPILL_DIR = ".spill";
 
 // Marker files
 constexpr const char* CONFIG_FILENAME = "config.json";
@@ -1,10 +1,16 @@
 // main.cpp - Main entry point
+#include <fcntl.h>
 #include <getopt.h>
+#include <sched.h>
+#include <sys/file.h>
 #include <sys/mount.h>
 #include <unistd.h>
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <set>
@@ -14,8 +20,10 @@
 #include "core/inventory.hpp"
 #include "core/json.hpp"
 #include "core/lkm.hpp"
+#include "core/manifest.hpp"
 #include "core/modules.hpp"
 #include "core/planner.hpp"
+#include "core/prefetch.hpp"
 #include "core/state.hpp"
 #include "core/storage.hpp"
 #include "core/sync.hpp"
@@ -23,6 +31,7 @@
 #include "core/webui.hpp"
 #include "defs.hpp"
 #include "mount/hymofs.hpp"
+#include "mount/magic.hpp"
 #include "utils.hpp"
 
 namespace fs = std::filesystem;
@@ -51,7 +60,9 @@ static void print_help() {
     std::cout << "  config gen         Generate default config file\n";
     std::cout << "  config show        Show current configuration\n";
     std::cout << "  config sync-partitions  Scan and auto-add partitions\n";
-    std::cout << "  config create-image [dir]  Create modules.img\n\n";
+    std::cout << "  config create-image [dir]  Create modules.img\n";
+    std::cout << "  config compact-image  Shrink modules.img to its contents\n";
+    std::cout << "  config prebuild-image  Build the next boot's image ahead of time\n\n";
 
     std::cout << "Module Commands (module <subcommand>):\n";
     std::cout << "  module list        List all modules\n";
@@ -88,7 +99,10 @@ static void print_help() {
     std::cout << "  debug enable       Enable kernel debug logging\n";
     std::cout << "  debug disable      Disable kernel debug logging\n";
     std::cout << "  debug stealth on|off    Enable/disable stealth mode\n";
-    std::cout << "  debug set-uname <release> <version>  Set kernel version spoofing\n\n";
+    std::cout << "  debug set-uname <release> <version>  Set kernel version spoofing\n";
+    std::cout << "  debug bench-sync [files] [dir]  Compare sync copy engines\n";
+    std::cout << "  debug magic-plan <module_dir>...  Print the magic mount program (dry run)\n";
+    std::cout << "  debug image-cache  Loop and page cache state of attached images\n\n";
 
     std::cout << "LKM Commands (lkm <subcommand>) - HymoFS kernel module:\n";
     std::cout << "  lkm load           Load HymoFS kernel module\n";
@@ -155,6 +169,391 @@ static void segregate_custom_rules(MountPlan& plan, const fs::path& mirror_dir)
     // Magic mount paths are module source directories, not overlay layers
 }
 
+static std::vector<std::string> module_ids(const std::vector<Module>& modules) {
+    std::vector<std::string> ids;
+    ids.reserve(modules.size());
+    for (const auto& mod : modules)
+        ids.push_back(mod.id);
+    return ids;
+}
+
+// Manifest digest of the module dirs behind `sources`. Empty modules have no
+// source, so boot and prebuild agree however the module list was filtered.
+static std::string sources_digest(const std::vector<ErofsSource>& sources,
+                                  const std::string& build_options) {
+    std::vector<fs::path> module_dirs;
+    for (const auto& source : sources)
+        module_dirs.push_back(source.dir);
+    return manifest_digest(module_dirs, build_options);
+}
+
+static void add_erofs_dedup(const ErofsWriterStats& stats, DedupStats& dedup) {
+    dedup.files_linked += stats.deduped_files;
+    dedup.bytes_saved += stats.deduped_bytes;
+}
+
+// A reused image deduplicated nothing this boot, but still saves what its build did
+static void add_sidecar_dedup(const fs::path& image_path, DedupStats& dedup) {
+    uint64_t files_linked = 0;
+    uint64_t bytes_saved = 0;
+    if (read_sidecar_dedup(image_path, files_linked, bytes_saved)) {
+        dedup.files_linked += files_linked;
+        dedup.bytes_saved += bytes_saved;
+    }
+}
+
+// Per-module EROFS: each module has its own image in BASE_DIR/erofs, keyed by
+// that module's digest and mounted at <mnt_dir>/<id> on a small tmpfs root.
+// Only modules whose digest changed are rebuilt; their ids go to `synced_ids`.
+static StorageHandle setup_erofs_module_mirror(const fs::path& mnt_dir,
+                                               const std::vector<Module>& modules,
+                                               const Config& config, DedupStats& dedup,
+                                               Prefetcher& prefetch,
+                                               std::vector<std::string>& synced_ids) {
+    fs::path image_dir = fs::path(BASE_DIR) / "erofs";
+    ensure_dir_exists(image_dir);
+
+    if (fs::exists(mnt_dir)) {
+        umount2(mnt_dir.c_str(), MNT_DETACH);
+    }
+    if (!mount_tmpfs(mnt_dir)) {
+        throw std::runtime_error("Failed to mount EROFS mirror root");
+    }
+    send_unmountable(mnt_dir);
+
+    ErofsWriterOptions options = erofs_module_options();
+    std::set<std::string> images;
+    size_t rebuilt = 0;
+    size_t reused = 0;
+    for (const auto& mod : modules) {
+        std::vector<ErofsSource> sources = erofs_module_sources({mod}, config, true);
+        if (sources.empty()) {
+            continue;  // nothing to mount (empty module)
+        }
+
+        fs::path image_path = image_dir / (mod.id + ".erofs");
+        images.insert(image_path.filename().string());
+
+        std::string digest = manifest_digest({mod.source_path}, erofs_build_options());
+        if (digest.empty() || read_digest_sidecar(image_path) != digest) {
+            prefetch.wait();
+            ErofsWriterStats stats;
+            if (!build_erofs_image(sources, options, image_path, digest, &stats)) {
+                throw std::runtime_error("Failed to create EROFS image for " + mod.id);
+            }
+            add_erofs_dedup(stats, dedup);
+            synced_ids.push_back(mod.id);
+            rebuilt++;
+        } else {
+            add_sidecar_dedup(image_path, dedup);
+            reused++;
+        }
+
+        fs::path target = mnt_dir / mod.id;
+        ensure_dir_exists(target);
+        if (!mount_image(image_path, target, "erofs", "loop,ro,noatime")) {
+            throw std::runtime_error("Failed to mount EROFS image for " + mod.id);
+        }
+    }
+
+    // Nothing was built (or the walk is already over), so no data gets read
+    prefetch.cancel();
+
+    // Images of modules that are gone, disabled or empty
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(image_dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (entry.path().extension() == ".erofs" && !images.count(name)) {
+            remove_digest_sidecar(entry.path());
+            fs::remove(entry.path(), ec);
+        }
+    }
+
+    LOG_INFO("EROFS active (per-module: " + std::to_string(rebuilt) + " rebuilt, " +
+             std::to_string(reused) + " reused)");
+    StorageHandle storage;
+    storage.mount_point = mnt_dir;
+    storage.mode = "erofs";
+    return storage;
+}
+
+// EROFS is read-only: modules.erofs is written straight from the module dirs.
+// The image is reused as long as the manifest digest of the modules (and build
+// options) matches the one it was built from. Throws if nothing could be mounted.
+// `prefetch` is cancelled on a cache hit and waited for before a build. Modules
+// written into an image are added to `synced_ids`.
+static StorageHandle setup_erofs_mirror(const fs::path& mnt_dir, const std::vector<Module>& modules,
+                                        const Config& config, DedupStats& dedup,
+                                        Prefetcher& prefetch,
+                                        std::vector<std::string>& synced_ids) {
+    // Left behind by versions that copied the modules to a staging dir first
+    std::error_code ec;
+    fs::remove_all(fs::path(BASE_DIR) / "erofs_staging", ec);
+
+    if (config.erofs_per_module) {
+        return setup_erofs_module_mirror(mnt_dir, modules, config, dedup, prefetch, synced_ids);
+    }
+
+    fs::path image_path = fs::path(BASE_DIR) / "modules.erofs";
+    std::vector<ErofsSource> sources = erofs_module_sources(modules, config, false);
+    std::string digest = sources_digest(sources, erofs_build_options());
+
+    StorageHandle storage;
+    if (mount_cached_erofs(mnt_dir, image_path, digest, storage)) {
+        prefetch.cancel();
+        add_sidecar_dedup(image_path, dedup);
+        return storage;
+    }
+
+    prefetch.wait();
+
+    LOG_INFO("Building EROFS image from " + std::to_string(modules.size()) + " active modules...");
+    ErofsWriterStats stats;
+    storage = setup_erofs_storage(mnt_dir, sources, erofs_module_options(), image_path, digest,
+                                  &stats);
+    add_erofs_dedup(stats, dedup);
+    synced_ids = module_ids(modules);
+    return storage;
+}
+
+// Ext4: modules.img is rebuilt already holding the module dirs (mke2fs -d) when
+// their manifest digest changed, and kept as mounted otherwise. Returns false
+// if the image couldn't be populated; the caller then syncs into it instead.
+// `prefetch` is cancelled when the image is current and waited for otherwise.
+// A rebuilt image sets `synced_ids` to every module.
+static bool setup_ext4_mirror(const StorageHandle& storage, const fs::path& image_path,
+                              const std::vector<Module>& modules, const Config& config,
+                              DedupStats& dedup, Prefetcher& prefetch,
+                              std::vector<std::string>& synced_ids) {
+    std::vector<ErofsSource> sources = erofs_module_sources(modules, config, false);
+    std::string digest = sources_digest(sources, ext4_build_options());
+
+    if (!digest.empty() && read_digest_sidecar(image_path) == digest) {
+        LOG_INFO("Ext4 image up to date (digest " + digest.substr(0, 12) + ")");
+        prefetch.cancel();
+        add_sidecar_dedup(image_path, dedup);
+        return true;
+    }
+
+    prefetch.wait();
+
+    if (!populate_ext4_image(storage.mount_point, image_path, sources)) {
+        return false;
+    }
+    synced_ids = module_ids(modules);
+
+    label_module_mirror(modules, storage.mount_point, config);
+    dedup = dedup_storage(storage.mount_point, module_ids(modules));
+    finalize_storage_permissions(storage.mount_point);
+
+    if (!digest.empty() &&
+        !write_digest_sidecar(image_path, digest, dedup.files_linked, dedup.bytes_saved)) {
+        LOG_WARN("Failed to record ext4 image digest");
+    }
+    return true;
+}
+
+// Modules as they will be after the next boot: KernelSU moves staged installs
+// and updates from modules_update into place before anything is mounted
+static std::vector<Module> scan_next_boot_modules(const Config& config) {
+    std::vector<Module> modules = scan_modules(config.moduledir, config);
+
+    fs::path update_dir = config.moduledir.parent_path() / "modules_update";
+    std::error_code ec;
+    std::set<std::string> staged;
+    for (const auto& entry : fs::directory_iterator(update_dir, ec)) {
+        if (entry.is_directory(ec))
+            staged.insert(entry.path().filename().string());
+    }
+    if (staged.empty())
+        return modules;
+
+    modules.erase(std::remove_if(modules.begin(), modules.end(),
+                                 [&staged](const Module& mod) { return staged.count(mod.id); }),
+                  modules.end());
+    for (auto& mod : scan_modules(update_dir, config))
+        modules.push_back(std::move(mod));
+    std::sort(modules.begin(), modules.end(),
+              [](const Module& a, const Module& b) { return a.id > b.id; });
+    return modules;
+}
+
+// Mount a freshly built slot image and check every source made it in. Labels
+// and ext4 fixups are applied through the same mount (`prepare`).
+static bool verify_slot_image(const fs::path& slot, const std::string& fs_type,
+                              const std::vector<ErofsSource>& sources,
+                              const std::function<void(const fs::path&)>& prepare = nullptr) {
+    fs::path mnt = fs::path(BASE_DIR) / "prebuild_mnt";
+    std::string options = fs_type == "erofs" ? "loop,ro,noatime" : "loop,rw,noatime";
+    if (!mount_image(slot, mnt, fs_type, options)) {
+        return false;
+    }
+
+    bool ok = true;
+    for (const auto& source : sources) {
+        for (const auto& include : source.include) {
+            if (!fs::is_directory(mnt / source.name / include)) {
+                LOG_ERROR("Prebuilt image lacks " + source.name + "/" + include);
+                ok = false;
+            }
+        }
+    }
+    if (ok && prepare)
+        prepare(mnt);
+
+    umount2(mnt.c_str(), 0);
+    std::error_code ec;
+    fs::remove(mnt, ec);
+    return ok;
+}
+
+// Build, verify and promote one image; the active image is only replaced by a
+// complete, mountable one. `dedup` is read after `build` and `prepare` filled it.
+static bool prebuild_slot(const fs::path& image_path, const std::string& fs_type,
+                          const std::vector<ErofsSource>& sources, const std::string& digest,
+                          const DedupStats& dedup,
+                          const std::function<bool(const fs::path&)>& build,
+                          const std::function<void(const fs::path&)>& prepare = nullptr) {
+    fs::path slot = image_slot(image_path);
+    LOG_INFO("Prebuilding " + slot.string());
+    if (!build(slot) || !verify_slot_image(slot, fs_type, sources, prepare)) {
+        LOG_ERROR("Prebuild of " + image_path.filename().string() + " failed, keeping " +
+                  "the active image");
+        std::error_code ec;
+        fs::remove(slot, ec);
+        return false;
+    }
+    return promote_image_slot(image_path, digest, dedup.files_linked, dedup.bytes_saved);
+}
+
+// `config prebuild-image`: build the image(s) the next boot will mount for the
+// current storage mode into their inactive slots, outside the boot path. Boot then
+// finds a matching digest and only mounts.
+static int prebuild_images(const Config& config) {
+    // Serialize runs; a queued one sees every install that happened meanwhile
+    fs::path lock_path = fs::path(BASE_DIR) / "prebuild.lock";
+    int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) != 0) {
+        LOG_ERROR("Failed to lock " + lock_path.string());
+        return 1;
+    }
+
+    // Verification mounts stay in this process' own namespace
+    if (unshare(CLONE_NEWNS) != 0 || mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr)) {
+        LOG_ERROR("Failed to create private mount namespace: " + std::string(strerror(errno)));
+        return 1;
+    }
+
+    std::string mode = load_runtime_state().storage_mode;
+    std::vector<Module> modules = scan_next_boot_modules(config);
+    bool ok = true;
+    size_t built = 0;
+
+    if (mode == "erofs" && config.erofs_per_module) {
+        ErofsWriterOptions options = erofs_module_options();
+        fs::path image_dir = fs::path(BASE_DIR) / "erofs";
+        ensure_dir_exists(image_dir);
+        for (const auto& mod : modules) {
+            std::vector<ErofsSource> sources = erofs_module_sources({mod}, config, true);
+            if (sources.empty())
+                continue;
+            fs::path image_path = image_dir / (mod.id + ".erofs");
+            std::string digest = sources_digest(sources, erofs_build_options());
+            if (!digest.empty() && read_digest_sidecar(image_path) == digest)
+                continue;
+
+            // Per-module images hold the module at their root
+            std::vector<ErofsSource> check = sources;
+            check[0].name = "";
+            DedupStats dedup;
+            auto build = [&](const fs::path& slot) {
+                ErofsWriterStats stats;
+                bool written = write_erofs_image(sources, slot, options, &stats);
+                add_erofs_dedup(stats, dedup);
+                return written;
+            };
+            ok &= prebuild_slot(image_path, "erofs", check, digest, dedup, build);
+            built++;
+        }
+    } else if (mode == "erofs" || mode == "ext4") {
+        std::vector<ErofsSource> sources = erofs_module_sources(modules, config, false);
+        bool erofs = mode == "erofs";
+        fs::path image_path = fs::path(BASE_DIR) / (erofs ? "modules.erofs" : "modules.img");
+        std::string digest =
+            sources_digest(sources, erofs ? erofs_build_options() : ext4_build_options());
+
+        if (digest.empty() || read_digest_sidecar(image_path) != digest) {
+            DedupStats dedup;
+            if (erofs) {
+                auto build = [&](const fs::path& slot) {
+                    ErofsWriterStats stats;
+                    bool written = write_erofs_image(sources, slot, erofs_module_options(), &stats);
+                    add_erofs_dedup(stats, dedup);
+                    return written;
+                };
+                ok = prebuild_slot(image_path, "erofs", sources, digest, dedup, build);
+            } else {
+                ok = prebuild_slot(
+                    image_path, "ext4", sources, digest, dedup,
+                    [&](const fs::path& slot) { return create_populated_image(sources, slot); },
+                    [&](const fs::path& mnt) {
+                        label_module_mirror(modules, mnt, config);
+                        dedup = dedup_storage(mnt, module_ids(modules));
+                        finalize_storage_permissions(mnt);
+                    });
+            }
+            built++;
+        }
+    } else {
+        LOG_INFO("Storage mode '" + mode + "' has no image to prebuild");
+        return 0;
+    }
+
+    LOG_INFO("Prebuild finished: " + std::to_string(built) + " image(s) built" +
+             (ok ? "" : ", with failures"));
+    return ok ? 0 : 1;
+}
+
+// Wall-clock durations of the mount stages, in the order they ran
+class StageClock {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    StageClock() : start_(Clock::now()), last_(start_) {}
+
+    // Close the stage that ran since the previous mark
+    void mark(const std::string& stage) {
+        auto now = Clock::now();
+        add(stage, elapsed_ms(last_, now));
+        last_ = now;
+    }
+
+    void add(const std::string& stage, uint64_t ms) {
+        timings_.emplace_back(stage, ms);
+        LOG_DEBUG("Stage " + stage + ": " + std::to_string(ms) + " ms");
+    }
+
+    uint64_t total_ms() const { return elapsed_ms(start_, Clock::now()); }
+
+    const std::vector<std::pair<std::string, uint64_t>>& timings() const { return timings_; }
+
+private:
+    static uint64_t elapsed_ms(Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+    }
+
+    Clock::time_point start_;
+    Clock::time_point last_;
+    std::vector<std::pair<std::string, uint64_t>> timings_;
+};
+
+static SpillPolicy make_spill_policy(const StorageHandle& storage, const Config& config) {
+    SpillPolicy spill;
+    spill.spill_dir = storage.spill_dir;
+    spill.threshold = static_cast<uint64_t>(std::max(config.spill_threshold_mb, 0)) * 1024 * 1024;
+    return spill;
+}
+
 static CliOptions parse_args(int argc, char* argv[]) {
     CliOptions opts;
 
@@ -312,6 +711,10 @@ int main(int argc, char* argv[]) {
                 std::cout << "  \"verbose\": " << (config.verbose ? "true" : "false") << ",\n";
                 std::cout << "  \"fs_type\": \"" << filesystem_type_to_string(config.fs_type)
                           << "\",\n";
+                std::cout << "  \"spill_threshold_mb\": " << config.spill_threshold_mb << ",\n";
+                std::cout << "  \"sync_engine\": \"" << config.sync_engine << "\",\n";
+                std::cout << "  \"erofs_per_module\": "
+                          << (config.erofs_per_module ? "true" : "false") << ",\n";
                 std::cout << "  \"disable_umount\": " << (config.disable_umount ? "true" : "false")
                           << ",\n";
                 std::cout << "  \"enable_nuke\": " << (config.enable_nuke ? "true" : "false")
@@ -395,9 +798,30 @@ int main(int argc, char* argv[]) {
                     LOG_ERROR("Failed to create modules.img via CLI");
                     return 1;
                 }
+            } else if (subcmd == "prebuild-image") {
+                return prebuild_images(config);
+            } else if (subcmd == "compact-image") {
+                fs::path img_path = fs::path(BASE_DIR) / "modules.img";
+                if (!fs::exists(img_path)) {
+                    std::cerr << "modules.img not found\n";
+                    return 1;
+                }
+                if (compact_image(img_path)) {
+                    std::cout << "modules.img compacted\n";
+                    return 0;
+                }
+                // Mounted (or failed): retry before the next boot mounts it
+                std::ofstream marker(COMPACT_IMAGE_FILE);
+                if (!marker) {
+                    std::cerr << "Failed to compact modules.img\n";
+                    return 1;
+                }
+                std::cout << "modules.img will be compacted on next boot\n";
+                return 0;
             } else {
                 std::cerr << "Unknown config subcommand: " << subcmd << "\n";
-                std::cerr << "Available: gen, show, sync-partitions, create-image\n";
+                std::cerr << "Available: gen, show, sync-partitions, create-image, compact-image, "
+                             "prebuild-image\n";
                 return 1;
             }
             break;
@@ -996,7 +1420,8 @@ int main(int argc, char* argv[]) {
 
         case Command::DEBUG: {
             if (cli.args.empty()) {
-                std::cerr << "Usage: hymod debug <enable|disable|stealth|set-uname>\n";
+                std::cerr << "Usage: hymod debug <enable|disable|stealth|set-uname|bench-sync|"
+                             "magic-plan|image-cache>\n";
                 return 1;
             }
             std::string subcmd = cli.args[0];
@@ -1079,9 +1504,39 @@ int main(int argc, char* argv[]) {
                     return 1;
                 }
                 return 0;
+            } else if (subcmd == "bench-sync") {
+                int files = 2000;
+                if (cli.args.size() >= 2) {
+                    try {
+                        files = std::stoi(cli.args[1]);
+                    } catch (...) {
+                        std::cerr << "Invalid file count: " << cli.args[1] << "\n";
+                        return 1;
+                    }
+                }
+                fs::path work_dir = cli.args.size() >= 3 ? fs::path(cli.args[2]) / "hymo_sync_bench"
+                                                         : fs::path(BASE_DIR) / "sync_bench";
+                return run_sync_benchmark(work_dir, std::max(files, 1)) ? 0 : 1;
+            } else if (subcmd == "magic-plan") {
+                if (cli.args.size() < 2) {
+                    std::cerr << "Usage: hymod debug magic-plan <module_dir>...\n";
+                    return 1;
+                }
+                std::vector<fs::path> module_paths(cli.args.begin() + 1, cli.args.end());
+                std::string plan = describe_magic_mount(module_paths, config.partitions);
+                if (plan.empty()) {
+                    std::cerr << "Nothing to magic mount.\n";
+                    return 1;
+                }
+                std::cout << plan;
+                return 0;
+            } else if (subcmd == "image-cache") {
+                print_image_cache_status();
+                return 0;
             } else {
                 std::cerr << "Unknown debug subcommand: " << subcmd << "\n";
-                std::cerr << "Available: enable, disable, stealth, set-uname\n";
+                std::cerr << "Available: enable, disable, stealth, set-uname, bench-sync, "
+                             "magic-plan, image-cache\n";
                 return 1;
             }
         }
@@ -1229,6 +1684,9 @@ int main(int argc, char* argv[]) {
         // Reset mount statistics at daemon start
         reset_mount_statistics();
 
+        if (set_copy_engine(config.sync_engine) != "sync")
+            LOG_INFO("Sync engine: io_uring");
+
         if (config.disable_umount) {
             LOG_WARN("Namespace Detach (try_umount) is DISABLED.");
         }
@@ -1236,10 +1694,21 @@ int main(int argc, char* argv[]) {
         // Ensure runtime directory exists
         ensure_dir_exists(RUN_DIR);
 
+        // try_umount registrations are collected and sent once everything is mounted
+        if (!config.disable_umount) {
+            begin_unmountable_batch();
+        }
+
         StorageHandle storage;
         MountPlan plan;
         ExecutionResult exec_result;
         std::vector<Module> module_list;
+        DedupStats dedup;
+        // Modules copied or imaged this boot; the others keep their measured usage
+        std::vector<std::string> synced_ids;
+        SpillPolicy spill;
+        StageClock clock;
+        Prefetcher prefetch;
 
         HymoFSStatus hymofs_status = HymoFS::check_status();
         std::string warning_msg = "";
@@ -1260,6 +1729,14 @@ int main(int argc, char* argv[]) {
             }
         }
 
+        // Warm the module trees while storage is being prepared
+        {
+            std::vector<std::string> prefetch_partitions = BUILTIN_PARTITIONS;
+            for (const auto& part : config.partitions)
+                prefetch_partitions.push_back(part);
+            prefetch.start(config.moduledir, prefetch_partitions);
+        }
+
         if (!can_use_hymofs && config.ignore_protocol_mismatch) {
             if (hymofs_status == HymoFSStatus::KernelTooOld ||
                 hymofs_status == HymoFSStatus::ModuleTooOld) {
@@ -1365,6 +1842,7 @@ int main(int argc, char* argv[]) {
             }
 
             module_list = active_modules;
+            clock.mark("scan");
 
             // **Mirror Strategy (Tmpfs/Ext4)**
             // To avoid SELinux/permission issues on /data, we mirror active modules
@@ -1387,78 +1865,86 @@ int main(int argc, char* argv[]) {
                     }
                 }
                 LOG_INFO("Mirror storage setup: " + storage.mode);
+                clock.mark("storage");
+                // Image modes check their cache first and only wait on a rebuild
+                if (storage.mode != "erofs" && storage.mode != "ext4") {
+                    prefetch.wait();
+                    clock.mark("prefetch_wait");
+                }
 
-                // EROFS is read-only: sync into a writable staging dir first, then build+mount.
+                // EROFS: reuse the cached image, or build it from the module dirs.
                 if (storage.mode == "erofs") {
-                    fs::path staging_dir = fs::path(BASE_DIR) / "erofs_staging";
-                    try {
-                        if (fs::exists(staging_dir)) {
-                            fs::remove_all(staging_dir);
+                    storage = setup_erofs_mirror(MIRROR_DIR, module_list, config, dedup,
+                                                 prefetch, synced_ids);
+                    mirror_success = true;
+                    hymofs_active = true;
+                    clock.mark("sync");
+
+                    // Plan should be generated from the mirrored storage root.
+                    plan = generate_plan(config, module_list, MIRROR_DIR);
+                    segregate_custom_rules(plan, MIRROR_DIR);
+                    update_hymofs_mappings(config, module_list, MIRROR_DIR, plan);
+                    clock.mark("plan");
+                    exec_result = execute_plan(plan, config, hymofs_active);
+                    clock.mark("execute");
+
+                    if (config.enable_stealth) {
+                        if (HymoFS::fix_mounts()) {
+                            LOG_INFO("Mount namespace fixed (mnt_id reordered).");
+                        } else {
+                            LOG_WARN("Failed to fix mount namespace.");
                         }
-                    } catch (...) {
-                        LOG_WARN("Failed to clean EROFS staging dir");
                     }
-                    ensure_dir_exists(staging_dir);
-
+                } else {
+                    // module_list already filtered above, just sync to mirror
                     LOG_INFO("Syncing " + std::to_string(module_list.size()) +
-                             " active modules to EROFS staging...");
+                             " active modules to mirror...");
 
-                    bool sync_ok = true;
-                    for (const auto& mod : module_list) {
-                        fs::path src = config.moduledir / mod.id;
-                        fs::path dst = staging_dir / mod.id;
-                        if (!sync_dir(src, dst)) {
-                            LOG_ERROR("Failed to sync module: " + mod.id);
-                            sync_ok = false;
-                        }
+                    bool hybrid = storage.mode == "hybrid";
+                    if (hybrid) {
+                        spill = make_spill_policy(storage, config);
                     }
 
-                    if (!sync_ok) {
-                        LOG_ERROR("EROFS staging sync failed. Aborting mirror strategy.");
-                        umount(MIRROR_DIR.c_str());
-                    } else {
-                        storage = setup_erofs_storage(MIRROR_DIR, staging_dir,
-                                                      fs::path(BASE_DIR) / "modules.erofs");
-                        mirror_success = true;
-                        hymofs_active = true;
-
-                        // Plan should be generated from the mirrored storage root.
-                        plan = generate_plan(config, module_list, MIRROR_DIR);
-                        segregate_custom_rules(plan, MIRROR_DIR);
-                        update_hymofs_mappings(config, module_list, MIRROR_DIR, plan);
-                        exec_result = execute_plan(plan, config, hymofs_active);
-
-                        if (config.enable_stealth) {
-                            if (HymoFS::fix_mounts()) {
-                                LOG_INFO("Mount namespace fixed (mnt_id reordered).");
-                            } else {
-                                LOG_WARN("Failed to fix mount namespace.");
-                            }
-                        }
+                    bool populated = storage.mode == "ext4" &&
+                                     setup_ext4_mirror(storage, img_path, module_list, config,
+                                                       dedup, prefetch, synced_ids);
+                    if (storage.mode == "ext4" && !populated) {
+                        remove_digest_sidecar(img_path);
+                        ensure_ext4_capacity(storage.mount_point, img_path,
+                                             erofs_module_sources(module_list, config, false));
                     }
-                } else {
-                    // module_list already filtered above, just sync to mirror
-                    LOG_INFO("Syncing " + std::to_string(module_list.size()) +
-                             " active modules to mirror...");
 
                     bool sync_ok = true;
-                    for (const auto& mod : module_list) {
-                        fs::path src = config.moduledir / mod.id;
-                        fs::path dst = MIRROR_DIR / mod.id;
-                        if (!sync_dir(src, dst)) {
-                            LOG_ERROR("Failed to sync module: " + mod.id);
-                            sync_ok = false;
+                    if (!populated) {
+                        synced_ids = module_ids(module_list);
+                        for (const auto& mod : module_list) {
+                            fs::path src = config.moduledir / mod.id;
+                            fs::path dst = MIRROR_DIR / mod.id;
+                            if (!sync_module(mod.id, src, dst, hybrid ? &spill : nullptr)) {
+                                LOG_ERROR("Failed to sync module: " + mod.id);
+                                sync_ok = false;
+                            }
+                        }
+                        if (hybrid) {
+                            prune_spill_tier(spill);
                         }
                     }
 
                     if (sync_ok) {
+                        // A populated image was labeled and deduplicated when built
+                        if (!populated)
+                            dedup = dedup_storage(MIRROR_DIR, module_ids(module_list));
+
                         // If using ext4 image, we need to fix permissions after sync
-                        if (storage.mode == "ext4") {
+                        if (storage.mode == "ext4" && !populated) {
                             finalize_storage_permissions(storage.mount_point);
+                        } else if (hybrid && !storage.spill_dir.empty()) {
+                            finalize_storage_permissions(storage.spill_dir);
                         }
 
                         mirror_success = true;
                         hymofs_active = true;
+                        clock.mark("sync");
 
                         // Plan should be generated from the mirrored storage root.
                         plan = generate_plan(config, module_list, MIRROR_DIR);
@@ -1466,7 +1952,9 @@ int main(int argc, char* argv[]) {
                         // Prepare plan and update mappings
                         segregate_custom_rules(plan, MIRROR_DIR);
                         update_hymofs_mappings(config, module_list, MIRROR_DIR, plan);
+                        clock.mark("plan");
                         exec_result = execute_plan(plan, config, hymofs_active);
+                        clock.mark("execute");
 
                         if (config.enable_stealth) {
                             if (HymoFS::fix_mounts()) {
@@ -1477,7 +1965,8 @@ int main(int argc, char* argv[]) {
                         }
                     } else {
                         LOG_ERROR("Mirror sync failed. Aborting mirror strategy.");
-                        umount(MIRROR_DIR.c_str());
+                        // Detach so hybrid spill mounts inside the mirror go with it
+                        umount2(MIRROR_DIR.c_str(), MNT_DETACH);
                     }
                 }
 
@@ -1492,6 +1981,7 @@ int main(int argc, char* argv[]) {
                 // redirect/hide work even when mirror mount failed (patch/LKM inherit bug).
                 storage.mode = "tmpfs";
                 storage.mount_point = config.moduledir;
+                synced_ids.clear();
 
                 module_list = scan_modules(config.moduledir, config);
 
@@ -1530,6 +2020,7 @@ int main(int argc, char* argv[]) {
 
                 // Execute plan
                 exec_result = execute_plan(plan, config, hymofs_active);
+                clock.mark("fallback");
             }
 
         } else {
@@ -1551,44 +2042,73 @@ int main(int argc, char* argv[]) {
             fs::path img_path = fs::path(BASE_DIR) / "modules.img";
 
             storage = setup_storage(mnt_base, img_path, config.fs_type);
+            clock.mark("storage");
 
             // **Step 2: Scan Modules**
             module_list = scan_modules(config.moduledir, config);
             LOG_INFO("Scanned " + std::to_string(module_list.size()) + " active modules.");
+            clock.mark("scan");
+            if (storage.mode != "erofs" && storage.mode != "ext4") {
+                prefetch.wait();
+                clock.mark("prefetch_wait");
+            }
 
             // **Step 3: Sync Content**
             if (storage.mode == "erofs") {
-                // EROFS is read-only: stage content first, then build+mount.
-                fs::path staging_dir = fs::path(BASE_DIR) / "erofs_staging";
                 try {
-                    if (fs::exists(staging_dir)) {
-                        fs::remove_all(staging_dir);
-                    }
-                } catch (...) {
-                    LOG_WARN("Failed to clean EROFS staging dir");
+                    storage = setup_erofs_mirror(mnt_base, module_list, config, dedup, prefetch,
+                                                 synced_ids);
+                } catch (const std::exception& e) {
+                    LOG_WARN("EROFS image unavailable, falling back to ext4: " +
+                             std::string(e.what()));
+                    storage = setup_storage(mnt_base, img_path, FilesystemType::EXT4);
+                }
+            }
+            if (storage.mode != "erofs") {
+                bool hybrid = storage.mode == "hybrid";
+                if (hybrid) {
+                    spill = make_spill_policy(storage, config);
                 }
-                ensure_dir_exists(staging_dir);
 
-                perform_sync(module_list, staging_dir, config);
-                storage = setup_erofs_storage(mnt_base, staging_dir,
-                                              fs::path(BASE_DIR) / "modules.erofs");
-            } else {
-                perform_sync(module_list, storage.mount_point, config);
+                bool populated = storage.mode == "ext4" &&
+                                 setup_ext4_mirror(storage, img_path, module_list, config, dedup,
+                                                   prefetch, synced_ids);
+                if (storage.mode == "ext4" && !populated) {
+                    remove_digest_sidecar(img_path);
+                    ensure_ext4_capacity(storage.mount_point, img_path,
+                                         erofs_module_sources(module_list, config, false));
+                }
+
+                if (!populated) {
+                    synced_ids = perform_sync(module_list, storage.mount_point, config,
+                                              hybrid ? &spill : nullptr);
+                    dedup = dedup_storage(storage.mount_point, module_ids(module_list),
+                                          &synced_ids);
+                }
 
                 // **FIX 1: Fix permissions after sync**
-                if (storage.mode == "ext4") {
+                if (storage.mode == "ext4" && !populated) {
                     finalize_storage_permissions(storage.mount_point);
+                } else if (hybrid && !storage.spill_dir.empty()) {
+                    finalize_storage_permissions(storage.spill_dir);
                 }
             }
 
+            clock.mark("sync");
+
             // **Step 4: Generate Plan**
             LOG_INFO("Generating mount plan...");
             plan = generate_plan(config, module_list, storage.mount_point);
+            clock.mark("plan");
 
             // **Step 5: Execute Plan**
             exec_result = execute_plan(plan, config, hymofs_active);
+            clock.mark("execute");
         }
 
+        // Already joined (or cancelled) on every path that reads module data
+        clock.add("prefetch", prefetch.wait().elapsed_ms);
+
         LOG_INFO("Plan: " + std::to_string(exec_result.overlay_module_ids.size()) +
                  " OverlayFS modules, " + std::to_string(exec_result.magic_module_ids.size()) +
                  " Magic modules, " + std::to_string(plan.hymofs_module_ids.size()) +
@@ -1606,6 +2126,9 @@ int main(int argc, char* argv[]) {
             }
         }
 
+        // **Step 7: Register try_umount mount points**
+        size_t try_umount_paths = flush_unmountables();
+
         // **Step 8: Save Runtime State**
         RuntimeState state;
         state.storage_mode = storage.mode;
@@ -1614,7 +2137,18 @@ int main(int argc, char* argv[]) {
         state.magic_module_ids = exec_result.magic_module_ids;
         state.hymofs_module_ids = plan.hymofs_module_ids;
         state.nuke_active = nuke_active;
+        state.dedup_files_linked = dedup.files_linked;
+        state.dedup_bytes_saved = dedup.bytes_saved;
+        state.tmpfs_budget = storage.tmpfs_budget;
+        state.try_umount_paths = try_umount_paths;
+        state.spilled_module_ids = spill.spilled_ids;
+        state.module_usage_bytes =
+            measure_module_usage(storage.mount_point, module_ids(module_list), &synced_ids,
+                                 load_runtime_state().module_usage_bytes);
+        state.stage_timings_ms = clock.timings();
+        state.stage_timings_ms.emplace_back("total", clock.total_ms());
         state.pid = getpid();
+        LOG_INFO("Mount stages finished in " + std::to_string(clock.total_ms()) + " ms");
 
         // Track active mount partitions
         if (!plan.hymofs_module_ids.empty()) {
@@ -1729,6 +2263,8 @@ int main(int argc, char* argv[]) {
     } catch (const std::exception& e) {
         std::cerr << "Fatal Error: " << e.what() << "\n";
         LOG_ERROR("Fatal Error: " + std::string(e.what()));
+        // Whatever got mounted before the failure still has to be hidden from apps
+        flush_unmountables();
         // Update with failure emoji
         update_module_description(false, "error", false, 0, 0, 0, "", false);
         return 1;
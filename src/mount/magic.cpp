@@ -1,22 +1,28 @@
 // mount/magic.cpp - Magic mount implementation
 #include "magic.hpp"
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <set>
 #include <sstream>
-#include <unordered_map>
+#include <thread>
 #include "../core/state.hpp"
 #include "../defs.hpp"
 #include "../utils.hpp"
+#include "magic_program.hpp"
+#include "magic_tree.hpp"
 #include "mount_utils.hpp"
 #include "partition_utils.hpp"
 
@@ -24,6 +30,25 @@
 #define TMPFS_MAGIC 0x01021994
 #endif // #ifndef TMPFS_MAGIC
 
+// Linux mount API syscalls
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#define __NR_fsconfig 431
+#define __NR_fsmount 432
+#define __NR_move_mount 429
+#endif // #ifndef __NR_fsopen
+
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif // #ifndef FSOPEN_CLOEXEC
+
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif // #ifndef MOVE_MOUNT_F_EMPTY_PATH
+
 namespace hymo {
 
 struct MountStats {
@@ -35,22 +60,20 @@ struct MountStats {
     int dirs_mounted = 0;
     int symlinks_created = 0;
     int overlayfs_mounts = 0;
+    int mirror_binds = 0;
+    int mounts_added = 0;
+    int tree_nodes = 0;
+    int tree_kib = 0;
+    int program_ops = 0;
+    int attr_clones = 0;
+    int program_cached = 0;
+    int attr_syscalls = 0;
 };
 
 static MountStats g_mount_stats;
 
-enum class NodeFileType { RegularFile, Directory, Symlink, Whiteout };
-
-struct Node {
-    std::string name;
-    NodeFileType file_type;
-    std::unordered_map<std::string, Node> children;
-    fs::path module_path;     // Path to module file
-    std::string module_name;  // Module ID that owns this node
-    bool replace = false;     // Directory marked for replacement (xattr/file)
-    bool skip = false;        // Skip mounting this node
-    bool done = false;        // Already processed flag
-};
+// Mount source of detached replacement trees; empty when they go through the workdir
+static std::string g_detached_source;
 
 static bool dir_is_replace(const fs::path& path) {
     char buf[4];
@@ -83,8 +106,8 @@ static NodeFileType get_file_type(const fs::path& path) {
     }
 }
 
-static bool collect_module_files(Node& node, const fs::path& module_dir,
-                                 const std::string& module_name = "") {
+static bool collect_module_files(MagicTree& tree, NodeId node, const fs::path& module_dir,
+                                 uint16_t module) {
     if (!fs::exists(module_dir)) {
         LOG_DEBUG("Module dir does not exist: " + module_dir.string());
         return false;
@@ -100,33 +123,26 @@ static bool collect_module_files(Node& node, const fs::path& module_dir,
     int dir_count = 0;
 
     try {
+        StrId source_dir = tree.intern(module_dir.string());
         for (const auto& entry : fs::directory_iterator(module_dir)) {
             std::string name = entry.path().filename().string();
             NodeFileType ft = get_file_type(entry.path());
 
-            auto it = node.children.find(name);
-            Node* child = nullptr;
-
-            if (it != node.children.end()) {
-                // Node already exists from another module - merge
-                child = &it->second;
-            } else {
-                // Create new node
-                Node new_child;
-                new_child.name = name;
-                new_child.file_type = ft;
-                new_child.module_path = entry.path();
-                new_child.module_name = module_name;
-                node.children[name] = new_child;
-                child = &node.children[name];
+            // A node that already exists came from an earlier module, which wins
+            NodeId child = tree.find(node, name);
+            if (child == NO_NODE) {
+                child = tree.add_child(node, name, ft, source_dir, module);
+            } else if (ft == NodeFileType::Directory) {
+                tree.node(child).shared = true;
             }
 
             if (ft == NodeFileType::Directory) {
                 dir_count++;
-                child->replace = dir_is_replace(entry.path());
-                bool child_has_file = collect_module_files(*child, entry.path(), module_name);
-                has_file |= child_has_file || child->replace;
-                if (child->replace) {
+                bool replace = dir_is_replace(entry.path());
+                tree.node(child).replace = replace;
+                bool child_has_file = collect_module_files(tree, child, entry.path(), module);
+                has_file |= child_has_file || replace;
+                if (replace) {
                     LOG_DEBUG("  Replace dir: " + entry.path().string());
                 }
             } else {
@@ -147,11 +163,160 @@ static bool collect_module_files(Node& node, const fs::path& module_dir,
     return has_file;
 }
 
-static Node* collect_all_modules(const std::vector<fs::path>& module_paths,
-                                 const std::vector<std::string>& extra_partitions) {
-    Node* root = new Node{"", NodeFileType::Directory, {}, {}, "", false, false, false};
-    Node system{"system", NodeFileType::Directory, {}, {}, "", false, false, false};
-    system.module_path = "/system";  // Set source for attribute cloning
+// Tags directories whose whole subtree comes from one module. If the stock tree
+// has no such directory either, the module's own one can be bound in one go.
+// Unsafe symlinks keep their subtree on the per-entry path, which rejects them.
+static bool mark_module_owned(MagicTree& tree, NodeId id) {
+    Node& node = tree.node(id);
+    bool owned = !node.shared && node.module != NO_MODULE && node.source_dir != NO_STR;
+    for (NodeId child_id : tree.children(node)) {
+        const Node& child = tree.node(child_id);
+        if (child.file_type == NodeFileType::Directory) {
+            owned &= mark_module_owned(tree, child_id);
+        } else if (child.file_type == NodeFileType::Symlink && owned) {
+            owned = is_safe_symlink(tree.source_path(child), fs::path("/"));
+        }
+    }
+    node.module_owned = owned && node.file_type == NodeFileType::Directory;
+    return owned;
+}
+
+// Moves a partition collected below system/ up to the root, keeping its subtree
+static void hoist_partition(MagicTree& tree, NodeId system, const std::string& partition) {
+    NodeId id = tree.find(system, partition);
+    if (id == NO_NODE) {
+        return;
+    }
+
+    Node& node = tree.node(id);
+    if (node.file_type == NodeFileType::Symlink && fs::is_directory(tree.source_path(node))) {
+        node.file_type = NodeFileType::Directory;
+    }
+    if (node.source_dir == NO_STR) {
+        node.source_dir = tree.intern("/");
+    }
+    tree.move(id, tree.root());
+}
+
+constexpr unsigned MAX_COLLECT_THREADS = 8;
+
+// One module's files, collected into a private tree so modules can be scanned in
+// parallel. The tree's root stands for the module dir and holds a node for every
+// partition the module ships.
+struct ModuleScan {
+    fs::path path;
+    std::string id;
+    uint16_t module = NO_MODULE;
+    MagicTree tree;
+    bool has_file = false;
+    bool failed = false;
+    std::string error;
+};
+
+static void scan_module(ModuleScan& scan, const std::vector<std::string>& partitions) {
+    MagicTree& tree = scan.tree;
+    try {
+        StrId source_dir = tree.intern(scan.path.string());
+        for (const auto& p : partitions) {
+            fs::path part_path = scan.path / p;
+            if (!fs::exists(part_path) || !fs::is_directory(part_path)) {
+                continue;
+            }
+            NodeId p_node = tree.find(tree.root(), p);
+            if (p_node == NO_NODE) {
+                p_node = tree.add_child(tree.root(), p, NodeFileType::Directory, source_dir, 0);
+            }
+            if (collect_module_files(tree, p_node, part_path, 0)) {
+                scan.has_file = true;
+            }
+        }
+    } catch (const std::exception& e) {
+        scan.failed = true;
+        scan.error = e.what();
+    }
+    tree.freeze();
+}
+
+static void scan_modules(std::vector<ModuleScan>& scans,
+                         const std::vector<std::string>& partitions) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    size_t threads = std::min<size_t>(cpus == 0 ? 2 : std::min(cpus, MAX_COLLECT_THREADS),
+                                      scans.size());
+
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for (size_t i; (i = next++) < scans.size();) {
+            scan_module(scans[i], partitions);
+        }
+    };
+
+    // The calling thread is one of the workers
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) {
+        try {
+            pool.emplace_back(worker);
+        } catch (const std::system_error& e) {
+            LOG_WARN("Failed to start collection worker: " + std::string(e.what()));
+            break;
+        }
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
+    }
+}
+
+// Folds a module's private subtree into the shared tree. Modules are merged in
+// priority order and an existing node is kept, so the earlier module still wins.
+static void merge_module_tree(MagicTree& tree, NodeId node, const MagicTree& src, NodeId src_node,
+                              uint16_t module) {
+    for (NodeId src_id : src.children(src.node(src_node))) {
+        const Node& entry = src.node(src_id);
+        std::string_view name = src.str(entry.name);
+
+        NodeId child = tree.find(node, name);
+        if (child == NO_NODE) {
+            child = tree.add_child(node, name, entry.file_type,
+                                   tree.intern(src.str(entry.source_dir)), module);
+        } else if (entry.file_type == NodeFileType::Directory) {
+            tree.node(child).shared = true;
+        }
+
+        if (entry.file_type == NodeFileType::Directory) {
+            tree.node(child).replace = entry.replace;
+            merge_module_tree(tree, child, src, src_id, module);
+        }
+    }
+}
+
+static void merge_module_scan(MagicTree& tree, NodeId system, const ModuleScan& scan) {
+    const MagicTree& src = scan.tree;
+    for (NodeId part_id : src.children(src.node(src.root()))) {
+        const Node& part = src.node(part_id);
+        std::string_view name = src.str(part.name);
+        if (name == "system") {
+            merge_module_tree(tree, system, src, part_id, scan.module);
+            continue;
+        }
+
+        // For top-level partitions like vendor/, product/ (KernelSU style)
+        // Add them to system's children so they get extracted properly later
+        NodeId p_node = tree.find(system, name);
+        if (p_node == NO_NODE) {
+            p_node = tree.add_child(system, name, NodeFileType::Directory,
+                                    tree.intern(src.str(part.source_dir)), scan.module);
+        } else {
+            tree.node(p_node).shared = true;
+        }
+        merge_module_tree(tree, p_node, src, part_id, scan.module);
+    }
+}
+
+static bool collect_all_modules(MagicTree& tree, const std::vector<fs::path>& module_paths,
+                                const std::vector<std::string>& extra_partitions) {
+    // Source of "/system" for attribute cloning
+    NodeId system = tree.add_child(tree.root(), "system", NodeFileType::Directory,
+                                   tree.intern("/"), NO_MODULE);
 
     bool has_file = false;
     std::vector<std::string> failed_modules;
@@ -162,6 +327,8 @@ static Node* collect_all_modules(const std::vector<fs::path>& module_paths,
     partitions_to_check.insert(partitions_to_check.end(), extra_partitions.begin(),
                                extra_partitions.end());
 
+    std::vector<ModuleScan> scans;
+    scans.reserve(module_paths.size());
     for (const auto& module_path : module_paths) {
         std::string module_id = module_path.filename().string();
 
@@ -186,44 +353,27 @@ static Node* collect_all_modules(const std::vector<fs::path>& module_paths,
         }
 
         LOG_INFO("Processing module: " + module_id);
-        try {
-            bool module_has_file = false;
-            for (const auto& p : partitions_to_check) {
-                fs::path part_path = module_path / p;
-                if (fs::exists(part_path) && fs::is_directory(part_path)) {
-                    if (p == "system") {
-                        if (collect_module_files(system, part_path, module_id)) {
-                            module_has_file = true;
-                        }
-                    } else {
-                        // For top-level partitions like vendor/, product/ (KernelSU style)
-                        // Add them to system's children so they get extracted properly later
-                        auto it = system.children.find(p);
-                        if (it == system.children.end()) {
-                            Node p_node;
-                            p_node.name = p;
-                            p_node.file_type = NodeFileType::Directory;
-                            p_node.module_path = part_path;
-                            p_node.module_name = module_id;
-                            system.children[p] = p_node;
-                            it = system.children.find(p);
-                        }
-                        if (collect_module_files(it->second, part_path, module_id)) {
-                            module_has_file = true;
-                        }
-                    }
-                }
-            }
-            
-            has_file |= module_has_file;
-            if (module_has_file) {
-                LOG_INFO("  Module " + module_id + " has files to mount");
+        ModuleScan& scan = scans.emplace_back();
+        scan.path = module_path;
+        scan.id = module_id;
+        scan.module = tree.add_module(module_id);
+    }
+
+    scan_modules(scans, partitions_to_check);
+
+    for (ModuleScan& scan : scans) {
+        merge_module_scan(tree, system, scan);
+        if (scan.failed) {
+            LOG_ERROR("Failed to collect module " + scan.id + ": " + scan.error);
+            failed_modules.push_back(scan.id);
+        } else {
+            has_file |= scan.has_file;
+            if (scan.has_file) {
+                LOG_INFO("  Module " + scan.id + " has files to mount");
             }
-        } catch (const std::exception& e) {
-            LOG_ERROR("Failed to collect module " + module_id + ": " + std::string(e.what()));
-            failed_modules.push_back(module_id);
-            continue;
         }
+        // Private trees are only needed until they are merged
+        scan.tree = MagicTree();
     }
 
     if (!failed_modules.empty()) {
@@ -232,8 +382,7 @@ static Node* collect_all_modules(const std::vector<fs::path>& module_paths,
 
     if (!has_file) {
         LOG_WARN("No files to magic mount from any module");
-        delete root;
-        return nullptr;
+        return false;
     }
 
     LOG_INFO("File collection successful");
@@ -247,22 +396,7 @@ static Node* collect_all_modules(const std::vector<fs::path>& module_paths,
 
         if (fs::is_directory(path_of_root) &&
             (!require_symlink || fs::is_symlink(path_of_system))) {
-            auto it = system.children.find(partition);
-            if (it != system.children.end()) {
-                Node& node = it->second;
-                if (node.file_type == NodeFileType::Symlink) {
-                    if (fs::is_directory(node.module_path)) {
-                        node.file_type = NodeFileType::Directory;
-                    }
-                }
-
-                if (node.module_path.empty()) {
-                    node.module_path = path_of_root;
-                }
-
-                root->children[partition] = node;
-                system.children.erase(it);
-            }
+            hoist_partition(tree, system, partition);
         }
     }
 
@@ -279,289 +413,394 @@ static Node* collect_all_modules(const std::vector<fs::path>& module_paths,
         }
 
         fs::path path_of_root = fs::path("/") / partition;
-        if (fs::is_directory(path_of_root)) {
-            auto it = system.children.find(partition);
-            if (it != system.children.end()) {
-                LOG_DEBUG("attach extra partition '" + partition + "' to root");
-                Node& node = it->second;
-                if (node.file_type == NodeFileType::Symlink && fs::is_directory(node.module_path)) {
-                    node.file_type = NodeFileType::Directory;
-                }
-                if (node.module_path.empty()) {
-                    node.module_path = path_of_root;
-                }
-                root->children[partition] = node;
-                system.children.erase(it);
-            }
+        if (fs::is_directory(path_of_root) && tree.find(system, partition) != NO_NODE) {
+            LOG_DEBUG("attach extra partition '" + partition + "' to root");
+            hoist_partition(tree, system, partition);
         }
     }
 
-    root->children["system"] = system;
-    return root;
-}
+    tree.freeze();
+    mark_module_owned(tree, tree.root());
 
-static bool mount_mirror(const fs::path& src_path, const fs::path& dst_path,
-                         const std::string& name) {
-    fs::path src = src_path / name;
-    fs::path dst = dst_path / name;
+    MagicTreeStats stats = tree.stats();
+    g_mount_stats.tree_nodes = static_cast<int>(stats.nodes);
+    g_mount_stats.tree_kib = static_cast<int>(stats.bytes / 1024);
+    LOG_INFO("Magic mount tree: " + std::to_string(stats.nodes) + " nodes, " +
+             std::to_string(stats.strings) + " names from " + std::to_string(stats.modules) +
+             " modules, " + std::to_string(stats.bytes / 1024) + " KiB (" +
+             std::to_string(stats.build_bytes / 1024) + " KiB while building)");
+    return true;
+}
 
-    try {
-        struct stat st;
-        if (lstat(src.c_str(), &st) != 0) {
-            LOG_WARN("lstat failed for: " + src.string());
-            return false;
+// Stock directory contents, read once through a dirfd so every decision for the
+// directory is made from here instead of re-resolving absolute paths per child
+struct DirSnapshot {
+    struct Entry {
+        std::string name;
+        unsigned char type;  // DT_*
+        NodeFileType file_type;
+    };
+
+    DIR* dir = nullptr;
+    bool exists = false;         // something exists at the path (symlinks followed)
+    std::vector<Entry> entries;  // sorted by name
+
+    DirSnapshot() = default;
+    DirSnapshot(const DirSnapshot&) = delete;
+    DirSnapshot& operator=(const DirSnapshot&) = delete;
+    ~DirSnapshot() {
+        if (dir) {
+            closedir(dir);
         }
+    }
 
-        if (S_ISREG(st.st_mode)) {
-            // Regular file: create empty file then bind mount
-            int fd = open(dst.c_str(), O_CREAT | O_WRONLY | O_TRUNC, st.st_mode & 07777);
-            if (fd < 0) {
-                LOG_ERROR("Failed to create mirror file: " + dst.string());
-                return false;
-            }
-            close(fd);
+    int fd() const { return dir ? dirfd(dir) : -1; }
 
-            if (!mount_bind_modern(src, dst, true)) {
-                LOG_WARN("Failed to bind mirror file: " + src.string());
-                return false;
-            }
-            LOG_VERBOSE("Mirror file: " + src.string() + " -> " + dst.string());
-        } else if (S_ISDIR(st.st_mode)) {
-            // Directory: create dir, copy attributes, recursively mirror children
-            if (mkdir(dst.c_str(), st.st_mode & 07777) != 0 && errno != EEXIST) {
-                LOG_ERROR("Failed to create mirror directory: " + dst.string());
-                return false;
-            }
+    const Entry* find(std::string_view name) const {
+        auto it = std::lower_bound(
+            entries.begin(), entries.end(), name,
+            [](const Entry& entry, std::string_view n) { return entry.name < n; });
+        return it != entries.end() && it->name == name ? &*it : nullptr;
+    }
+};
 
-            chmod(dst.c_str(), st.st_mode & 07777);
-            chown(dst.c_str(), st.st_uid, st.st_gid);
-            clone_attr(src, dst);
+static void take_snapshot(DirSnapshot& snap, const fs::path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        struct stat st;
+        snap.exists = stat(path.c_str(), &st) == 0;
+        return;
+    }
 
-            // Recursively mirror all children
-            bool ok = true;
-            for (const auto& entry : fs::directory_iterator(src)) {
-                std::string child_name = entry.path().filename().string();
-                if (!mount_mirror(src, dst, child_name)) {
-                    ok = false;
-                }
-            }
-            if (!ok) {
-                return false;
-            }
-        } else if (S_ISLNK(st.st_mode)) {
-            // Symlink: read target and create symlink
-            char target[PATH_MAX];
-            ssize_t len = readlink(src.c_str(), target, sizeof(target) - 1);
-            if (len < 0) {
-                LOG_ERROR("Failed to read symlink: " + src.string());
-                return false;
-            }
-            target[len] = '\0';
+    snap.exists = true;
+    snap.dir = fdopendir(fd);
+    if (!snap.dir) {
+        close(fd);
+        return;
+    }
 
-            if (symlink(target, dst.c_str()) != 0) {
-                LOG_ERROR("Failed to create symlink: " + dst.string());
-                return false;
+    struct dirent* entry;
+    while ((entry = readdir(snap.dir)) != nullptr) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        unsigned char type = entry->d_type;
+        NodeFileType file_type = NodeFileType::RegularFile;
+        // Whiteouts are char devices with rdev 0, so those need the full stat
+        if (type == DT_UNKNOWN || type == DT_CHR) {
+            struct stat st;
+            if (fstatat(snap.fd(), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = IFTODT(st.st_mode);
+            if (S_ISCHR(st.st_mode) && st.st_rdev == 0) {
+                file_type = NodeFileType::Whiteout;
             }
-            clone_attr(src, dst);
-            LOG_VERBOSE("Mirror symlink: " + src.string() + " -> " + std::string(target));
         }
-    } catch (const std::exception& e) {
-        LOG_WARN("Failed to mirror " + src.string() + ": " + std::string(e.what()));
-        return false;
+        if (type == DT_DIR) {
+            file_type = NodeFileType::Directory;
+        } else if (type == DT_LNK) {
+            file_type = NodeFileType::Symlink;
+        }
+        snap.entries.push_back({name, type, file_type});
     }
 
-    return true;
+    std::sort(snap.entries.begin(), snap.entries.end(),
+              [](const DirSnapshot::Entry& a, const DirSnapshot::Entry& b) {
+                  return a.name < b.name;
+              });
 }
 
-static bool mount_file(const fs::path& path, const fs::path& work_dir_path, const Node& node,
-                       bool has_tmpfs, bool disable_umount) {
-    g_mount_stats.total_mounts++;
-    g_mount_stats.files_mounted++;
-
-    fs::path target_path = has_tmpfs ? work_dir_path : path;
-
+static bool should_create_tmpfs(const MagicTree& tree, const DirSnapshot& real,
+                                const Node& node, const fs::path& path, bool has_tmpfs) {
     if (has_tmpfs) {
-        std::ofstream f(work_dir_path);
-        f.close();
+        return true;
     }
 
-    if (!node.module_path.empty()) {
-        if (!mount_bind_modern(node.module_path, target_path, true)) {
-            LOG_ERROR("Failed to bind mount file: " + node.module_path.string() + " -> " +
-                      target_path.string());
-            g_mount_stats.failed_mounts++;
-            return false;
-        }
-        LOG_VERBOSE("Mount file: " + node.module_path.string() + " -> " + target_path.string());
+    if (node.replace) {
+        return real.exists || node.source_dir != NO_STR;
+    }
 
-        if (!disable_umount) {
-            send_unmountable(target_path);
+    for (NodeId id : tree.children(node)) {
+        const Node& child = tree.node(id);
+        const DirSnapshot::Entry* entry = real.find(tree.str(child.name));
+
+        bool need = false;
+        if (child.file_type == NodeFileType::Symlink) {
+            need = true;
+        } else if (child.file_type == NodeFileType::Whiteout) {
+            need = entry != nullptr;
+        } else if (entry) {
+            need = (entry->file_type != child.file_type ||
+                    entry->file_type == NodeFileType::Symlink);
+        } else {
+            need = true;
         }
 
-        mount(nullptr, target_path.c_str(), nullptr, MS_REMOUNT | MS_RDONLY | MS_BIND, nullptr);
-        g_mount_stats.successful_mounts++;
+        if (need) {
+            if (node.source_dir == NO_STR && !real.exists) {
+                LOG_ERROR("Cannot create tmpfs on " + path.string() + " (no source)");
+                return false;
+            }
+            return true;
+        }
     }
 
-    return true;
+    return false;
 }
 
-static bool mount_symlink(const fs::path& work_dir_path, const Node& node) {
-    g_mount_stats.total_mounts++;
-    g_mount_stats.symlinks_created++;
+// Compiling walks the node tree against the stock directories and only emits
+// ops; nothing is created or mounted until the program runs.
 
-    if (!node.module_path.empty()) {
-        try {
-            auto link_target = fs::read_symlink(node.module_path);
+static void emit(MagicProgram& program, MountOpKind kind, uint32_t tree_id, std::string target,
+                 std::string source = {}, uint8_t flags = 0) {
+    program.ops.push_back({kind, flags, tree_id, std::move(target), std::move(source)});
+}
 
-            // Validate symlink safety
-            if (!is_safe_symlink(node.module_path, fs::path("/"))) {
-                LOG_ERROR("Unsafe symlink detected: " + node.module_path.string());
-                g_mount_stats.failed_mounts++;
-                return false;
-            }
+static std::string join_work(const std::string& work, const std::string& name) {
+    return work.empty() ? name : work + "/" + name;
+}
 
-            fs::create_symlink(link_target, work_dir_path);
-            clone_attr(node.module_path, work_dir_path);
-            g_mount_stats.successful_mounts++;
-        } catch (...) {
-            g_mount_stats.failed_mounts++;
-            return false;
+static void compile_mirror(MagicProgram& program, const DirSnapshot& parent,
+                           const fs::path& src_path, uint32_t tree_id, const std::string& work,
+                           const DirSnapshot::Entry& entry) {
+    std::string src = (src_path / entry.name).string();
+    std::string dst = join_work(work, entry.name);
+
+    // The bind covers the mode of mirrored files and dirs, so only the type matters
+    if (entry.type == DT_REG) {
+        emit(program, MountOpKind::Bind, tree_id, dst, src, OP_MIRROR);
+    } else if (entry.type == DT_DIR) {
+        // No module touches anything below here, so one recursive bind carries
+        // the whole subtree (and its attributes) instead of a mount per file
+        emit(program, MountOpKind::BindDir, tree_id, dst, src, OP_MIRROR);
+    } else if (entry.type == DT_LNK) {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(parent.fd(), entry.name.c_str(), target, sizeof(target) - 1);
+        if (len < 0) {
+            emit(program, MountOpKind::Fail, tree_id, dst, "Failed to read symlink " + src);
+            return;
         }
+        target[len] = '\0';
+
+        emit(program, MountOpKind::Symlink, tree_id, dst, target, OP_MIRROR);
+        emit(program, MountOpKind::CloneAttr, tree_id, dst, src);
     }
-    return true;
 }
 
-static bool create_whiteout(const fs::path& target_path, const fs::path& work_dir_path) {
-    try {
-        fs::create_directories(work_dir_path.parent_path());
-
-        if (fs::exists(work_dir_path)) {
-            fs::remove(work_dir_path);
+static void compile_node(const MagicTree& tree, MagicProgram& program, const fs::path& path,
+                         uint32_t tree_id, const std::string& work, const Node& current,
+                         bool target_exists);
+
+static void compile_children(const MagicTree& tree, MagicProgram& program,
+                             const DirSnapshot& real, const fs::path& path, uint32_t tree_id,
+                             const std::string& work, const Node& node) {
+    bool has_tmpfs = tree_id != NO_TREE;
+    bool walk_real = real.exists && !node.replace;
+    if (walk_real) {
+        if (!real.dir) {
+            emit(program, MountOpKind::Fail, tree_id, has_tmpfs ? work : path.string(),
+                 "Failed to iterate directory " + path.string());
         }
-
-        if (mknod(work_dir_path.c_str(), S_IFCHR | 0000, makedev(0, 0)) != 0) {
-            LOG_ERROR("Failed to create whiteout: " + work_dir_path.string() + ": " +
-                      strerror(errno));
-            return false;
+        for (const auto& entry : real.entries) {
+            const Node* child = tree.find_child(node, entry.name);
+            if (child) {
+                if (!child->skip) {
+                    compile_node(tree, program, path, tree_id, work, *child, true);
+                }
+            } else if (has_tmpfs) {
+                compile_mirror(program, real, path, tree_id, work, entry);
+            }
         }
+    }
 
-        if (fs::exists(target_path)) {
-            clone_attr(target_path, work_dir_path);
-        } else {
-            copy_path_context(work_dir_path.parent_path(), work_dir_path);
+    // Module entries the real directory doesn't have (or all of them when replaced)
+    for (NodeId id : tree.children(node)) {
+        const Node& child_node = tree.node(id);
+        if (child_node.skip) {
+            continue;
         }
 
-        return true;
-    } catch (const std::exception& e) {
-        LOG_ERROR("Failed to create whiteout: " + work_dir_path.string() + ": " +
-                  std::string(e.what()));
-        return false;
+        bool in_real = real.find(tree.str(child_node.name)) != nullptr;
+        if (!walk_real || !in_real) {
+            compile_node(tree, program, path, tree_id, work, child_node, in_real);
+        }
     }
 }
 
-static bool do_magic_mount(const fs::path& path, const fs::path& work_dir_path, const Node& current,
-                           bool has_tmpfs, bool disable_umount);
+static void compile_node(const MagicTree& tree, MagicProgram& program, const fs::path& path,
+                         uint32_t tree_id, const std::string& work, const Node& current,
+                         bool target_exists) {
+    std::string name = tree.name(current);
+    fs::path target_path = path / name;
+    std::string target_work = join_work(work, name);
+    std::string module_path = tree.source_path(current).string();
+    bool has_tmpfs = tree_id != NO_TREE;
 
-static bool mount_directory_children(const fs::path& path, const fs::path& work_dir_path,
-                                     const Node& node, bool has_tmpfs, bool disable_umount) {
-    bool ok = true;
-    if (fs::exists(path) && !node.replace) {
+    switch (current.file_type) {
+    case NodeFileType::RegularFile:
+        if (!module_path.empty()) {
+            emit(program, MountOpKind::Bind, tree_id,
+                 has_tmpfs ? target_work : target_path.string(), module_path, OP_MODULE);
+        }
+        break;
+
+    case NodeFileType::Symlink:
+        if (module_path.empty()) {
+            break;
+        }
+        if (!has_tmpfs) {
+            emit(program, MountOpKind::Bind, tree_id, target_path.string(), module_path,
+                 OP_MODULE);
+            break;
+        }
         try {
-            for (const auto& entry : fs::directory_iterator(path)) {
-                std::string name = entry.path().filename().string();
-                auto it = node.children.find(name);
-                if (it != node.children.end()) {
-                    if (!it->second.skip) {
-                        if (!do_magic_mount(path, work_dir_path, it->second, has_tmpfs,
-                                            disable_umount)) {
-                            ok = false;
-                        }
-                    }
-                } else if (has_tmpfs) {
-                    if (!mount_mirror(path, work_dir_path, name)) {
-                        ok = false;
-                    }
-                }
+            if (!is_safe_symlink(module_path, fs::path("/"))) {
+                emit(program, MountOpKind::Fail, tree_id, target_work,
+                     "Unsafe symlink detected: " + module_path);
+                break;
             }
-        } catch (...) {
-            LOG_WARN("Failed to iterate directory: " + path.string());
-            ok = false;
+            emit(program, MountOpKind::Symlink, tree_id, target_work,
+                 fs::read_symlink(module_path).string(), OP_MODULE);
+            emit(program, MountOpKind::CloneAttr, tree_id, target_work, module_path);
+        } catch (const std::exception& e) {
+            emit(program, MountOpKind::Fail, tree_id, target_work,
+                 "Failed to read symlink " + module_path + ": " + e.what());
         }
-    }
+        break;
 
-    for (const auto& [name, child_node] : node.children) {
-        if (child_node.skip) {
-            continue;
+    case NodeFileType::Directory: {
+        program.dirs++;
+        if (has_tmpfs && !target_exists && current.module_owned) {
+            // A directory only one module adds: one recursive bind of the module's
+            // own copy instead of a skeleton with a bind per file
+            emit(program, MountOpKind::BindDir, tree_id, target_work, module_path, OP_MODULE);
+            break;
+        }
+
+        DirSnapshot real;
+        if (target_exists) {
+            take_snapshot(real, target_path);
         }
 
-        fs::path real_path = path / name;
-        bool processed_in_first_loop = fs::exists(real_path) && !node.replace;
-        
-        if (!processed_in_first_loop) {
-            if (!do_magic_mount(path, work_dir_path, child_node, has_tmpfs, disable_umount)) {
-                ok = false;
+        bool create_tmpfs =
+            !has_tmpfs && should_create_tmpfs(tree, real, current, target_path, false);
+        std::string attr_source = real.exists ? target_path.string() : module_path;
+        uint32_t child_tree = tree_id;
+        std::string child_work = target_work;
+
+        if (create_tmpfs) {
+            if (attr_source.empty()) {
+                emit(program, MountOpKind::Fail, NO_TREE, target_path.string(),
+                     "No source for tmpfs skeleton");
+                break;
             }
+            child_tree = program.trees++;
+            child_work.clear();
+            emit(program, MountOpKind::OpenTree, child_tree, target_path.string(), attr_source);
+            emit(program, MountOpKind::CloneAttr, child_tree, "", attr_source);
+        } else if (has_tmpfs) {
+            emit(program, MountOpKind::Mkdir, tree_id, target_work);
+            emit(program, MountOpKind::CloneAttr, tree_id, target_work, attr_source);
         }
+
+        compile_children(tree, program, real, target_path, child_tree, child_work, current);
+
+        if (create_tmpfs) {
+            emit(program, MountOpKind::Finalize, child_tree, target_path.string());
+        }
+        break;
     }
 
-    return ok;
+    case NodeFileType::Whiteout:
+        if (has_tmpfs) {
+            emit(program, MountOpKind::Whiteout, tree_id, target_work);
+            emit(program, MountOpKind::CloneAttr, tree_id, target_work,
+                 target_exists ? target_path.string() : "");
+        }
+        break;
+    }
 }
 
-static bool should_create_tmpfs(const Node& node, const fs::path& path, bool has_tmpfs) {
-    if (has_tmpfs) {
-        return true;
-    }
+static void compile_program(const MagicTree& tree, MagicProgram& program) {
+    compile_node(tree, program, "/", NO_TREE, "", tree.node(tree.root()), true);
+    sort_program(program);
+}
 
-    if (node.replace) {
-        return fs::exists(path) || !node.module_path.empty();
+static int open_detached_tmpfs(const std::string& mount_source) {
+    int fs_fd = syscall(__NR_fsopen, "tmpfs", FSOPEN_CLOEXEC);
+    if (fs_fd < 0) {
+        return -1;
     }
 
-    for (const auto& [name, child] : node.children) {
-        fs::path real_path = path / name;
+    const char* source = mount_source.c_str();
+    int mnt_fd = -1;
+    if (syscall(__NR_fsconfig, fs_fd, FSCONFIG_SET_STRING, "source", source, 0) == 0 &&
+        syscall(__NR_fsconfig, fs_fd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) == 0) {
+        mnt_fd = syscall(__NR_fsmount, fs_fd, FSMOUNT_CLOEXEC, 0);
+    }
+    close(fs_fd);
+    return mnt_fd;
+}
 
-        bool need = false;
-        if (child.file_type == NodeFileType::Symlink) {
-            need = true;
-        } else if (child.file_type == NodeFileType::Whiteout) {
-            need = fs::exists(real_path);
-        } else {
-            try {
-                if (fs::exists(real_path)) {
-                    NodeFileType real_ft = get_file_type(real_path);
-                    need = (real_ft != child.file_type || real_ft == NodeFileType::Symlink);
-                } else {
-                    need = true;
-                }
-            } catch (...) {
-                need = true;
-            }
-        }
+// Replacement trees can be built off-namespace only if the kernel lets binds
+// land inside a detached mount (6.15+); otherwise they go through the workdir
+static bool detached_trees_supported(const std::string& mount_source) {
+    static int supported = -1;
+    if (supported >= 0) {
+        return supported == 1;
+    }
 
-        if (need) {
-            if (node.module_path.empty() && !fs::exists(path)) {
-                LOG_ERROR("Cannot create tmpfs on " + path.string() + " (no source)");
-                return false;
-            }
-            return true;
-        }
+    supported = 0;
+    int outer = open_detached_tmpfs(mount_source);
+    int inner = outer >= 0 ? open_detached_tmpfs(mount_source) : -1;
+    if (inner >= 0 && mkdirat(outer, "probe", 0700) == 0 &&
+        syscall(__NR_move_mount, inner, "", outer, "probe", MOVE_MOUNT_F_EMPTY_PATH) == 0) {
+        supported = 1;
+    }
+    if (inner >= 0) {
+        close(inner);
+    }
+    if (outer >= 0) {
+        close(outer);
     }
 
-    return false;
+    LOG_DEBUG(std::string("Detached magic mount trees: ") + (supported ? "yes" : "no"));
+    return supported == 1;
 }
 
-static bool prepare_tmpfs_dir(const fs::path& path, const fs::path& work_dir_path,
-                              const Node& node) {
-    try {
-        fs::create_directories(work_dir_path);
+// Path that reaches into a detached mount for the path-based helpers
+static fs::path detached_root(int tree_fd) {
+    return fs::path("/proc/self/fd") / std::to_string(tree_fd) / ".";
+}
 
-        if (!fs::exists(path) && node.module_path.empty()) {
-            LOG_ERROR("No source for tmpfs skeleton: " + path.string());
-            return false;
-        }
+static bool attach_detached_tree(int tree_fd, const fs::path& path, bool disable_umount) {
+    // Binds inside a detached tree can't be remounted one by one, so the whole
+    // tree turns read-only from its root before it goes live
+    if (!mount_set_readonly(tree_fd, "", true)) {
+        LOG_WARN("Failed to make " + path.string() + " tree read-only: " + strerror(errno));
+    }
 
-        fs::path src_path = fs::exists(path) ? path : node.module_path;
-        clone_attr(src_path, work_dir_path);
+    if (syscall(__NR_move_mount, tree_fd, "", AT_FDCWD, path.c_str(), MOVE_MOUNT_F_EMPTY_PATH) !=
+        0) {
+        LOG_ERROR("Failed to attach tree at " + path.string() + ": " + strerror(errno));
+        return false;
+    }
+    mount(nullptr, path.c_str(), nullptr, MS_PRIVATE, nullptr);
 
+    if (!disable_umount) {
+        send_unmountable(path);
+    }
+
+    LOG_VERBOSE("Attached detached tree -> " + path.string());
+    return true;
+}
+
+static bool prepare_tmpfs_dir(const fs::path& work_dir_path) {
+    try {
+        fs::create_directories(work_dir_path);
         mount(work_dir_path.c_str(), work_dir_path.c_str(), nullptr, MS_BIND | MS_REC, nullptr);
     } catch (...) {
         return false;
@@ -572,7 +811,11 @@ static bool prepare_tmpfs_dir(const fs::path& path, const fs::path& work_dir_pat
 
 static bool finalize_tmpfs_overlay(const fs::path& path, const fs::path& work_dir_path,
                                    bool disable_umount) {
-    mount(nullptr, work_dir_path.c_str(), nullptr, MS_REMOUNT | MS_RDONLY | MS_BIND, nullptr);
+    // One recursive mount_setattr covers every bind in the tree; older kernels
+    // had the files and module dirs remounted as they were bound and only need the root here
+    if (!mount_set_readonly(AT_FDCWD, work_dir_path.c_str(), true)) {
+        mount(nullptr, work_dir_path.c_str(), nullptr, MS_REMOUNT | MS_RDONLY | MS_BIND, nullptr);
+    }
     mount(work_dir_path.c_str(), path.c_str(), nullptr, MS_MOVE, nullptr);
     mount(nullptr, path.c_str(), nullptr, MS_PRIVATE, nullptr);
 
@@ -584,91 +827,370 @@ static bool finalize_tmpfs_overlay(const fs::path& path, const fs::path& work_di
     return true;
 }
 
-static bool do_magic_mount(const fs::path& path, const fs::path& work_dir_path, const Node& current,
-                           bool has_tmpfs, bool disable_umount) {
-    fs::path target_path = path / current.name;
-    fs::path target_work_path = work_dir_path / current.name;
+// Running: a flat loop over the sorted ops. Trees are opened on the fly and
+// their ops address paths below the tree root.
 
-    switch (current.file_type) {
-    case NodeFileType::RegularFile:
-        return mount_file(target_path, target_work_path, current, has_tmpfs, disable_umount);
+struct TreeState {
+    fs::path root;
+    int fd = -1;        // detached tree, -1 when it lives in the workdir
+    bool open = false;  // ops of a tree that failed to open are skipped
+    bool failed = false;
+};
 
-    case NodeFileType::Symlink:
-        if (has_tmpfs) {
-            return mount_symlink(target_work_path, current);
-        } else {
-            return mount_file(target_path, target_work_path, current, has_tmpfs, disable_umount);
+struct ProgramRun {
+    fs::path work_dir;
+    bool disable_umount = false;
+    std::vector<TreeState> trees;
+    AttrCloner attrs;  // shared so clones from one source dir reuse its fd and buffers
+};
+
+static fs::path op_path(const MountOp& op, const TreeState* tree) {
+    if (!tree) {
+        return op.target;
+    }
+    return op.target.empty() ? tree->root : tree->root / op.target;
+}
+
+static bool run_op(ProgramRun& run, const MountOp& op);
+
+// Entry-by-entry mirror of a directory, used when it can't be bound as a whole
+static bool mirror_dir_entries(ProgramRun& run, const MountOp& dir_op) {
+    DirSnapshot snap;
+    take_snapshot(snap, dir_op.source);
+    if (!snap.dir) {
+        LOG_WARN("Failed to read mirror directory: " + dir_op.source);
+        return false;
+    }
+
+    fs::path dst = op_path(dir_op, &run.trees[dir_op.tree]);
+    struct stat st;
+    if (fstat(snap.fd(), &st) == 0) {
+        chmod(dst.c_str(), st.st_mode & 07777);
+        chown(dst.c_str(), st.st_uid, st.st_gid);
+    }
+    run.attrs.clone(dir_op.source, dst);
+
+    MagicProgram entries;
+    for (const auto& entry : snap.entries) {
+        compile_mirror(entries, snap, dir_op.source, dir_op.tree, dir_op.target, entry);
+    }
+
+    bool ok = true;
+    for (const auto& op : entries.ops) {
+        if (!run_op(run, op)) {
+            ok = false;
         }
+    }
+    return ok;
+}
 
-    case NodeFileType::Directory: {
-        g_mount_stats.dirs_mounted++;
-        bool create_tmpfs = !has_tmpfs && should_create_tmpfs(current, target_path, false);
-        bool effective_tmpfs = has_tmpfs || create_tmpfs;
-
-        if (effective_tmpfs) {
-            if (create_tmpfs) {
-                if (!prepare_tmpfs_dir(target_path, target_work_path, current)) {
-                    g_mount_stats.failed_mounts++;
-                    return false;
-                }
-            } else if (has_tmpfs && !fs::exists(target_work_path)) {
-                fs::create_directory(target_work_path);
-                fs::path src_path = fs::exists(target_path) ? target_path : current.module_path;
-                clone_attr(src_path, target_work_path);
-            }
+static bool create_mount_point(const fs::path& path, bool dir) {
+    if (dir) {
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+            LOG_ERROR("Failed to create mount point: " + path.string() + ": " + strerror(errno));
+            return false;
         }
+        return true;
+    }
 
-        if (!mount_directory_children(target_path, target_work_path, current, effective_tmpfs,
-                                      disable_umount)) {
-            g_mount_stats.failed_mounts++;
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Failed to create mount point: " + path.string() + ": " + strerror(errno));
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+static bool run_bind(ProgramRun& run, const MountOp& op, const TreeState* tree) {
+    fs::path dst = op_path(op, tree);
+    bool mirror = op.flags & OP_MIRROR;
+
+    if (tree && !create_mount_point(dst, false)) {
+        return false;
+    }
+
+    if (mirror) {
+        if (!mount_bind_modern(op.source, dst, true)) {
+            LOG_WARN("Failed to bind mirror file: " + op.source);
             return false;
         }
+        g_mount_stats.mirror_binds++;
+        LOG_VERBOSE("Mirror file: " + op.source + " -> " + dst.string());
+        return true;
+    }
 
-        if (create_tmpfs) {
-            if (!finalize_tmpfs_overlay(target_path, target_work_path, disable_umount)) {
-                g_mount_stats.failed_mounts++;
-                return false;
-            }
+    g_mount_stats.total_mounts++;
+    g_mount_stats.files_mounted++;
+
+    // Inside a tmpfs tree the finalize step makes everything read-only at once
+    bool per_file_ro = !tree || !mount_setattr_supported();
+    bool bound = per_file_ro ? mount_bind_readonly(op.source, dst)
+                             : mount_bind_modern(op.source, dst, true);
+    if (!bound) {
+        LOG_ERROR("Failed to bind mount file: " + op.source + " -> " + dst.string());
+        return false;
+    }
+    LOG_VERBOSE("Mount file: " + op.source + " -> " + dst.string());
+
+    // Inside a tmpfs tree the tree root is what gets unmounted
+    if (!run.disable_umount && !tree) {
+        send_unmountable(dst);
+    }
+    g_mount_stats.successful_mounts++;
+    return true;
+}
+
+static bool run_bind_dir(ProgramRun& run, const MountOp& op, const TreeState* tree) {
+    fs::path dst = op_path(op, tree);
+    bool mirror = op.flags & OP_MIRROR;
+    if (!mirror) {
+        g_mount_stats.total_mounts++;
+    }
+
+    if (!create_mount_point(dst, true)) {
+        return false;
+    }
+
+    if (!mount_bind_modern(op.source, dst, true)) {
+        if (mirror) {
+            LOG_WARN("Failed to bind mirror dir, mirroring entries: " + op.source);
+            return mirror_dir_entries(run, op);
         }
-        break;
+        LOG_ERROR("Failed to bind module dir: " + op.source + " -> " + dst.string());
+        return false;
     }
 
-    case NodeFileType::Whiteout:
-        if (has_tmpfs) {
-            if (!create_whiteout(target_path, target_work_path)) {
-                g_mount_stats.failed_mounts++;
-                return false;
-            }
-            g_mount_stats.successful_mounts++;
+    // Finalize can only make the whole tree read-only through mount_setattr;
+    // without it the module dir keeps the writable flags of its source mount
+    if (!mirror && !mount_setattr_supported() &&
+        mount(nullptr, dst.c_str(), nullptr, MS_REMOUNT | MS_RDONLY | MS_BIND, nullptr) != 0) {
+        LOG_ERROR("Failed to make module dir read-only: " + dst.string() + ": " +
+                  strerror(errno));
+        umount2(dst.c_str(), MNT_DETACH);
+        return false;
+    }
+
+    if (mirror) {
+        g_mount_stats.mirror_binds++;
+        LOG_VERBOSE("Mirror dir: " + op.source + " -> " + dst.string());
+    } else {
+        g_mount_stats.successful_mounts++;
+        LOG_VERBOSE("Mount module dir: " + op.source + " -> " + dst.string());
+    }
+    return true;
+}
+
+static bool run_open_tree(ProgramRun& run, const MountOp& op, TreeState& tree) {
+    if (!g_detached_source.empty()) {
+        tree.fd = open_detached_tmpfs(g_detached_source);
+        if (tree.fd < 0) {
+            LOG_ERROR("Failed to create detached tmpfs for " + op.target + ": " +
+                      strerror(errno));
+            return false;
+        }
+        g_mount_stats.tmpfs_created++;
+        tree.root = detached_root(tree.fd);
+    } else {
+        tree.root = run.work_dir / fs::path(op.target).relative_path();
+        if (!prepare_tmpfs_dir(tree.root)) {
+            LOG_ERROR("Failed to prepare tmpfs skeleton for " + op.target);
+            return false;
         }
-        break;
     }
 
+    tree.open = true;
     return true;
 }
 
+static bool run_finalize(ProgramRun& run, const MountOp& op, const TreeState& tree) {
+    // A tree with failed ops is left unattached; the failures are already counted
+    if (tree.failed) {
+        LOG_WARN("Not attaching incomplete tree at " + op.target);
+        return true;
+    }
+    if (tree.fd >= 0) {
+        return attach_detached_tree(tree.fd, op.target, run.disable_umount);
+    }
+    return finalize_tmpfs_overlay(op.target, tree.root, run.disable_umount);
+}
+
+static void run_clone_attr(ProgramRun& run, const MountOp& op, const TreeState* tree) {
+    fs::path dst = op_path(op, tree);
+    if (op.source.empty()) {
+        copy_path_context(dst.parent_path(), dst);
+    } else {
+        run.attrs.clone(op.source, dst);
+    }
+}
+
+static bool run_op(ProgramRun& run, const MountOp& op) {
+    TreeState* tree = op.tree == NO_TREE ? nullptr : &run.trees[op.tree];
+    fs::path dst = op_path(op, tree);
+
+    switch (op.kind) {
+    case MountOpKind::OpenTree:
+        return run_open_tree(run, op, *tree);
+
+    case MountOpKind::Mkdir:
+        return create_mount_point(dst, true);
+
+    case MountOpKind::Whiteout:
+        if (unlink(dst.c_str()) != 0 && errno != ENOENT) {
+            LOG_ERROR("Failed to create whiteout: " + dst.string() + ": " + strerror(errno));
+            return false;
+        }
+        if (mknod(dst.c_str(), S_IFCHR | 0000, makedev(0, 0)) != 0) {
+            LOG_ERROR("Failed to create whiteout: " + dst.string() + ": " + strerror(errno));
+            return false;
+        }
+        g_mount_stats.successful_mounts++;
+        return true;
+
+    case MountOpKind::Symlink:
+        if (op.flags & OP_MODULE) {
+            g_mount_stats.total_mounts++;
+            g_mount_stats.symlinks_created++;
+        }
+        if (symlink(op.source.c_str(), dst.c_str()) != 0) {
+            LOG_ERROR("Failed to create symlink: " + dst.string() + ": " + strerror(errno));
+            return false;
+        }
+        if (op.flags & OP_MODULE) {
+            g_mount_stats.successful_mounts++;
+        }
+        LOG_VERBOSE("Symlink: " + dst.string() + " -> " + op.source);
+        return true;
+
+    case MountOpKind::Bind:
+        return run_bind(run, op, tree);
+
+    case MountOpKind::BindDir:
+        return run_bind_dir(run, op, tree);
+
+    case MountOpKind::CloneAttr:
+        run_clone_attr(run, op, tree);
+        return true;
+
+    case MountOpKind::Finalize:
+        return run_finalize(run, op, *tree);
+
+    case MountOpKind::Fail:
+        LOG_ERROR(op.source + " (" + dst.string() + ")");
+        return false;
+    }
+    return false;
+}
+
+static bool run_program(const MagicProgram& program, const fs::path& work_dir,
+                        bool disable_umount) {
+    ProgramRun run;
+    run.work_dir = work_dir;
+    run.disable_umount = disable_umount;
+    run.trees.resize(program.trees);
+
+    bool ok = true;
+    const auto& ops = program.ops;
+    for (size_t i = 0; i < ops.size(); i++) {
+        const MountOp& op = ops[i];
+        TreeState* tree = op.tree == NO_TREE ? nullptr : &run.trees[op.tree];
+        if (tree && !tree->open && op.kind != MountOpKind::OpenTree) {
+            continue;
+        }
+
+        // Attribute clones are grouped per tree and run back to back, after
+        // everything in the tree exists and before it turns read-only
+        if (op.kind == MountOpKind::CloneAttr) {
+            for (; i < ops.size() && ops[i].kind == MountOpKind::CloneAttr &&
+                   ops[i].tree == op.tree;
+                 i++) {
+                run_clone_attr(run, ops[i], tree);
+            }
+            i--;
+            continue;
+        }
+
+        if (!run_op(run, op)) {
+            g_mount_stats.failed_mounts++;
+            ok = false;
+            if (tree) {
+                tree->failed = true;
+            }
+        }
+    }
+
+    for (const auto& tree : run.trees) {
+        if (tree.fd >= 0) {
+            close(tree.fd);
+        }
+    }
+
+    g_mount_stats.attr_syscalls = static_cast<int>(run.attrs.syscalls());
+    LOG_DEBUG("Attribute clones: " + std::to_string(program.count(MountOpKind::CloneAttr)) +
+              " ops, " + std::to_string(run.attrs.syscalls()) + " syscalls");
+    return ok;
+}
+
+// The compiled program, replayed from the cache when neither the tree nor the
+// partitions it touches changed since it was saved
+static void build_program(const MagicTree& tree, MagicProgram& program) {
+    std::string key = program_cache_key(tree);
+    if (!key.empty() && load_program(MAGIC_PROGRAM_FILE, key, program)) {
+        g_mount_stats.program_cached = 1;
+        LOG_INFO("Magic mount: replaying cached program (" + std::to_string(program.ops.size()) +
+                 " ops)");
+        return;
+    }
+
+    compile_program(tree, program);
+    LOG_INFO("Magic mount: compiled " + std::to_string(program.ops.size()) + " ops, " +
+             std::to_string(program.trees) + " trees");
+    if (!key.empty() && !program.has_errors() &&
+        !save_program(MAGIC_PROGRAM_FILE, key, program)) {
+        LOG_DEBUG("Magic mount program not cached");
+    }
+}
+
 bool mount_partitions(const fs::path& tmp_path, const std::vector<fs::path>& module_paths,
                       const std::string& mount_source,
                       const std::vector<std::string>& extra_partitions, bool disable_umount) {
-    Node* root = collect_all_modules(module_paths, extra_partitions);
-    if (!root) {
+    MagicTree tree;
+    if (!collect_all_modules(tree, module_paths, extra_partitions)) {
         LOG_INFO("No files to magic mount");
         return true;
     }
 
-    fs::path work_dir = tmp_path / "workdir";
-
-    if (!mount_tmpfs(work_dir, mount_source.c_str())) {
-        LOG_ERROR("Failed to create workdir tmpfs at " + work_dir.string());
-        delete root;
+    MagicProgram program;
+    try {
+        build_program(tree, program);
+    } catch (const std::exception& e) {
+        LOG_ERROR("Magic mount failed to compile: " + std::string(e.what()));
         return false;
     }
+    g_mount_stats.dirs_mounted = program.dirs;
+    g_mount_stats.program_ops = static_cast<int>(program.ops.size());
+    g_mount_stats.attr_clones = static_cast<int>(program.count(MountOpKind::CloneAttr));
 
-    mount(nullptr, work_dir.c_str(), nullptr, MS_PRIVATE, nullptr);
+    size_t mounts_before = count_mounts();
+    fs::path work_dir = tmp_path / "workdir";
+
+    // Detached trees need no workdir: each one is assembled off-namespace and
+    // attached with a single move_mount
+    bool detached = detached_trees_supported(mount_source);
+    g_detached_source = detached ? mount_source : "";
+
+    if (!detached) {
+        if (!mount_tmpfs(work_dir, mount_source.c_str())) {
+            LOG_ERROR("Failed to create workdir tmpfs at " + work_dir.string());
+            return false;
+        }
+
+        mount(nullptr, work_dir.c_str(), nullptr, MS_PRIVATE, nullptr);
+    }
 
     bool result = false;
     try {
-        result = do_magic_mount("/", work_dir, *root, false, disable_umount);
+        result = run_program(program, work_dir, disable_umount);
     } catch (const std::exception& e) {
         LOG_ERROR("Magic mount failed with exception: " + std::string(e.what()));
         result = false;
@@ -677,25 +1199,44 @@ bool mount_partitions(const fs::path& tmp_path, const std::vector<fs::path>& mod
         result = false;
     }
 
-    g_mount_stats.tmpfs_created++;
-    if (umount2(work_dir.c_str(), MNT_DETACH) != 0) {
-        LOG_WARN("Failed to umount workdir: " + work_dir.string() + ": " + strerror(errno));
-    }
-    try {
-        if (fs::exists(work_dir)) {
-            fs::remove(work_dir);
+    if (!detached) {
+        g_mount_stats.tmpfs_created++;
+        if (umount2(work_dir.c_str(), MNT_DETACH) != 0) {
+            LOG_WARN("Failed to umount workdir: " + work_dir.string() + ": " + strerror(errno));
+        }
+        try {
+            if (fs::exists(work_dir)) {
+                fs::remove(work_dir);
+            }
+        } catch (const std::exception& e) {
+            LOG_WARN("Failed to remove workdir: " + work_dir.string() + ": " + e.what());
         }
-    } catch (const std::exception& e) {
-        LOG_WARN("Failed to remove workdir: " + work_dir.string() + ": " + e.what());
     }
+    g_detached_source.clear();
 
-    delete root;
+    size_t mounts_after = count_mounts();
+    g_mount_stats.mounts_added = static_cast<int>(mounts_after) - static_cast<int>(mounts_before);
+    LOG_INFO("Magic mount: " + std::to_string(mounts_before) + " -> " +
+             std::to_string(mounts_after) + " mounts (" +
+             std::to_string(g_mount_stats.mirror_binds) + " mirror binds)");
 
     save_mount_statistics();
 
     return result;
 }
 
+std::string describe_magic_mount(const std::vector<fs::path>& module_paths,
+                                 const std::vector<std::string>& extra_partitions) {
+    MagicTree tree;
+    if (!collect_all_modules(tree, module_paths, extra_partitions)) {
+        return "";
+    }
+
+    MagicProgram program;
+    compile_program(tree, program);
+    return describe_program(program);
+}
+
 bool mount_partitions_auto(const fs::path& tmp_path, const std::vector<fs::path>& module_paths,
                            const std::string& mount_source, bool disable_umount) {
     // Automatically detect all partitions
@@ -737,6 +1278,14 @@ MountStatistics get_mount_statistics() {
             stats.dirs_mounted = get_int("dirs_mounted");
             stats.symlinks_created = get_int("symlinks_created");
             stats.overlayfs_mounts = get_int("overlayfs_mounts");
+            stats.mirror_binds = get_int("mirror_binds");
+            stats.mounts_added = get_int("mounts_added");
+            stats.tree_nodes = get_int("tree_nodes");
+            stats.tree_kib = get_int("tree_kib");
+            stats.program_ops = get_int("program_ops");
+            stats.attr_clones = get_int("attr_clones");
+            stats.program_cached = get_int("program_cached") != 0;
+            stats.attr_syscalls = get_int("attr_syscalls");
         } catch (...) {
             // Return zeros on parse error
         }
@@ -760,7 +1309,15 @@ void save_mount_statistics() {
          << "  \"files_mounted\": " << g_mount_stats.files_mounted << ",\n"
          << "  \"dirs_mounted\": " << g_mount_stats.dirs_mounted << ",\n"
          << "  \"symlinks_created\": " << g_mount_stats.symlinks_created << ",\n"
-         << "  \"overlayfs_mounts\": " << g_mount_stats.overlayfs_mounts << "\n"
+         << "  \"overlayfs_mounts\": " << g_mount_stats.overlayfs_mounts << ",\n"
+         << "  \"mirror_binds\": " << g_mount_stats.mirror_binds << ",\n"
+         << "  \"mounts_added\": " << g_mount_stats.mounts_added << ",\n"
+         << "  \"tree_nodes\": " << g_mount_stats.tree_nodes << ",\n"
+         << "  \"tree_kib\": " << g_mount_stats.tree_kib << ",\n"
+         << "  \"program_ops\": " << g_mount_stats.program_ops << ",\n"
+         << "  \"attr_clones\": " << g_mount_stats.attr_clones << ",\n"
+         << "  \"program_cached\": " << g_mount_stats.program_cached << ",\n"
+         << "  \"attr_syscalls\": " << g_mount_stats.attr_syscalls << "\n"
          << "}\n";
 
     file.close();
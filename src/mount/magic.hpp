@@ -19,6 +19,14 @@ struct MountStatistics {
     int dirs_mounted = 0;
     int symlinks_created = 0;
     int overlayfs_mounts = 0;  // OverlayFS partition mounts
+    int mirror_binds = 0;      // binds re-exposing untouched stock entries
+    int mounts_added = 0;      // mount table growth of the last magic mount
+    int tree_nodes = 0;        // magic mount node tree size
+    int tree_kib = 0;
+    int program_ops = 0;          // ops in the compiled mount program
+    int attr_clones = 0;          // attribute clones among them
+    bool program_cached = false;  // program was replayed from the cache
+    int attr_syscalls = 0;        // syscalls spent cloning attributes
 
     // Calculate success rate
     double get_success_rate() const {
@@ -35,6 +43,10 @@ bool mount_partitions(const fs::path& tmp_path, const std::vector<fs::path>& mod
 bool mount_partitions_auto(const fs::path& tmp_path, const std::vector<fs::path>& module_paths,
                            const std::string& mount_source, bool disable_umount);
 
+// Dry run: the mount program magic mount would run for these modules, as text
+std::string describe_magic_mount(const std::vector<fs::path>& module_paths,
+                                 const std::vector<std::string>& extra_partitions);
+
 // Get mount statistics (for WebUI/debugging)
 MountStatistics get_mount_statistics();
 
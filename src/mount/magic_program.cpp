@@ -0,0 +1,294 @@
+// mount/magic_program.cpp - Flat mount-operation program for magic mount
+#include "magic_program.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include "../core/manifest.hpp"
+#include "../utils.hpp"
+
+namespace hymo {
+
+namespace {
+
+// Bump when the op set or the way programs are compiled changes
+constexpr int PROGRAM_VERSION = 1;
+constexpr const char* PROGRAM_MAGIC = "hymo-magic-program";
+
+const char* const KIND_NAMES[] = {"open-tree", "mkdir",      "whiteout", "symlink", "bind",
+                                  "bind-dir",  "clone-attr", "finalize", "fail"};
+
+const char* kind_name(MountOpKind kind) {
+    return KIND_NAMES[static_cast<size_t>(kind)];
+}
+
+bool parse_kind(const std::string& name, MountOpKind& kind) {
+    for (size_t i = 0; i < std::size(KIND_NAMES); i++) {
+        if (name == KIND_NAMES[i]) {
+            kind = static_cast<MountOpKind>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+int phase(MountOpKind kind) {
+    switch (kind) {
+    case MountOpKind::OpenTree:
+        return 0;
+    case MountOpKind::CloneAttr:
+        return 2;
+    case MountOpKind::Finalize:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// Path order where '/' sorts before every other byte, so a directory always
+// comes right before its own entries
+int compare_paths(const std::string& a, const std::string& b) {
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] == b[i])
+            continue;
+        if (a[i] == '/')
+            return -1;
+        if (b[i] == '/')
+            return 1;
+        return static_cast<unsigned char>(a[i]) < static_cast<unsigned char>(b[i]) ? -1 : 1;
+    }
+    return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+}
+
+// Live ops (NO_TREE) sort first
+uint64_t tree_rank(const MountOp& op) {
+    return op.tree == NO_TREE ? 0 : uint64_t(op.tree) + 1;
+}
+
+void hash_node(const MagicTree& tree, NodeId id, const std::string& path, Sha256& hasher) {
+    const Node& node = tree.node(id);
+    fs::path source = tree.source_path(node);
+    std::string record = path + "\t" + std::to_string(static_cast<int>(node.file_type)) +
+                         (node.replace ? "r" : "") + (node.skip ? "s" : "") +
+                         (node.module_owned ? "o" : "") + "\t" + source.string();
+
+    // The link text is copied into the Symlink op, so retargeting a module
+    // symlink has to change the key
+    if (node.file_type == NodeFileType::Symlink && !source.empty()) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(source.c_str(), target, sizeof(target));
+        record += "\t" + (len < 0 ? std::string("?") : std::string(target, len));
+    }
+    hasher.update(record + "\n");
+    for (NodeId child : tree.children(node)) {
+        hash_node(tree, child, path + "/" + tree.name(tree.node(child)), hasher);
+    }
+}
+
+// Mounts at or below `partition`, without the ids and device numbers that
+// change from boot to boot
+void hash_partition_mounts(const std::string& partition, const std::vector<std::string>& mountinfo,
+                           Sha256& hasher) {
+    for (const auto& line : mountinfo) {
+        std::istringstream iss(line);
+        std::string id, parent, dev, root, mount_point, options;
+        iss >> id >> parent >> dev >> root >> mount_point >> options;
+        if (mount_point != partition && mount_point.compare(0, partition.size() + 1,
+                                                            partition + "/") != 0) {
+            continue;
+        }
+
+        size_t sep = line.find(" - ");
+        std::string tail = sep == std::string::npos ? "" : line.substr(sep + 3);
+        hasher.update("mount:" + root + " " + mount_point + " " + options + " " + tail + "\n");
+    }
+}
+
+// Contents rather than size and mtime: OTA images are built with fixed
+// timestamps, and the fingerprint line alone can change without a resize
+void hash_build_props(const std::string& partition, Sha256& hasher) {
+    for (const char* name : {"/build.prop", "/etc/build.prop"}) {
+        std::string path = partition + name;
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            continue;
+        }
+        hasher.update(path + "\n");
+        char buf[4096];
+        while (file.read(buf, sizeof(buf)) || file.gcount() > 0) {
+            hasher.update(buf, static_cast<size_t>(file.gcount()));
+        }
+    }
+}
+
+bool storable(const std::string& s) {
+    return s.find_first_of("\t\n") == std::string::npos;
+}
+
+}  // namespace
+
+bool MagicProgram::has_errors() const {
+    return count(MountOpKind::Fail) > 0;
+}
+
+size_t MagicProgram::count(MountOpKind kind) const {
+    return std::count_if(ops.begin(), ops.end(),
+                         [kind](const MountOp& op) { return op.kind == kind; });
+}
+
+void sort_program(MagicProgram& program) {
+    auto& ops = program.ops;
+    std::stable_sort(ops.begin(), ops.end(), [](const MountOp& a, const MountOp& b) {
+        if (tree_rank(a) != tree_rank(b))
+            return tree_rank(a) < tree_rank(b);
+        if (phase(a.kind) != phase(b.kind))
+            return phase(a.kind) < phase(b.kind);
+        int cmp = compare_paths(a.target, b.target);
+        if (cmp != 0)
+            return cmp < 0;
+        return a.kind < b.kind;
+    });
+
+    // The first op compiled for a target wins
+    ops.erase(std::unique(ops.begin(), ops.end(),
+                          [](const MountOp& a, const MountOp& b) {
+                              return a.tree == b.tree && a.kind == b.kind && a.target == b.target;
+                          }),
+              ops.end());
+}
+
+std::string describe_program(const MagicProgram& program) {
+    std::ostringstream out;
+    for (const auto& op : program.ops) {
+        std::string where = op.target;
+        if (op.tree != NO_TREE && op.kind != MountOpKind::OpenTree &&
+            op.kind != MountOpKind::Finalize) {
+            where = "#" + std::to_string(op.tree) + "/" + op.target;
+        } else if (op.tree != NO_TREE) {
+            where = "#" + std::to_string(op.tree) + " " + op.target;
+        }
+
+        out << std::left << std::setw(11) << kind_name(op.kind) << where;
+        if (!op.source.empty()) {
+            out << (op.kind == MountOpKind::Fail ? ": " : " <- ") << op.source;
+        }
+        if (op.flags & OP_MIRROR) {
+            out << " (mirror)";
+        }
+        out << "\n";
+    }
+    out << program.ops.size() << " ops, " << program.trees << " trees, "
+        << program.count(MountOpKind::Bind) + program.count(MountOpKind::BindDir) << " binds, "
+        << program.count(MountOpKind::CloneAttr) << " attribute clones\n";
+    return out.str();
+}
+
+std::string program_cache_key(const MagicTree& tree) {
+    Sha256 hasher;
+    hasher.update(std::string(PROGRAM_MAGIC) + " " + std::to_string(PROGRAM_VERSION) + "\n");
+    hash_node(tree, tree.root(), "", hasher);
+
+    std::vector<std::string> mountinfo;
+    std::ifstream file("/proc/self/mountinfo");
+    for (std::string line; std::getline(file, line);) {
+        mountinfo.push_back(std::move(line));
+    }
+    if (mountinfo.empty()) {
+        return "";
+    }
+
+    for (NodeId id : tree.children(tree.node(tree.root()))) {
+        std::string partition = "/" + tree.name(tree.node(id));
+        hash_partition_mounts(partition, mountinfo, hasher);
+        hash_build_props(partition, hasher);
+    }
+    return hasher.hex_digest();
+}
+
+bool load_program(const fs::path& path, const std::string& key, MagicProgram& program) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string magic, version, file_key;
+    if (!(file >> magic >> version >> file_key) || magic != PROGRAM_MAGIC ||
+        version != std::to_string(PROGRAM_VERSION) || file_key != key) {
+        return false;
+    }
+
+    MagicProgram loaded;
+    std::string trees_label, dirs_label;
+    if (!(file >> trees_label >> loaded.trees >> dirs_label >> loaded.dirs) ||
+        trees_label != "trees" || dirs_label != "dirs") {
+        return false;
+    }
+    file.ignore(1);
+
+    for (std::string line; std::getline(file, line);) {
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (size_t tab; (tab = line.find('\t', start)) != std::string::npos; start = tab + 1) {
+            fields.push_back(line.substr(start, tab - start));
+        }
+        fields.push_back(line.substr(start));
+
+        MountOp op;
+        if (fields.size() != 5 || !parse_kind(fields[0], op.kind)) {
+            LOG_WARN("Ignoring malformed magic mount program: " + path.string());
+            return false;
+        }
+        try {
+            op.flags = static_cast<uint8_t>(std::stoi(fields[1]));
+            op.tree = fields[2] == "-" ? NO_TREE : static_cast<uint32_t>(std::stoul(fields[2]));
+        } catch (...) {
+            LOG_WARN("Ignoring malformed magic mount program: " + path.string());
+            return false;
+        }
+        if (op.tree != NO_TREE && op.tree >= loaded.trees) {
+            LOG_WARN("Ignoring malformed magic mount program: " + path.string());
+            return false;
+        }
+        op.target = std::move(fields[3]);
+        op.source = std::move(fields[4]);
+        loaded.ops.push_back(std::move(op));
+    }
+
+    program = std::move(loaded);
+    return true;
+}
+
+bool save_program(const fs::path& path, const std::string& key, const MagicProgram& program) {
+    for (const auto& op : program.ops) {
+        if (!storable(op.target) || !storable(op.source)) {
+            return false;
+        }
+    }
+
+    fs::path tmp = path.string() + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        if (!file.is_open()) {
+            return false;
+        }
+        file << PROGRAM_MAGIC << " " << PROGRAM_VERSION << " " << key << "\n"
+             << "trees " << program.trees << " dirs " << program.dirs << "\n";
+        for (const auto& op : program.ops) {
+            file << kind_name(op.kind) << "\t" << static_cast<int>(op.flags) << "\t"
+                 << (op.tree == NO_TREE ? "-" : std::to_string(op.tree)) << "\t" << op.target
+                 << "\t" << op.source << "\n";
+        }
+        if (!file.good()) {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+}  // namespace hymo
@@ -0,0 +1,69 @@
+// mount/magic_program.hpp - Flat mount-operation program for magic mount
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "magic_tree.hpp"
+
+namespace fs = std::filesystem;
+
+namespace hymo {
+
+enum class MountOpKind : uint8_t {
+    OpenTree,   // new tmpfs tree that will replace `target` (absolute)
+    Mkdir,      // directory in a tree
+    Whiteout,   // 0:0 char device in a tree
+    Symlink,    // symlink with link text `source` in a tree
+    Bind,       // bind `source` onto a file, created first when it is in a tree
+    BindDir,    // recursive bind of the directory `source`, mount point created first
+    CloneAttr,  // attributes of `source` onto `target`; empty source copies the parent's label
+    Finalize,   // make a tree read-only and move it over `target` (absolute)
+    Fail,       // compile-time error `source` about `target`, fails the op's tree
+};
+
+constexpr uint32_t NO_TREE = UINT32_MAX;
+
+// Op flags
+constexpr uint8_t OP_MODULE = 1 << 0;  // module content (mount stats), not mirrored stock
+constexpr uint8_t OP_MIRROR = 1 << 1;  // re-exposes an untouched stock entry
+
+// Targets of tree ops are relative to the tree root ("" is the root itself);
+// ops outside any tree (`tree` == NO_TREE) act on the live path in `target`.
+struct MountOp {
+    MountOpKind kind;
+    uint8_t flags = 0;
+    uint32_t tree = NO_TREE;
+    std::string target;
+    std::string source;
+};
+
+struct MagicProgram {
+    std::vector<MountOp> ops;
+    uint32_t trees = 0;
+    int dirs = 0;  // directory nodes visited while compiling
+
+    bool has_errors() const;
+    size_t count(MountOpKind kind) const;
+};
+
+// Orders ops for execution and drops duplicates. Each tree runs as one block:
+// OpenTree, its content ops by path (parents before children), its attribute
+// clones by path, then Finalize. Live binds come first.
+void sort_program(MagicProgram& program);
+
+// Dry-run listing, one op per line
+std::string describe_program(const MagicProgram& program);
+
+// Cache key for the program compiled from `tree`: the tree itself plus the
+// mount table and build.prop of every partition the tree touches, since the
+// program also depends on what the stock directories look like
+std::string program_cache_key(const MagicTree& tree);
+
+// Cached program for `key`; false when missing, stale or unreadable
+bool load_program(const fs::path& path, const std::string& key, MagicProgram& program);
+// False (and nothing written) if a path can't be stored in the line format
+bool save_program(const fs::path& path, const std::string& key, const MagicProgram& program);
+
+}  // namespace hymo
@@ -0,0 +1,180 @@
+// mount/magic_tree.cpp - Arena-backed node tree for magic mount
+#include "magic_tree.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace hymo {
+
+namespace {
+
+constexpr size_t STRING_BLOCK_SIZE = 64 * 1024;
+
+// Rough per-entry cost of a node-based hash map: node, cached hash and bucket
+template <typename Map>
+size_t hash_map_bytes(const Map& map) {
+    return map.bucket_count() * sizeof(void*) +
+           map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*));
+}
+
+}  // namespace
+
+MagicTree::MagicTree() {
+    nodes_.emplace_back();
+    nodes_[0].name = intern("");
+}
+
+uint16_t MagicTree::add_module(const std::string& id) {
+    if (modules_.size() >= NO_MODULE)
+        return NO_MODULE;
+    modules_.push_back(id);
+    return static_cast<uint16_t>(modules_.size() - 1);
+}
+
+const std::string& MagicTree::module_name(uint16_t module) const {
+    static const std::string none;
+    return module < modules_.size() ? modules_[module] : none;
+}
+
+StrId MagicTree::intern(std::string_view s) {
+    auto it = string_ids_.find(s);
+    if (it != string_ids_.end())
+        return it->second;
+
+    char* dst;
+    if (s.size() > STRING_BLOCK_SIZE / 4) {
+        // Long strings get their own block so they don't waste the current one
+        blocks_.emplace_back(new char[s.size()]);
+        dst = blocks_.back().get();
+        pool_bytes_ += s.size();
+    } else {
+        if (s.size() > block_left_) {
+            blocks_.emplace_back(new char[STRING_BLOCK_SIZE]);
+            block_ = blocks_.back().get();
+            block_left_ = STRING_BLOCK_SIZE;
+            pool_bytes_ += STRING_BLOCK_SIZE;
+        }
+        dst = block_;
+        block_ += s.size();
+        block_left_ -= s.size();
+    }
+    if (!s.empty())
+        memcpy(dst, s.data(), s.size());
+
+    StrId id = static_cast<StrId>(strings_.size());
+    strings_.emplace_back(dst, s.size());
+    string_ids_.emplace(strings_.back(), id);
+    return id;
+}
+
+fs::path MagicTree::source_path(const Node& node) const {
+    if (node.source_dir == NO_STR)
+        return {};
+    fs::path path(std::string(str(node.source_dir)));
+    return path / std::string(str(node.name));
+}
+
+NodeId MagicTree::find(NodeId parent, std::string_view name) const {
+    auto sid = string_ids_.find(name);
+    if (sid == string_ids_.end())
+        return NO_NODE;
+    auto it = lookup_.find(key(parent, sid->second));
+    return it == lookup_.end() ? NO_NODE : it->second;
+}
+
+NodeId MagicTree::add_child(NodeId parent, std::string_view name, NodeFileType type,
+                            StrId source_dir, uint16_t module) {
+    StrId name_id = intern(name);
+    NodeId id = static_cast<NodeId>(nodes_.size());
+
+    Node node;
+    node.name = name_id;
+    node.source_dir = source_dir;
+    node.parent = parent;
+    node.module = module;
+    node.file_type = type;
+    nodes_.push_back(node);
+
+    lookup_[key(parent, name_id)] = id;
+    return id;
+}
+
+void MagicTree::move(NodeId id, NodeId new_parent) {
+    Node& node = nodes_[id];
+    lookup_.erase(key(node.parent, node.name));
+    node.parent = new_parent;
+    lookup_[key(new_parent, node.name)] = id;
+}
+
+void MagicTree::freeze() {
+    if (frozen_)
+        return;
+
+    // Only nodes still reachable through the lookup table are children
+    std::vector<uint32_t> counts(nodes_.size() + 1, 0);
+    for (const auto& [k, id] : lookup_)
+        counts[nodes_[id].parent]++;
+
+    uint32_t offset = 0;
+    for (size_t i = 0; i < nodes_.size(); i++) {
+        nodes_[i].first_child = offset;
+        nodes_[i].child_count = 0;
+        offset += counts[i];
+    }
+
+    child_index_.assign(offset, NO_NODE);
+    for (const auto& [k, id] : lookup_) {
+        Node& parent = nodes_[nodes_[id].parent];
+        child_index_[parent.first_child + parent.child_count++] = id;
+    }
+
+    for (const Node& node : nodes_) {
+        auto first = child_index_.begin() + node.first_child;
+        std::sort(first, first + node.child_count, [this](NodeId a, NodeId b) {
+            return str(nodes_[a].name) < str(nodes_[b].name);
+        });
+    }
+
+    build_bytes_ = memory_bytes();
+
+    decltype(lookup_)().swap(lookup_);
+    decltype(string_ids_)().swap(string_ids_);
+    nodes_.shrink_to_fit();
+    strings_.shrink_to_fit();
+    frozen_ = true;
+}
+
+MagicTree::Children MagicTree::children(const Node& node) const {
+    const NodeId* first = child_index_.data() + node.first_child;
+    return {first, first + node.child_count};
+}
+
+const Node* MagicTree::find_child(const Node& node, std::string_view name) const {
+    Children span = children(node);
+    auto it = std::lower_bound(
+        span.begin(), span.end(), name,
+        [this](NodeId id, std::string_view n) { return str(nodes_[id].name) < n; });
+    if (it == span.end() || str(nodes_[*it].name) != name)
+        return nullptr;
+    return &nodes_[*it];
+}
+
+size_t MagicTree::memory_bytes() const {
+    size_t bytes = nodes_.capacity() * sizeof(Node) + child_index_.capacity() * sizeof(NodeId) +
+                   strings_.capacity() * sizeof(std::string_view) + pool_bytes_ +
+                   hash_map_bytes(string_ids_) + hash_map_bytes(lookup_);
+    for (const auto& module : modules_)
+        bytes += sizeof(std::string) + module.capacity();
+    return bytes;
+}
+
+MagicTreeStats MagicTree::stats() const {
+    MagicTreeStats stats;
+    stats.nodes = nodes_.size();
+    stats.strings = strings_.size();
+    stats.modules = modules_.size();
+    stats.bytes = memory_bytes();
+    stats.build_bytes = std::max(build_bytes_, stats.bytes);
+    return stats;
+}
+
+}  // namespace hymo
@@ -0,0 +1,112 @@
+// mount/magic_tree.hpp - Arena-backed node tree for magic mount
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace hymo {
+
+enum class NodeFileType : uint8_t { RegularFile, Directory, Symlink, Whiteout };
+
+using NodeId = uint32_t;
+using StrId = uint32_t;
+
+constexpr NodeId NO_NODE = UINT32_MAX;
+constexpr StrId NO_STR = UINT32_MAX;
+constexpr uint16_t NO_MODULE = UINT16_MAX;
+
+// Nodes hold indexes only: names and source dirs are interned in the tree's
+// string pool and the owning module is an index into its module table.
+struct Node {
+    StrId name = NO_STR;
+    StrId source_dir = NO_STR;  // dir holding the source entry, NO_STR when there is none
+    NodeId parent = NO_NODE;
+    uint32_t first_child = 0;  // span in the sorted child index, valid once frozen
+    uint32_t child_count = 0;
+    uint16_t module = NO_MODULE;
+    NodeFileType file_type = NodeFileType::Directory;
+    bool replace = false;       // Directory marked for replacement (xattr/file)
+    bool skip = false;          // Skip mounting this node
+    bool shared = false;        // Directory more than one module contributed to
+    bool module_owned = false;  // Whole subtree comes from this node's module alone
+};
+
+struct MagicTreeStats {
+    size_t nodes = 0;
+    size_t strings = 0;
+    size_t modules = 0;
+    size_t build_bytes = 0;  // peak, with the build-time lookup tables
+    size_t bytes = 0;        // once frozen
+};
+
+// Append-only tree: nodes live in one vector and are addressed by NodeId, so
+// moving a subtree is a parent change rather than a copy. Children are looked
+// up through a hash while building; freeze() turns them into name-sorted spans
+// searched by binary search and drops the build-time tables.
+class MagicTree {
+public:
+    MagicTree();
+
+    NodeId root() const { return 0; }
+    const Node& node(NodeId id) const { return nodes_[id]; }
+    Node& node(NodeId id) { return nodes_[id]; }
+
+    uint16_t add_module(const std::string& id);
+    const std::string& module_name(uint16_t module) const;
+
+    StrId intern(std::string_view s);
+    std::string_view str(StrId id) const { return strings_[id]; }
+    std::string name(const Node& node) const { return std::string(str(node.name)); }
+
+    // Source path of the node, empty when it has none
+    fs::path source_path(const Node& node) const;
+
+    // Build phase
+    NodeId find(NodeId parent, std::string_view name) const;
+    NodeId add_child(NodeId parent, std::string_view name, NodeFileType type, StrId source_dir,
+                     uint16_t module);
+    void move(NodeId id, NodeId new_parent);
+    void freeze();
+
+    // After freeze()
+    struct Children {
+        const NodeId* first;
+        const NodeId* last;
+        const NodeId* begin() const { return first; }
+        const NodeId* end() const { return last; }
+        bool empty() const { return first == last; }
+    };
+    Children children(const Node& node) const;
+    const Node* find_child(const Node& node, std::string_view name) const;
+
+    MagicTreeStats stats() const;
+
+private:
+    static uint64_t key(NodeId parent, StrId name) { return (uint64_t(parent) << 32) | name; }
+    size_t memory_bytes() const;
+
+    std::vector<Node> nodes_;
+    std::vector<NodeId> child_index_;
+    std::vector<std::string> modules_;
+
+    // Interned strings are stored in fixed blocks so views stay valid as the pool grows
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* block_ = nullptr;
+    size_t block_left_ = 0;
+    size_t pool_bytes_ = 0;
+    std::vector<std::string_view> strings_;
+    std::unordered_map<std::string_view, StrId> string_ids_;
+    std::unordered_map<uint64_t, NodeId> lookup_;
+
+    size_t build_bytes_ = 0;
+    bool frozen_ = false;
+};
+
+}  // namespace hymo
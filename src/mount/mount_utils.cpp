@@ -25,87 +25,180 @@
 #define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
 #endif // #ifndef MOVE_MOUNT_F_EMPTY_PATH
 
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif // #ifndef __NR_mount_setattr
+
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#endif // #ifndef MOUNT_ATTR_RDONLY
+
 namespace hymo {
 
-bool clone_attr(const fs::path& source, const fs::path& target) {
-    struct stat st;
-    if (lstat(source.c_str(), &st) != 0) {
-        LOG_ERROR("Failed to stat source: " + source.string() + " - " + strerror(errno));
-        return false;
+namespace {
+
+constexpr size_t XATTR_BUFFER_SIZE = 256;
+
+bool same_time(const struct timespec& a, const struct timespec& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+}  // namespace
+
+AttrCloner::AttrCloner()
+    : names_(XATTR_BUFFER_SIZE), value_(XATTR_BUFFER_SIZE), current_(XATTR_BUFFER_SIZE) {}
+
+AttrCloner::~AttrCloner() {
+    for (CachedDir* dir : {&source_dir_, &target_dir_}) {
+        if (dir->fd >= 0) {
+            close(dir->fd);
+        }
     }
+}
 
-    // Set owner and group
-    if (lchown(target.c_str(), st.st_uid, st.st_gid) != 0) {
-        LOG_WARN("Failed to chown " + target.string() + ": " + strerror(errno));
+int AttrCloner::open_parent(CachedDir& dir, const fs::path& path, std::string& name) {
+    name = path.filename().string();
+    if (name.empty()) {
+        name = ".";
     }
 
-    // Set permissions (for non-symlinks)
-    if (!S_ISLNK(st.st_mode)) {
-        if (chmod(target.c_str(), st.st_mode & 07777) != 0) {
-            LOG_WARN("Failed to chmod " + target.string() + ": " + strerror(errno));
-        }
+    std::string parent = path.parent_path().string();
+    if (dir.fd >= 0 && dir.path == parent) {
+        return dir.fd;
     }
 
-    // Set timestamps
-    struct timespec times[2];
-    times[0] = st.st_atim;  // access time
-    times[1] = st.st_mtim;  // modification time
+    if (dir.fd >= 0) {
+        syscalls_++;
+        close(dir.fd);
+    }
+    syscalls_++;
+    dir.fd = open(parent.empty() ? "." : parent.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    dir.path = parent;
+    // xattr calls have no *at() form; this path reaches the entry through the fd
+    dir.proc_path = "/proc/self/fd/" + std::to_string(dir.fd) + "/";
+    return dir.fd;
+}
+
+ssize_t AttrCloner::get_xattr(const char* path, const char* name, std::vector<char>& buf) {
+    while (true) {
+        syscalls_++;
+        ssize_t len = lgetxattr(path, name, buf.data(), buf.size());
+        if (len >= 0 || errno != ERANGE) {
+            return len;
+        }
+        syscalls_++;
+        len = lgetxattr(path, name, nullptr, 0);
+        if (len < 0) {
+            return len;
+        }
+        buf.resize(static_cast<size_t>(len));
+    }
+}
 
-    if (utimensat(AT_FDCWD, target.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
-        LOG_WARN("Failed to set times on " + target.string() + ": " + strerror(errno));
+ssize_t AttrCloner::list_xattrs(const char* path) {
+    while (true) {
+        syscalls_++;
+        ssize_t len = llistxattr(path, names_.data(), names_.size());
+        if (len >= 0 || errno != ERANGE) {
+            return len;
+        }
+        syscalls_++;
+        len = llistxattr(path, nullptr, 0);
+        if (len < 0) {
+            return len;
+        }
+        names_.resize(static_cast<size_t>(len));
     }
+}
 
-#ifdef __ANDROID__
-    // Copy SELinux context only if source has one
-    ssize_t sel_len = lgetxattr(source.c_str(), SELINUX_XATTR, nullptr, 0);
-    if (sel_len > 0) {
-        std::string context;
-        context.resize(static_cast<size_t>(sel_len));
-        if (lgetxattr(source.c_str(), SELINUX_XATTR, context.data(), sel_len) > 0) {
-            if (!lsetfilecon(target, context)) {
-                LOG_WARN("Failed to set SELinux context on " + target.string() + ": " +
-                         strerror(errno));
-            }
-        } else {
-            LOG_WARN("Failed to read SELinux context from " + source.string() + ": " +
+void AttrCloner::copy_xattrs(const std::string& src_path, const std::string& dst_path,
+                             const fs::path& target) {
+    ssize_t list_size = list_xattrs(src_path.c_str());
+    for (ssize_t off = 0; off < list_size;) {
+        const char* name = names_.data() + off;
+        off += strlen(name) + 1;
+
+#ifndef __ANDROID__
+        if (strcmp(name, SELINUX_XATTR) == 0) {
+            continue;
+        }
+#endif // #ifndef __ANDROID__
+
+        ssize_t len = get_xattr(src_path.c_str(), name, value_);
+        if (len <= 0) {
+            continue;
+        }
+
+        // Only write what differs; tmpfs labels and the like are often right already
+        ssize_t cur = get_xattr(dst_path.c_str(), name, current_);
+        if (cur == len && memcmp(current_.data(), value_.data(), len) == 0) {
+            continue;
+        }
+
+        syscalls_++;
+        if (lsetxattr(dst_path.c_str(), name, value_.data(), len, 0) != 0) {
+            LOG_WARN("Failed to set xattr " + std::string(name) + " on " + target.string() + ": " +
                      strerror(errno));
         }
     }
-#endif // #ifdef __ANDROID__
-
-    // Copy extended attributes (except security.selinux which we already copied)
-    char* list = nullptr;
-    ssize_t list_size = llistxattr(source.c_str(), nullptr, 0);
-
-    if (list_size > 0) {
-        list = new char[list_size];
-        if (llistxattr(source.c_str(), list, list_size) > 0) {
-            for (char* name = list; name < list + list_size; name += strlen(name) + 1) {
-                // Skip security.selinux as we already copied it with lgetfilecon
-                if (strcmp(name, "security.selinux") == 0) {
-                    continue;
-                }
+}
 
-                // Get xattr value
-                ssize_t val_size = lgetxattr(source.c_str(), name, nullptr, 0);
-                if (val_size > 0) {
-                    char* value = new char[val_size];
-                    if (lgetxattr(source.c_str(), name, value, val_size) > 0) {
-                        if (lsetxattr(target.c_str(), name, value, val_size, 0) != 0) {
-                            LOG_WARN("Failed to set xattr " + std::string(name) + " on " +
-                                     target.string() + ": " + strerror(errno));
-                        }
-                    }
-                    delete[] value;
-                }
-            }
+bool AttrCloner::clone(const fs::path& source, const fs::path& target) {
+    std::string src_name;
+    std::string dst_name;
+    int src_dir = open_parent(source_dir_, source, src_name);
+    int dst_dir = open_parent(target_dir_, target, dst_name);
+
+    struct stat st;
+    struct stat cur;
+    syscalls_++;
+    if (src_dir < 0 || fstatat(src_dir, src_name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        LOG_ERROR("Failed to stat source: " + source.string() + " - " + strerror(errno));
+        return false;
+    }
+    syscalls_++;
+    if (dst_dir < 0 || fstatat(dst_dir, dst_name.c_str(), &cur, AT_SYMLINK_NOFOLLOW) != 0) {
+        LOG_WARN("Failed to stat " + target.string() + ": " + strerror(errno));
+        return false;
+    }
+
+    // Set owner and group; a chown can drop setuid bits, so the mode follows
+    bool chowned = false;
+    if (st.st_uid != cur.st_uid || st.st_gid != cur.st_gid) {
+        syscalls_++;
+        chowned = true;
+        if (fchownat(dst_dir, dst_name.c_str(), st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0) {
+            LOG_WARN("Failed to chown " + target.string() + ": " + strerror(errno));
+        }
+    }
+
+    // Set permissions (for non-symlinks)
+    if (!S_ISLNK(st.st_mode) && (chowned || (st.st_mode & 07777) != (cur.st_mode & 07777))) {
+        syscalls_++;
+        if (fchmodat(dst_dir, dst_name.c_str(), st.st_mode & 07777, 0) != 0) {
+            LOG_WARN("Failed to chmod " + target.string() + ": " + strerror(errno));
+        }
+    }
+
+    copy_xattrs(source_dir_.proc_path + src_name, target_dir_.proc_path + dst_name, target);
+
+    // Set timestamps last, nothing after this touches the target
+    if (!same_time(st.st_atim, cur.st_atim) || !same_time(st.st_mtim, cur.st_mtim)) {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        syscalls_++;
+        if (utimensat(dst_dir, dst_name.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0) {
+            LOG_WARN("Failed to set times on " + target.string() + ": " + strerror(errno));
         }
-        delete[] list;
     }
 
     return true;
 }
 
+bool clone_attr(const fs::path& source, const fs::path& target) {
+    AttrCloner cloner;
+    return cloner.clone(source, target);
+}
+
 // Modern mount using open_tree + move_mount
 static bool try_modern_bind_mount(const fs::path& source, const fs::path& target, bool recursive) {
 #ifdef __NR_open_tree
@@ -150,6 +243,62 @@ bool mount_bind_modern(const fs::path& source, const fs::path& target, bool recu
     return false;
 }
 
+struct MountAttr {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+};
+
+static int mount_setattr_rdonly(int dfd, const char* path, unsigned int flags) {
+    MountAttr attr = {};
+    attr.attr_set = MOUNT_ATTR_RDONLY;
+    return syscall(__NR_mount_setattr, dfd, path, flags, &attr, sizeof(attr));
+}
+
+bool mount_setattr_supported() {
+    // An invalid fd tells EBADF apart from ENOSYS without touching any mount
+    static const bool supported = mount_setattr_rdonly(-1, "", AT_EMPTY_PATH) == 0 ||
+                                  errno != ENOSYS;
+    return supported;
+}
+
+bool mount_set_readonly(int dfd, const char* path, bool recursive) {
+    if (!mount_setattr_supported()) {
+        return false;
+    }
+    unsigned int flags = path[0] == '\0' ? AT_EMPTY_PATH : 0;
+    if (recursive) {
+        flags |= AT_RECURSIVE;
+    }
+    return mount_setattr_rdonly(dfd, path, flags) == 0;
+}
+
+bool mount_bind_readonly(const fs::path& source, const fs::path& target) {
+#ifdef __NR_open_tree
+    if (mount_setattr_supported()) {
+        int tree_fd = syscall(__NR_open_tree, AT_FDCWD, source.c_str(),
+                              OPEN_TREE_CLONE | O_CLOEXEC | AT_EMPTY_PATH);
+        if (tree_fd >= 0) {
+            // Read-only before it is attached, so no remount is needed afterwards
+            bool ok = mount_set_readonly(tree_fd, "", false) &&
+                      syscall(__NR_move_mount, tree_fd, "", AT_FDCWD, target.c_str(),
+                              MOVE_MOUNT_F_EMPTY_PATH) == 0;
+            close(tree_fd);
+            if (ok) {
+                return true;
+            }
+        }
+    }
+#endif // #ifdef __NR_open_tree
+
+    if (!mount_bind_modern(source, target, false)) {
+        return false;
+    }
+    mount(nullptr, target.c_str(), nullptr, MS_REMOUNT | MS_RDONLY | MS_BIND, nullptr);
+    return true;
+}
+
 bool mount_with_retry(const char* source, const char* target, const char* filesystemtype,
                       unsigned long mountflags, const void* data, int max_retries) {
     for (int attempt = 0; attempt < max_retries; ++attempt) {
@@ -174,6 +323,24 @@ bool mount_with_retry(const char* source, const char* target, const char* filesy
     return false;
 }
 
+size_t count_mounts() {
+    int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    size_t lines = 0;
+    char buf[16384];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            lines += buf[i] == '\n';
+        }
+    }
+    close(fd);
+    return lines;
+}
+
 bool is_safe_path(const fs::path& base, const fs::path& target) {
     try {
         auto canonical_base = fs::canonical(base);
@@ -7,8 +7,10 @@
 #include <sys/sysmacros.h>
 #include <sys/xattr.h>
 #include <unistd.h>
+#include <cstdint>
 #include <filesystem>
 #include <string>
+#include <vector>
 #include "../defs.hpp"
 
 namespace fs = std::filesystem;
@@ -19,15 +21,66 @@ namespace hymo {
 // Includes: owner, permissions, timestamps, SELinux context, xattrs
 bool clone_attr(const fs::path& source, const fs::path& target);
 
+// clone_attr() for many targets in a row. Entries are reached through cached
+// O_PATH fds of their parent dirs, so clones from the same source directory
+// share one lookup of it. Buffers are reused across calls and attributes the
+// target already has are not written again.
+class AttrCloner {
+public:
+    AttrCloner();
+    AttrCloner(const AttrCloner&) = delete;
+    AttrCloner& operator=(const AttrCloner&) = delete;
+    ~AttrCloner();
+
+    bool clone(const fs::path& source, const fs::path& target);
+
+    // Syscalls made so far, for the debug stats
+    uint64_t syscalls() const { return syscalls_; }
+
+private:
+    struct CachedDir {
+        std::string path;
+        std::string proc_path;  // "/proc/self/fd/N/"
+        int fd = -1;
+    };
+
+    int open_parent(CachedDir& dir, const fs::path& path, std::string& name);
+    ssize_t get_xattr(const char* path, const char* name, std::vector<char>& buf);
+    ssize_t list_xattrs(const char* path);
+    void copy_xattrs(const std::string& src_path, const std::string& dst_path,
+                     const fs::path& target);
+
+    CachedDir source_dir_;
+    CachedDir target_dir_;
+    std::vector<char> names_;
+    std::vector<char> value_;
+    std::vector<char> current_;
+    uint64_t syscalls_ = 0;
+};
+
 // Modern mount using open_tree + move_mount (kernel 5.2+)
 // Falls back to traditional mount on failure
 // Note: This function does NOT log - caller should log appropriately
 bool mount_bind_modern(const fs::path& source, const fs::path& target, bool recursive = true);
 
+// mount_setattr() is available (kernel 5.12+)
+bool mount_setattr_supported();
+
+// Makes the mount at dfd/path read-only, the whole tree below it with `recursive`;
+// an empty path means dfd itself. False when mount_setattr() is unavailable.
+bool mount_set_readonly(int dfd, const char* path, bool recursive);
+
+// Read-only bind: the clone is made read-only while still detached, falling back
+// to bind + MS_REMOUNT on older kernels
+bool mount_bind_readonly(const fs::path& source, const fs::path& target);
+
 // Mount with automatic retry and fallback
 bool mount_with_retry(const char* source, const char* target, const char* filesystemtype,
                       unsigned long mountflags, const void* data, int max_retries = 3);
 
+// Number of mounts in this namespace (lines of /proc/self/mountinfo)
+size_t count_mounts();
+
 // Check if path is safe (within allowed base directory)
 bool is_safe_path(const fs::path& base, const fs::path& target);
 
@@ -155,7 +155,7 @@ size_t get_optimal_tmpfs_size(const fs::path& partition_path) {
     // - Use at most 10% of available memory
     // - Use at most 512MB
     // - If partition exists, use at most 25% of partition size
-    size_t max_from_memory = info.freeram / 10;
+    size_t max_from_memory = static_cast<size_t>(info.freeram) * info.mem_unit / 10;
     size_t absolute_max = 512 * 1024 * 1024;  // 512MB
 
     size_t optimal = std::min(max_from_memory, absolute_max);
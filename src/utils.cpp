@@ -1,22 +1,31 @@
 // utils.cpp - Utility functions implementation
 #include "utils.hpp"
+#include <dirent.h>
 #include <fcntl.h>
 #include <linux/loop.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
 #include <sys/xattr.h>
 #include <unistd.h>
+#include <cctype>
+#include <climits>
 #include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <vector>
+#include "core/file_contexts.hpp"
+#include "core/uring.hpp"
 #include "defs.hpp"
 
 extern char** environ;
@@ -57,11 +66,13 @@ void Logger::log(const std::string& level, const std::string& message) {
         return;
 
     auto now = std::time(nullptr);
+    struct tm tm_buf;
     char time_buf[64];
-    std::strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", std::localtime(&now));
+    std::strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm_buf));
 
     std::string log_line = std::string("[") + time_buf + "] [" + level + "] " + message + "\n";
 
+    std::lock_guard<std::mutex> lock(mutex_);
     std::cerr << log_line;
     std::cerr.flush();
     if (log_file_ && log_file_->is_open()) {
@@ -104,6 +115,27 @@ std::string lgetfilecon(const fs::path& path) {
     return DEFAULT_SELINUX_CONTEXT;
 }
 
+bool fsetfilecon(int fd, const std::string& context) {
+#ifdef __ANDROID__
+    if (fsetxattr(fd, SELINUX_XATTR, context.c_str(), context.length(), 0) == 0) {
+        return true;
+    }
+    LOG_DEBUG("fsetfilecon failed for fd " + std::to_string(fd) + ": " + strerror(errno));
+#endif // #ifdef __ANDROID__
+    return false;
+}
+
+std::string fgetfilecon(int fd) {
+#ifdef __ANDROID__
+    char buf[256];
+    ssize_t len = fgetxattr(fd, SELINUX_XATTR, buf, sizeof(buf));
+    if (len > 0) {
+        return std::string(buf, len);
+    }
+#endif // #ifdef __ANDROID__
+    return DEFAULT_SELINUX_CONTEXT;
+}
+
 // Get appropriate SELinux context based on path
 // /vendor and /odm paths should use vendor_file context
 std::string get_context_for_path(const fs::path& path) {
@@ -143,13 +175,17 @@ bool is_xattr_supported(const fs::path& path) {
     }
 }
 
-bool mount_tmpfs(const fs::path& target, const char* source) {
+bool mount_tmpfs(const fs::path& target, const char* source, uint64_t size) {
     if (!ensure_dir_exists(target)) {
         return false;
     }
 
     const char* src = (source && *source) ? source : OVERLAY_SOURCE;
-    if (mount(src, target.c_str(), "tmpfs", 0, "mode=0755") != 0) {
+    std::string data = "mode=0755";
+    if (size > 0) {
+        data += ",size=" + std::to_string(size);
+    }
+    if (mount(src, target.c_str(), "tmpfs", 0, data.c_str()) != 0) {
         LOG_ERROR("Failed to mount tmpfs at " + target.string() + ": " + strerror(errno));
         return false;
     }
@@ -157,22 +193,50 @@ bool mount_tmpfs(const fs::path& target, const char* source) {
     return true;
 }
 
-bool has_files_recursive(const fs::path& path) {
-    if (!fs::exists(path) || !fs::is_directory(path)) {
-        return false;
+// True if the tree below `dir_fd` holds any file or symlink. Takes ownership of `dir_fd`.
+static bool has_files_at(int dir_fd) {
+    DIR* dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        return true;
     }
 
-    try {
-        for (const auto& entry : fs::recursive_directory_iterator(path)) {
-            if (fs::is_regular_file(entry) || fs::is_symlink(entry)) {
-                return true;
+    bool found = false;
+    struct dirent* entry;
+    while (!found && (entry = readdir(dir)) != nullptr) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                found = true;
+                break;
             }
+            type = IFTODT(st.st_mode);
+        }
+
+        if (type == DT_REG || type == DT_LNK) {
+            found = true;
+        } else if (type == DT_DIR) {
+            int child = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            // Unreadable subtrees count as non-empty, as before
+            found = child < 0 || has_files_at(child);
         }
-    } catch (...) {
-        return true;
     }
 
-    return false;
+    closedir(dir);
+    return found;
+}
+
+bool has_files_recursive(const fs::path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    return has_files_at(fd);
 }
 
 // Forward declaration for loop device helper
@@ -194,6 +258,81 @@ bool is_erofs_supported() {
 }
 
 // Loop device helpers
+
+// Read-ahead of image loop devices, in 512-byte sectors. Direct I/O skips the
+// backing file's page cache and with it its read-ahead, so the loop device
+// reads ahead instead.
+static constexpr unsigned long LOOP_READ_AHEAD_SECTORS = 1024;  // 512 KiB
+
+// Block size of the filesystem inside an image (EROFS or ext4), used as the loop
+// device's logical block size; 0 if unknown
+static uint32_t image_block_size(int file_fd) {
+    uint8_t sb[64];
+    if (pread(file_fd, sb, sizeof(sb), 1024) != static_cast<ssize_t>(sizeof(sb)))
+        return 0;
+
+    auto le32 = [&sb](size_t off) {
+        return static_cast<uint32_t>(sb[off]) | static_cast<uint32_t>(sb[off + 1]) << 8 |
+               static_cast<uint32_t>(sb[off + 2]) << 16 | static_cast<uint32_t>(sb[off + 3]) << 24;
+    };
+
+    uint32_t size = 0;
+    if (le32(0) == 0xE0F5E1E2) {
+        if (sb[12] < 32)
+            size = 1u << sb[12];  // blkszbits
+    } else if ((sb[56] | sb[57] << 8) == 0xEF53) {
+        if (le32(24) < 22)
+            size = 1024u << le32(24);  // s_log_block_size
+    }
+    // Loop devices take 512 bytes up to the page size
+    return size >= 512 && size <= static_cast<uint32_t>(getpagesize()) ? size : 0;
+}
+
+// Attach `file_fd` to `loop_fd`. LOOP_CONFIGURE (Linux 5.8+) sets up the device in
+// one ioctl with direct I/O, so image reads aren't cached a second time for the
+// backing file; older kernels get the LOOP_SET_FD + LOOP_SET_STATUS64 sequence.
+static bool attach_loop_device(int loop_fd, int file_fd, uint32_t lo_flags, uint32_t block_size) {
+#ifdef LOOP_CONFIGURE
+    struct loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = file_fd;
+    config.block_size = block_size;
+    config.info.lo_flags = lo_flags | LO_FLAGS_DIRECT_IO;
+    if (ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0)
+        return true;
+
+    // Newer kernels refuse direct I/O the backing file can't do
+    config.info.lo_flags = lo_flags;
+    if (ioctl(loop_fd, LOOP_CONFIGURE, &config) == 0)
+        return true;
+    if (errno == EBUSY) {
+        LOG_ERROR("Failed to configure loop device: " + std::string(strerror(errno)));
+        return false;
+    }
+    LOG_DEBUG("LOOP_CONFIGURE unavailable, using LOOP_SET_FD");
+#endif  // #ifdef LOOP_CONFIGURE
+
+    if (ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0) {
+        LOG_ERROR("Failed to bind loop device: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    struct loop_info64 info;
+    memset(&info, 0, sizeof(info));
+    info.lo_flags = lo_flags;
+    if (ioctl(loop_fd, LOOP_SET_STATUS64, &info) < 0) {
+        LOG_ERROR("Failed to set loop status: " + std::string(strerror(errno)));
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+        return false;
+    }
+
+    // Best effort: direct I/O needs the block size to match the backing device
+    if (block_size != 0)
+        ioctl(loop_fd, LOOP_SET_BLOCK_SIZE, static_cast<unsigned long>(block_size));
+    ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1UL);
+    return true;
+}
+
 static int setup_loop_device(const std::string& image_path, std::string& loop_path,
                              bool read_only) {
     int control_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
@@ -237,37 +376,87 @@ static int setup_loop_device(const std::string& image_path, std::string& loop_pa
         return -1;
     }
 
-    int file_fd = open(image_path.c_str(), read_only ? O_RDONLY : O_RDWR | O_CLOEXEC);
+    int file_fd = open(image_path.c_str(), (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
     if (file_fd < 0) {
         LOG_ERROR("Failed to open image " + image_path + ": " + strerror(errno));
         close(loop_fd);
         return -1;
     }
 
-    if (ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0) {
-        LOG_ERROR("Failed to bind loop device: " + std::string(strerror(errno)));
-        close(file_fd);
+    uint32_t lo_flags = LO_FLAGS_AUTOCLEAR;
+    if (read_only)
+        lo_flags |= LO_FLAGS_READ_ONLY;
+
+    bool attached = attach_loop_device(loop_fd, file_fd, lo_flags, image_block_size(file_fd));
+    close(file_fd);
+    if (!attached) {
         close(loop_fd);
         return -1;
     }
-    close(file_fd);
+
+    if (ioctl(loop_fd, BLKRASET, LOOP_READ_AHEAD_SECTORS) != 0) {
+        LOG_DEBUG("Failed to set loop read-ahead: " + std::string(strerror(errno)));
+    }
 
     struct loop_info64 info;
     memset(&info, 0, sizeof(info));
-    info.lo_flags = LO_FLAGS_AUTOCLEAR;
-    if (read_only)
-        info.lo_flags |= LO_FLAGS_READ_ONLY;
-
-    if (ioctl(loop_fd, LOOP_SET_STATUS64, &info) < 0) {
-        LOG_ERROR("Failed to set loop status: " + std::string(strerror(errno)));
-        ioctl(loop_fd, LOOP_CLR_FD, 0);
-        close(loop_fd);
-        return -1;
+    if (ioctl(loop_fd, LOOP_GET_STATUS64, &info) == 0) {
+        LOG_DEBUG(loop_path + " <- " + image_path + " (direct I/O " +
+                  ((info.lo_flags & LO_FLAGS_DIRECT_IO) ? "on" : "off") + ")");
     }
 
     return loop_fd;
 }
 
+uint64_t file_cached_bytes(const fs::path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    uint64_t cached = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t length = static_cast<size_t>(st.st_size);
+        void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            const size_t page = static_cast<size_t>(getpagesize());
+            std::vector<unsigned char> resident((length + page - 1) / page);
+            if (mincore(map, length, resident.data()) == 0) {
+                for (unsigned char r : resident)
+                    cached += (r & 1) ? page : 0;
+            }
+            munmap(map, length);
+        }
+    }
+    close(fd);
+    return cached;
+}
+
+bool find_image_loop(const fs::path& image_path, std::string& loop_name, bool& direct_io) {
+    std::error_code ec;
+    fs::path image = fs::weakly_canonical(image_path, ec);
+    if (ec)
+        image = image_path;
+
+    for (const auto& entry : fs::directory_iterator("/sys/block", ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, 4, "loop") != 0)
+            continue;
+
+        std::ifstream backing(entry.path() / "loop" / "backing_file");
+        std::string backing_file;
+        if (!std::getline(backing, backing_file) || fs::path(backing_file) != image)
+            continue;
+
+        std::ifstream dio(entry.path() / "loop" / "dio");
+        std::string value;
+        direct_io = std::getline(dio, value) && value == "1";
+        loop_name = name;
+        return true;
+    }
+    return false;
+}
+
 bool mount_image(const fs::path& image_path, const fs::path& target, const std::string& fs_type,
                  const std::string& options) {
     if (!ensure_dir_exists(target)) {
@@ -350,7 +539,8 @@ bool mount_image(const fs::path& image_path, const fs::path& target, const std::
 }
 
 // Run external binary via execve (no shell)
-static bool exec_run(const char* bin_path, const std::vector<const char*>& argv) {
+static bool exec_run(const char* bin_path, const std::vector<const char*>& argv,
+                     int max_status = 2) {
     pid_t pid = fork();
     if (pid < 0) {
         LOG_ERROR("fork failed: " + std::string(strerror(errno)));
@@ -373,7 +563,7 @@ static bool exec_run(const char* bin_path, const std::vector<const char*>& argv)
         LOG_ERROR("waitpid failed");
         return false;
     }
-    return WIFEXITED(status) && (WEXITSTATUS(status) <= 2);
+    return WIFEXITED(status) && (WEXITSTATUS(status) <= max_status);
 }
 
 bool repair_image(const fs::path& image_path) {
@@ -403,55 +593,574 @@ bool repair_image(const fs::path& image_path) {
     return true;
 }
 
+bool resize_image(const fs::path& image_path, uint64_t size_bytes) {
+    const char* resize_paths[] = {"/system/bin/resize2fs", "/sbin/resize2fs",
+                                  "/vendor/bin/resize2fs"};
+    const char* resize_bin = nullptr;
+    for (const auto& p : resize_paths) {
+        if (access(p, X_OK) == 0) {
+            resize_bin = p;
+            break;
+        }
+    }
+    if (!resize_bin) {
+        LOG_ERROR("resize2fs not found");
+        return false;
+    }
+
+    std::string path_str = image_path.string();
+    std::string size_str = std::to_string(size_bytes / 1024) + "K";
+    std::vector<const char*> argv = {resize_bin, path_str.c_str(), size_str.c_str(), nullptr};
+
+    if (!exec_run(resize_bin, argv, 0)) {
+        LOG_ERROR("resize2fs failed on " + path_str);
+        return false;
+    }
+    return true;
+}
+
 // returns false if the path relation cannot be determined, or if paths match
 bool is_subpath(const fs::path& path, const fs::path& base) {
     auto rel = fs::relative(path, base);
     return !rel.empty() && rel.native()[0] != '.';
 }
 
-static bool native_cp_r(const fs::path& src, const fs::path& dst) {
-    try {
-        LOG_DEBUG("native_cp_r: " + src.string() + " -> " + dst.string());
-
-        if (!fs::exists(dst)) {
-            fs::create_directories(dst);
-            fs::permissions(dst, fs::status(src).permissions());
-            lsetfilecon(dst, get_context_for_path(dst));
-        }
-
-        int count = 0;
-        for (const auto& entry : fs::directory_iterator(src)) {
-            auto dst_path = dst / entry.path().filename();
-            count++;
-
-            if (fs::is_directory(entry)) {
-                if (!fs::is_symlink(entry) || !is_subpath(fs::read_symlink(entry.path()), entry)) {
-                    if (!native_cp_r(entry.path(), dst_path)) {
-                        LOG_ERROR("Failed to copy dir: " + entry.path().string());
-                        return false;
-                    }
-                }
-            } else if (fs::is_symlink(entry)) {
-                auto link_target = fs::read_symlink(entry.path());
-                if (fs::exists(dst_path)) {
-                    fs::remove(dst_path);
-                }
-                fs::create_symlink(link_target, dst_path);
-                lsetfilecon(dst_path, get_context_for_path(dst_path));
-            } else {
-                fs::copy_file(entry.path(), dst_path, fs::copy_options::overwrite_existing);
-                fs::permissions(dst_path, fs::status(entry.path()).permissions());
-                lsetfilecon(dst_path, get_context_for_path(dst_path));
+namespace {
+
+class UringCopyBatch;
+
+// Path buffers shared by one sync_dir() walk. Names are appended on the way down and
+// truncated on the way up, so descending doesn't allocate per entry. Only the device
+// path is needed for labeling; the other two are kept for symlinks and error messages.
+struct CopyWalk {
+    std::string src_path;
+    std::string dst_path;
+    std::string device_path;
+    size_t count = 0;
+    UringCopyBatch* batch = nullptr;  // regular files go through io_uring when set
+
+    void push(const char* name) {
+        src_path.append("/").append(name);
+        dst_path.append("/").append(name);
+        device_path.append("/").append(name);
+    }
+    void pop(size_t src_len, size_t dst_len, size_t device_len) {
+        src_path.resize(src_len);
+        dst_path.resize(dst_len);
+        device_path.resize(device_len);
+    }
+};
+
+bool copy_fail(const CopyWalk& walk, const char* what) {
+    LOG_ERROR("native_cp_r: " + std::string(what) + " failed (" + walk.src_path + " -> " +
+              walk.dst_path + "): " + strerror(errno));
+    return false;
+}
+
+bool copy_fd_data(int in, int out) {
+    bool use_sendfile = true;
+    char buf[64 * 1024];
+    for (;;) {
+        if (use_sendfile) {
+            ssize_t n = sendfile(out, in, nullptr, 1 << 30);
+            if (n > 0)
+                continue;
+            if (n == 0)
+                return true;
+            if (errno != EINVAL && errno != ENOSYS)
+                return false;
+            use_sendfile = false;
+        }
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n == 0)
+            return true;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out, buf + off, n - off);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
             }
+            off += w;
         }
+    }
+}
+
+bool copy_file_at(int src_dir, int dst_dir, const char* name, CopyWalk& walk) {
+    int in = openat(src_dir, name, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return copy_fail(walk, "open");
+
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return copy_fail(walk, "stat");
+    }
+
+    // Break dedup hardlinks so the copy doesn't write through to other modules
+    struct stat dst_st;
+    if (fstatat(dst_dir, name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        (dst_st.st_nlink > 1 || S_ISLNK(dst_st.st_mode))) {
+        unlinkat(dst_dir, name, 0);
+    }
+
+    mode_t perms = st.st_mode & 07777;
+    int out = openat(dst_dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, perms);
+    if (out < 0) {
+        close(in);
+        return copy_fail(walk, "create");
+    }
+
+    bool ok = copy_fd_data(in, out) && fchmod(out, perms) == 0;
+    if (ok)
+        fsetfilecon(out, resolve_file_context(walk.device_path, S_IFREG));
+    else
+        copy_fail(walk, "copy");
+
+    close(in);
+    close(out);
+    return ok;
+}
+
+// Regular files queued from the open directories of a walk and copied through
+// io_uring in four submissions per batch: open+statx, create, linked read->write
+// for files that fit a buffer slot, close. Larger files, and short reads, are
+// copied with copy_fd_data() once both ends are open. Queued directory fds must
+// stay open until flush(), so the walk flushes before leaving each directory.
+class UringCopyBatch {
+public:
+    static constexpr size_t DEPTH = 32;
+    static constexpr size_t SLOT_SIZE = 64 * 1024;
+
+    explicit UringCopyBatch(Uring& ring) : ring_(ring), buffers_(new char[DEPTH * SLOT_SIZE]) {
+        jobs_.reserve(DEPTH);
+    }
+
+    bool add(int src_dir, int dst_dir, const char* name, const CopyWalk& walk) {
+        jobs_.emplace_back();
+        Job& job = jobs_.back();
+        job.src_dir = src_dir;
+        job.dst_dir = dst_dir;
+        job.name = name;
+        job.dst_path = walk.dst_path;
+        job.device_path = walk.device_path;
+        return jobs_.size() < DEPTH || flush();
+    }
 
-        LOG_DEBUG("Copied " + std::to_string(count) + " items from " + src.string());
+    bool flush();
+
+private:
+    struct Job {
+        int src_dir = -1;
+        int dst_dir = -1;
+        std::string name;
+        std::string dst_path;
+        std::string device_path;
+        int src_fd = -1;
+        int dst_fd = -1;
+        int src_stat_res = 0;
+        int dst_stat_res = 0;
+        struct statx src_stx;
+        struct statx dst_stx;
+        bool failed = false;
+    };
+
+    void fail(Job& job, const char* what, int err) {
+        errno = err;
+        LOG_ERROR("native_cp_r: " + std::string(what) + " failed (" + job.dst_path +
+                  ", io_uring): " + strerror(err));
+        job.failed = true;
+    }
+
+    Uring& ring_;
+    std::unique_ptr<char[]> buffers_;
+    std::vector<Job> jobs_;
+    std::vector<io_uring_cqe> cqes_;
+};
+
+bool UringCopyBatch::flush() {
+    if (jobs_.empty())
         return true;
-    } catch (const std::exception& e) {
-        LOG_ERROR("native_cp_r failed (" + src.string() + " -> " + dst.string() +
-                  "): " + std::string(e.what()));
+
+    const unsigned n = static_cast<unsigned>(jobs_.size());
+    bool ok = true;
+
+    // 1: open the source, stat it, and stat whatever is at the destination
+    for (unsigned i = 0; i < n; ++i) {
+        Job& job = jobs_[i];
+        io_uring_sqe* sqe = ring_.get_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = job.src_dir;
+        sqe->addr = reinterpret_cast<uint64_t>(job.name.c_str());
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = i * 3;
+
+        sqe = ring_.get_sqe();
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = job.src_dir;
+        sqe->addr = reinterpret_cast<uint64_t>(job.name.c_str());
+        sqe->len = STATX_MODE | STATX_SIZE;
+        sqe->off = reinterpret_cast<uint64_t>(&job.src_stx);
+        sqe->user_data = i * 3 + 1;
+
+        sqe = ring_.get_sqe();
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = job.dst_dir;
+        sqe->addr = reinterpret_cast<uint64_t>(job.name.c_str());
+        sqe->len = STATX_TYPE | STATX_NLINK;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->off = reinterpret_cast<uint64_t>(&job.dst_stx);
+        sqe->user_data = i * 3 + 2;
+    }
+    if (!ring_.submit_and_reap(n * 3, cqes_)) {
+        // Sources opened before the ring failed are only in the reaped CQEs
+        for (const auto& cqe : cqes_) {
+            if (cqe.user_data % 3 == 0 && cqe.res >= 0)
+                close(cqe.res);
+        }
+        cqes_.clear();
+        jobs_.clear();
         return false;
     }
+    for (const auto& cqe : cqes_) {
+        Job& job = jobs_[cqe.user_data / 3];
+        switch (cqe.user_data % 3) {
+        case 0:
+            job.src_fd = cqe.res;
+            break;
+        case 1:
+            job.src_stat_res = cqe.res;
+            break;
+        default:
+            job.dst_stat_res = cqe.res;
+            break;
+        }
+    }
+
+    // 2: create the destinations. Dedup hardlinks and symlinks are removed first
+    // so the copy doesn't write through to other modules.
+    cqes_.clear();
+    unsigned queued = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        Job& job = jobs_[i];
+        if (job.src_fd < 0) {
+            fail(job, "open", -job.src_fd);
+            continue;
+        }
+        if (job.src_stat_res < 0) {
+            fail(job, "stat", -job.src_stat_res);
+            continue;
+        }
+        if (job.dst_stat_res == 0 && (job.dst_stx.stx_nlink > 1 || S_ISLNK(job.dst_stx.stx_mode)))
+            unlinkat(job.dst_dir, job.name.c_str(), 0);
+
+        io_uring_sqe* sqe = ring_.get_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = job.dst_dir;
+        sqe->addr = reinterpret_cast<uint64_t>(job.name.c_str());
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+        sqe->len = job.src_stx.stx_mode & 07777;
+        sqe->user_data = i;
+        queued++;
+    }
+    // With nothing queued cqes_ stays empty rather than holding step 1's CQEs
+    if (queued > 0 && !ring_.submit_and_reap(queued, cqes_))
+        ok = false;
+    for (const auto& cqe : cqes_) {
+        Job& job = jobs_[cqe.user_data];
+        job.dst_fd = cqe.res;
+        if (cqe.res < 0)
+            fail(job, "create", -cqe.res);
+    }
+    cqes_.clear();
+
+    // 3: small files are read into their slot and written out by a linked SQE
+    queued = 0;
+    for (unsigned i = 0; ok && i < n; ++i) {
+        Job& job = jobs_[i];
+        uint64_t size = job.src_stx.stx_size;
+        if (job.failed || size == 0 || size > SLOT_SIZE)
+            continue;
+
+        char* slot = buffers_.get() + i * SLOT_SIZE;
+        io_uring_sqe* sqe = ring_.get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = job.src_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(slot);
+        sqe->len = static_cast<uint32_t>(size);
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = i * 2;
+
+        sqe = ring_.get_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = job.dst_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(slot);
+        sqe->len = static_cast<uint32_t>(size);
+        sqe->user_data = i * 2 + 1;
+        queued += 2;
+    }
+    if (queued > 0 && !ring_.submit_and_reap(queued, cqes_))
+        ok = false;
+
+    std::vector<bool> copied(n, false);
+    std::vector<unsigned> done(n, 0);
+    for (const auto& cqe : cqes_) {
+        unsigned i = static_cast<unsigned>(cqe.user_data / 2);
+        if (cqe.res >= 0 && static_cast<uint64_t>(cqe.res) == jobs_[i].src_stx.stx_size)
+            done[i]++;
+    }
+    for (unsigned i = 0; i < n; ++i)
+        copied[i] = done[i] == 2 || jobs_[i].src_stx.stx_size == 0;
+
+    // Everything else (large files, short reads) is copied synchronously
+    for (unsigned i = 0; ok && i < n; ++i) {
+        Job& job = jobs_[i];
+        if (job.failed)
+            continue;
+        if (!copied[i]) {
+            if (lseek(job.src_fd, 0, SEEK_SET) != 0 || ftruncate(job.dst_fd, 0) != 0 ||
+                lseek(job.dst_fd, 0, SEEK_SET) != 0 || !copy_fd_data(job.src_fd, job.dst_fd)) {
+                fail(job, "copy", errno);
+                continue;
+            }
+        }
+        // openat() applied the umask
+        if (fchmod(job.dst_fd, job.src_stx.stx_mode & 07777) != 0) {
+            fail(job, "chmod", errno);
+            continue;
+        }
+        fsetfilecon(job.dst_fd, resolve_file_context(job.device_path, S_IFREG));
+    }
+
+    // 4: close both ends
+    queued = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        Job& job = jobs_[i];
+        for (int fd : {job.src_fd, job.dst_fd}) {
+            if (fd < 0)
+                continue;
+            io_uring_sqe* sqe = ring_.get_sqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fd;
+            sqe->user_data = i;
+            queued++;
+        }
+        if (job.failed)
+            ok = false;
+    }
+    if (queued > 0 && !ring_.submit_and_reap(queued, cqes_)) {
+        // The ring is unusable; don't leak the descriptors
+        for (const auto& job : jobs_) {
+            if (job.src_fd >= 0)
+                close(job.src_fd);
+            if (job.dst_fd >= 0)
+                close(job.dst_fd);
+        }
+        ok = false;
+    }
+
+    jobs_.clear();
+    return ok;
+}
+
+bool copy_symlink_at(int src_dir, int dst_dir, const char* name, CopyWalk& walk) {
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(src_dir, name, target, sizeof(target) - 1);
+    if (len < 0)
+        return copy_fail(walk, "readlink");
+    target[len] = '\0';
+
+    struct stat dst_st;
+    if (fstatat(dst_dir, name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0) {
+        unlinkat(dst_dir, name, S_ISDIR(dst_st.st_mode) ? AT_REMOVEDIR : 0);
+    }
+    if (symlinkat(target, dst_dir, name) != 0)
+        return copy_fail(walk, "symlink");
+
+    // There is no fd to label a symlink through
+    lsetfilecon(walk.dst_path, resolve_file_context(walk.device_path, S_IFLNK));
+    return true;
+}
+
+// Whiteouts (0:0 char devices) and other special nodes are recreated, not read
+bool copy_node_at(int src_dir, int dst_dir, const char* name, CopyWalk& walk) {
+    struct stat st;
+    if (fstatat(src_dir, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return copy_fail(walk, "stat");
+
+    unlinkat(dst_dir, name, 0);
+    if (mknodat(dst_dir, name, st.st_mode, st.st_rdev) != 0)
+        return copy_fail(walk, "mknod");
+
+    lsetfilecon(walk.dst_path, resolve_file_context(walk.device_path, st.st_mode & S_IFMT));
+    return true;
+}
+
+bool copy_tree_at(int src_fd, int dst_fd, CopyWalk& walk);
+
+// Copy directory `name` (or a directory symlink, which is dereferenced as before)
+bool copy_dir_at(int src_dir, int dst_dir, const char* name, bool follow, CopyWalk& walk) {
+    int src_fd = openat(src_dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+    if (src_fd < 0)
+        return copy_fail(walk, "open dir");
+
+    bool created = mkdirat(dst_dir, name, 0700) == 0;
+    if (!created && errno != EEXIST) {
+        close(src_fd);
+        return copy_fail(walk, "mkdir");
+    }
+
+    int dst_fd = openat(dst_dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dst_fd < 0) {
+        close(src_fd);
+        return copy_fail(walk, "open dst dir");
+    }
+
+    if (created) {
+        struct stat st;
+        if (fstat(src_fd, &st) == 0)
+            fchmod(dst_fd, st.st_mode & 07777);
+        fsetfilecon(dst_fd, resolve_file_context(walk.device_path, S_IFDIR));
+    }
+
+    bool ok = copy_tree_at(src_fd, dst_fd, walk);
+    close(dst_fd);
+    return ok;
+}
+
+// Copy the contents of `src_fd` into `dst_fd`; takes ownership of `src_fd`
+bool copy_tree_at(int src_fd, int dst_fd, CopyWalk& walk) {
+    DIR* dir = fdopendir(src_fd);
+    if (!dir) {
+        close(src_fd);
+        return copy_fail(walk, "opendir");
+    }
+
+    const size_t src_len = walk.src_path.size();
+    const size_t dst_len = walk.dst_path.size();
+    const size_t device_len = walk.device_path.size();
+
+    bool ok = true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(dir)) != nullptr) {
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        walk.push(name);
+        walk.count++;
+
+        struct stat st;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                ok = copy_fail(walk, "stat");
+                break;
+            }
+            type = IFTODT(st.st_mode);
+        }
+
+        if (type == DT_DIR) {
+            ok = copy_dir_at(dirfd(dir), dst_fd, name, false, walk);
+        } else if (type == DT_LNK) {
+            if (fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t len = readlinkat(dirfd(dir), name, target, sizeof(target) - 1);
+                target[len < 0 ? 0 : len] = '\0';
+                if (!is_subpath(target, walk.src_path))
+                    ok = copy_dir_at(dirfd(dir), dst_fd, name, true, walk);
+            } else {
+                ok = copy_symlink_at(dirfd(dir), dst_fd, name, walk);
+            }
+        } else if (type == DT_REG) {
+            ok = walk.batch ? walk.batch->add(dirfd(dir), dst_fd, name, walk)
+                            : copy_file_at(dirfd(dir), dst_fd, name, walk);
+        } else {
+            ok = copy_node_at(dirfd(dir), dst_fd, name, walk);
+        }
+
+        walk.pop(src_len, dst_len, device_len);
+    }
+
+    // Queued files reference this directory's fds
+    if (walk.batch) {
+        bool flushed = walk.batch->flush();
+        ok = ok && flushed;
+    }
+
+    closedir(dir);
+    return ok;
+}
+
+}  // namespace
+
+static bool g_use_uring = false;
+
+static Uring& copy_ring() {
+    static Uring ring;
+    return ring;
+}
+
+std::string set_copy_engine(const std::string& name) {
+    g_use_uring = false;
+    if (name != "uring")
+        return "sync";
+
+    static const std::vector<uint8_t> ops = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                                             IORING_OP_WRITE, IORING_OP_CLOSE};
+    if (!copy_ring().init(128, ops)) {
+        LOG_WARN("io_uring unavailable (" + std::string(strerror(errno)) +
+                 "), using sync copy engine");
+        return "sync";
+    }
+    g_use_uring = true;
+    return "uring";
+}
+
+// Entries are labeled once from the compiled file_contexts as their on-device path,
+// so no separate context repair pass is needed. The walk holds directory fds and only
+// issues name-relative syscalls.
+static bool native_cp_r(const fs::path& src, const fs::path& dst) {
+    int src_fd = open(src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (src_fd < 0) {
+        LOG_ERROR("native_cp_r: cannot open " + src.string() + ": " + strerror(errno));
+        return false;
+    }
+    int dst_fd = open(dst.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dst_fd < 0) {
+        LOG_ERROR("native_cp_r: cannot open " + dst.string() + ": " + strerror(errno));
+        close(src_fd);
+        return false;
+    }
+
+    // sync_dir() creates the root itself. Like the directories below it, it takes the
+    // source's mode; it has no on-device path, so it gets the storage root's label.
+    struct stat st;
+    if (fstat(src_fd, &st) == 0)
+        fchmod(dst_fd, st.st_mode & 07777);
+    fsetfilecon(dst_fd, DEFAULT_SELINUX_CONTEXT);
+
+    CopyWalk walk;
+    std::unique_ptr<UringCopyBatch> batch;
+    if (g_use_uring) {
+        batch.reset(new UringCopyBatch(copy_ring()));
+        walk.batch = batch.get();
+    }
+    walk.src_path = src.string();
+    walk.dst_path = dst.string();
+    // `src` is a module root: its children map to "/system", "/vendor", ...
+    walk.device_path.reserve(PATH_MAX);
+
+    bool ok = copy_tree_at(src_fd, dst_fd, walk);
+    close(dst_fd);
+
+    LOG_DEBUG("Copied " + std::to_string(walk.count) + " items from " + src.string());
+    return ok;
 }
 
 bool sync_dir(const fs::path& src, const fs::path& dst) {
@@ -590,19 +1299,12 @@ struct NukeExt4SysfsCmd {
 };
 #endif // #ifdef __ANDROID__
 
-bool send_unmountable(const fs::path& target) {
-#ifdef __ANDROID__
-    static std::set<std::string> sent_unmounts;
-
-    std::string path_str = target.string();
-    if (path_str.empty())
-        return true;
-
-    // Dedup check
-    if (sent_unmounts.find(path_str) != sent_unmounts.end()) {
-        return true;
-    }
+static std::set<std::string> g_sent_unmounts;
+static bool g_unmount_batch = false;
+static std::vector<std::string> g_pending_unmounts;
 
+static bool add_try_umount(const std::string& path_str) {
+#ifdef __ANDROID__
     int fd = grab_ksu_fd();
     if (fd < 0) {
         return false;
@@ -612,15 +1314,170 @@ bool send_unmountable(const fs::path& target) {
         .arg = reinterpret_cast<uint64_t>(path_str.c_str()), .flags = 2, .mode = 1};
 
     if (ioctl(fd, KSU_IOCTL_ADD_TRY_UMOUNT, &cmd) == 0) {
-        sent_unmounts.insert(path_str);
+        g_sent_unmounts.insert(path_str);
         LOG_DEBUG("Registered unmountable path: " + path_str);
     } else {
         LOG_WARN("Failed to register unmountable path: " + path_str);
+        return false;
     }
 #endif // #ifdef __ANDROID__
     return true;
 }
 
+bool send_unmountable(const fs::path& target) {
+    std::string path_str = target.string();
+    if (path_str.empty())
+        return true;
+
+    // Dedup check
+    if (g_sent_unmounts.find(path_str) != g_sent_unmounts.end()) {
+        return true;
+    }
+
+    if (g_unmount_batch) {
+        g_pending_unmounts.push_back(path_str);
+        return true;
+    }
+
+    add_try_umount(path_str);
+    return true;
+}
+
+void begin_unmountable_batch() {
+    g_unmount_batch = true;
+}
+
+namespace {
+
+struct MountEntry {
+    int id;
+    int parent;
+    std::string mount_point;
+};
+
+// mountinfo escapes space, tab, newline and backslash as \ooo
+std::string unescape_mountinfo(const std::string& field) {
+    std::string out;
+    out.reserve(field.size());
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] == '\\' && i + 3 < field.size() && isdigit(field[i + 1]) &&
+            isdigit(field[i + 2]) && isdigit(field[i + 3])) {
+            out += static_cast<char>((field[i + 1] - '0') * 64 + (field[i + 2] - '0') * 8 +
+                                     (field[i + 3] - '0'));
+            i += 3;
+        } else {
+            out += field[i];
+        }
+    }
+    return out;
+}
+
+bool read_mount_entries(std::vector<MountEntry>& entries) {
+    std::ifstream mountinfo("/proc/self/mountinfo");
+    if (!mountinfo.is_open())
+        return false;
+
+    std::string line;
+    while (std::getline(mountinfo, line)) {
+        std::istringstream ss(line);
+        MountEntry entry;
+        std::string dev, root, mount_point;
+        if (ss >> entry.id >> entry.parent >> dev >> root >> mount_point) {
+            entry.mount_point = unescape_mountinfo(mount_point);
+            entries.push_back(std::move(entry));
+        }
+    }
+    return !entries.empty();
+}
+
+// Drops paths whose mounts all sit below a mount at another queued path:
+// try_umount detaches with MNT_DETACH, which takes the whole subtree along.
+// Paths that aren't mount points at all have nothing to unmount.
+std::vector<std::string> collapse_unmountables(const std::vector<std::string>& paths) {
+    std::vector<MountEntry> entries;
+    if (!read_mount_entries(entries))
+        return paths;
+
+    std::map<int, const MountEntry*> by_id;
+    std::map<std::string, std::vector<const MountEntry*>> by_point;
+    for (const auto& entry : entries) {
+        by_id[entry.id] = &entry;
+        by_point[entry.mount_point].push_back(&entry);
+    }
+
+    std::set<int> queued_ids;
+    for (const auto& path : paths) {
+        auto it = by_point.find(path);
+        if (it == by_point.end())
+            continue;
+        for (const MountEntry* entry : it->second)
+            queued_ids.insert(entry->id);
+    }
+
+    auto covered = [&](const MountEntry* entry) {
+        std::set<int> seen;
+        auto parent = by_id.find(entry->parent);
+        while (parent != by_id.end() && seen.insert(parent->first).second) {
+            const MountEntry* ancestor = parent->second;
+            if (ancestor->mount_point != entry->mount_point && queued_ids.count(ancestor->id))
+                return true;
+            parent = by_id.find(ancestor->parent);
+        }
+        return false;
+    };
+
+    std::vector<std::string> result;
+    for (const auto& path : paths) {
+        auto it = by_point.find(path);
+        if (it == by_point.end()) {
+            LOG_DEBUG("Not a mount point, skipping try_umount: " + path);
+            continue;
+        }
+        bool all_covered = true;
+        for (const MountEntry* entry : it->second) {
+            if (!covered(entry)) {
+                all_covered = false;
+                break;
+            }
+        }
+        if (all_covered)
+            LOG_DEBUG("Covered by an ancestor try_umount: " + path);
+        else
+            result.push_back(path);
+    }
+    return result;
+}
+
+}  // namespace
+
+size_t flush_unmountables() {
+    if (!g_unmount_batch)
+        return 0;
+    g_unmount_batch = false;
+
+    std::vector<std::string> unique;
+    std::set<std::string> seen;
+    for (const auto& path : g_pending_unmounts) {
+        std::string normal = fs::path(path).lexically_normal().string();
+        if (normal.size() > 1 && normal.back() == '/')
+            normal.pop_back();
+        if (seen.insert(normal).second)
+            unique.push_back(normal);
+    }
+    g_pending_unmounts.clear();
+
+    std::vector<std::string> minimal = collapse_unmountables(unique);
+    size_t sent = 0;
+    for (const auto& path : minimal) {
+        if (add_try_umount(path))
+            sent++;
+    }
+
+    LOG_INFO("try_umount: " + std::to_string(sent) + " mount points registered (" +
+             std::to_string(unique.size()) + " requested)");
+    return sent;
+}
+
 bool ksu_nuke_sysfs(const std::string& target) {
 #ifdef __ANDROID__
     int fd = grab_ksu_fd();
@@ -1,8 +1,10 @@
 // utils.hpp - Utility functions
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <memory>
+#include <mutex>
 #include <string>
 
 namespace fs = std::filesystem;
@@ -21,6 +23,7 @@ private:
     bool debug_ = false;
     bool verbose_ = false;
     std::unique_ptr<std::ofstream> log_file_;
+    std::mutex mutex_;  // log() is called from worker threads
 };
 
 #define LOG_INFO(msg) Logger::getInstance().log("INFO", msg)
@@ -34,23 +37,43 @@ bool ensure_dir_exists(const fs::path& path);
 bool is_xattr_supported(const fs::path& path);
 bool lsetfilecon(const fs::path& path, const std::string& context);
 std::string lgetfilecon(const fs::path& path);
+// fd variants for walkers that hold directory fds; symlinks still need lsetfilecon()
+bool fsetfilecon(int fd, const std::string& context);
+std::string fgetfilecon(int fd);
 std::string get_context_for_path(const fs::path& path);
 bool copy_path_context(const fs::path& src, const fs::path& dst);
 
-bool mount_tmpfs(const fs::path& target, const char* source = nullptr);
+bool mount_tmpfs(const fs::path& target, const char* source = nullptr, uint64_t size = 0);
 bool mount_image(const fs::path& image_path, const fs::path& target,
                  const std::string& fs_type = "ext4",
                  const std::string& options = "loop,rw,noatime");
 bool repair_image(const fs::path& image_path);
+// resize2fs the ext4 filesystem in `image_path` (an image file, or the loop device
+// of a mounted one) to `size_bytes`
+bool resize_image(const fs::path& image_path, uint64_t size_bytes);
+// Bytes of `path` resident in the page cache
+uint64_t file_cached_bytes(const fs::path& path);
+// Loop device (e.g. "loop3") backing `image_path`, and whether it does direct I/O
+bool find_image_loop(const fs::path& image_path, std::string& loop_name, bool& direct_io);
+// Copy a module tree; entries are labeled as their on-device paths below `src`
 bool sync_dir(const fs::path& src, const fs::path& dst);
+// Select the sync_dir() file copy engine: "sync" (default) or "uring". Falls back to
+// "sync" when io_uring is unavailable; returns the engine actually in use.
+std::string set_copy_engine(const std::string& name);
 bool has_files_recursive(const fs::path& path);
 bool check_tmpfs_xattr();
+// True if `path` resolves to somewhere below `base`
+bool is_subpath(const fs::path& path, const fs::path& base);
 
 // EROFS support
 bool is_erofs_supported();
 
 // KSU utilities
 bool send_unmountable(const fs::path& target);
+// Between these calls send_unmountable() only queues; the flush sends the minimal
+// set of top-level mount points (children go with their ancestor) and returns its size
+void begin_unmountable_batch();
+size_t flush_unmountables();
 bool ksu_nuke_sysfs(const std::string& target);
 int grab_ksu_fd();
 
@@ -83,6 +83,14 @@ export type MountStatistics = {
   dirs_mounted: number
   symlinks_created: number
   overlayfs_mounts: number
+  mirror_binds?: number
+  mounts_added?: number
+  tree_nodes?: number
+  tree_kib?: number
+  program_ops?: number
+  attr_clones?: number
+  program_cached?: boolean
+  attr_syscalls?: number
   success_rate?: number
 }
 